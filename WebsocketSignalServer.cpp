@@ -5,53 +5,143 @@
 #include <fstream>
 #include "signal_server.h"
 #include "message_queue.h"
+#include "server_config.h"
+#include "server_stats.h"
+#include "journal.h"
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/exceptions.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/sinks/text_file_backend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/bounded_fifo_queue.hpp>
+#include <boost/log/sinks/drop_on_overflow.hpp>
+#include <boost/log/sinks/block_on_overflow.hpp>
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/log/utility/setup/console.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
 #include <boost/log/sources/severity_channel_logger.hpp>
 #include <boost/log/sources/record_ostream.hpp>
 #include <boost/log/support/date_time.hpp>
+#include <boost/core/null_deleter.hpp>
+#include <boost/make_shared.hpp>
 
 #include "json/json.h"
 #include <thread>
+#include <climits>
+#include <cstdlib>
 
 #define DAEMON "daemon"
 #define STOP "stop"
 #define START "start"
 #define SERVICE "service"
+#define DRAIN "drain"
+#define LOG_LEVEL "log_level"
+#define STATS "stats"
+#define TOP "top"
+#define DUMP_STATS "dump_stats"
+#define PEERS "peers"
+#define RELOAD_CONFIG "reload_config"
+#define RELOAD_CERTS "reload_certs"
+#define KICK "kick"
+#define PAUSE "pause"
+#define RESUME "resume"
 
-#define FILTER_DEBUG "debug"
-#define FILTER_INFO "info"
-#define FILTER_WARNING "warning"
-#define FILTER_ERROR "error"
-#define FILTER_FATAL "fatal"
+#define REQUEST_TIMEOUT 3000
+#define TOP_INTERVAL 1000
+
+#define TAKEOVER "--takeover"
 
+#define FILTER_INFO "info"
 
 #define LOG_CONSOLE 0
 #define LOG_FILE_USER 1
 #define LOG_FILE_SERVICE 2
 
+#define LOG_OVERFLOW_DROP "drop"
+#define LOG_OVERFLOW_BLOCK "block"
+#define LOG_QUEUE_RECORDS 8192
+
+#define JOURNAL_FILE "wsSignalServer.journal"
+#define JOURNAL_RECORDS (1 << 18)
+
 extern int start_ssl();
 
-void init_log(int type,int filter)
+// the running async sink, and how to rebuild it in a forked worker
+std::function<void()> g_stop_log;
+std::function<void()> g_restart_log;
+
+boost::log::formatter log_format()
+{
+  namespace expr = boost::log::expressions;
+  return expr::stream
+         << expr::format_date_time<boost::posix_time::ptime>("TimeStamp", "[%m/%d %H:%M:%S]")
+         << "[" << boost::log::trivial::severity
+         << "] " << expr::smessage;
+}
+
+// records are written by the sink's own thread, a full queue drops or
+// blocks as Queue says
+template <typename Queue, typename Backend>
+void add_async_sink(const boost::shared_ptr<Backend>& backend)
+{
+  typedef boost::log::sinks::asynchronous_sink<Backend, Queue> sink_t;
+  boost::shared_ptr<sink_t> sink = boost::make_shared<sink_t>(backend);
+  sink->set_formatter(log_format());
+  boost::log::core::get()->add_sink(sink);
+  g_stop_log = [sink]() {
+    boost::log::core::get()->remove_sink(sink);
+    sink->stop();
+    sink->flush();
+  };
+  g_restart_log = [sink, backend]() {
+    // a forked child has no feeding thread, stopping or destroying the sink
+    // would wait for it forever, so it is left alone
+    boost::log::core::get()->remove_sink(sink);
+    new boost::shared_ptr<sink_t>(sink);
+    add_async_sink<Queue>(backend);
+  };
+}
+
+template <typename Backend>
+void add_async_sink(const boost::shared_ptr<Backend>& backend, bool block)
+{
+  namespace sinks = boost::log::sinks;
+  if (block)
+    add_async_sink<sinks::bounded_fifo_queue<LOG_QUEUE_RECORDS,
+                                             sinks::block_on_overflow> >(backend);
+  else
+    add_async_sink<sinks::bounded_fifo_queue<LOG_QUEUE_RECORDS,
+                                             sinks::drop_on_overflow> >(backend);
+}
+
+// writes out what is queued, call before the process exits
+void stop_log()
+{
+  if (g_stop_log)
+    g_stop_log();
+  g_stop_log = nullptr;
+}
+
+// in a worker just forked
+void restart_log()
+{
+  std::function<void()> restart = g_restart_log;
+  if (restart)
+    restart();
+}
+
+void init_log(int type,int filter,bool block)
 {
   namespace keyword = boost::log::keywords;
   namespace sinks = boost::log::sinks;
-  namespace expr = boost::log::expressions;
   if (type == LOG_CONSOLE)
   {
-    boost::log::add_console_log(
-        std::clog,
-        keyword::format =
-            (expr::stream
-             << expr::format_date_time<boost::posix_time::ptime>("TimeStamp", "[%m/%d %H:%M:%S]")
-             << "[" << boost::log::trivial::severity
-             << "] " << expr::smessage));
+    auto backend = boost::make_shared<sinks::text_ostream_backend>();
+    backend->add_stream(boost::shared_ptr<std::ostream>(&std::clog, boost::null_deleter()));
+    backend->auto_flush(true);
+    add_async_sink(backend, block);
   }
   else
   {
@@ -60,28 +150,63 @@ void init_log(int type,int filter)
 
     std::strftime(tbuffer, sizeof(tbuffer), (type == LOG_FILE_USER) ? "log/wsSignalServer_%Y%m%d.%H%M%S" : "/root/log/wsSignalServer_%Y%m%d.%H%M%S",
                   std::localtime(&t));
-    boost::log::add_file_log(
+    auto backend = boost::make_shared<sinks::text_file_backend>(
         keyword::file_name = strcat(tbuffer, "_%N.log"),
         keyword::rotation_size = 10 * 1024 * 1024,
-        keyword::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0),
-        keyword::format =
-            (expr::stream
-             << expr::format_date_time<boost::posix_time::ptime>("TimeStamp", "[%m/%d %H:%M:%S]")
-             << "[" << boost::log::trivial::severity
-             << "] " << expr::smessage));
+        keyword::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0));
+    // flushed by the sink's thread, records reach the file as they are written
+    backend->auto_flush(true);
+    add_async_sink(backend, block);
   }
 
-  boost::log::core::get()->set_filter(
-          boost::log::trivial::severity >= filter
-  );
+  SetLogFilter(static_cast<boost::log::trivial::severity_level>(filter));
   boost::log::add_common_attributes();
 }
 
 
-int listen(int port)
+int listen(int port, bool takeover, int drain_deadline, int workers,
+           int worker_peers, const std::string& journal_file,
+           uint64_t journal_records)
 {
+  StatsSegment stats(workers > 1 ? workers : 1);
+  // workers and a process taking over all append to the same ring
+  std::unique_ptr<EventJournal> journal;
+  if (!journal_file.empty())
+  {
+    journal.reset(new EventJournal(journal_file, journal_records));
+    if (journal->IsOpen())
+      g_journal = journal.get();
+  }
+  if (workers > 1)
+  {
+    // each worker binds the ports itself, there is nothing to take over
+    WorkerGroup group(workers, worker_peers);
+    int result = group.Run([&](int index) {
+      restart_log();
+      stats.Attach(index);
+      if (g_journal)
+        g_journal->Attach();
+      std::string queue = WorkerGroup::QueueName(index);
+      SignalServer server(queue.c_str());
+      server.JoinWorkers(&group);
+      server.Listen(port,9002);
+      stop_log();
+      return 0;
+    });
+    stop_log();
+    return result;
+  }
+
+  // take the listen sockets of a running server before our own control
+  // queue replaces its one
+  listen_fds fds;
+  if (takeover)
+    TakeOverListenSockets(fds, drain_deadline);
+
   SignalServer server;
+  server.Inherit(fds);
   server.Listen(port,9002);
+  stop_log();
   return 0;
 }
 
@@ -93,6 +218,14 @@ public:
     }
   }
 
+  bool has(const std::string& flag) {
+    for (const auto& arg : m_arg_list) {
+      if (arg == flag)
+        return true;
+    }
+    return false;
+  }
+
   std::string get(const std::string& command,const char* def) {
     for (int i = 0; i < m_arg_list.size(); i++) {
       if (m_arg_list[i] == command && i+1 < m_arg_list.size()) {
@@ -106,6 +239,90 @@ private:
   std::vector<std::string> m_arg_list;
 };
 
+// sends a runtime command to the running server and prints its reply
+int request(int command, int arg = 0, const std::string& text = std::string())
+{
+  control_message msg;
+  msg.command = command;
+  msg.arg = arg;
+  msg.text = text;
+  std::string reply;
+  if (!MessageQueue(false).Request(msg, reply, REQUEST_TIMEOUT))
+  {
+    std::cout << "no reply from the server\n";
+    return 1;
+  }
+  std::cout << reply;
+  return 0;
+}
+
+// reads the stats segment, top refreshes it until interrupted
+int show_stats(bool top)
+{
+  std::vector<StatsSnapshot> before;
+  std::vector<StatsSnapshot> now;
+  int pid = 0;
+  if (!StatsSegment::Read(now, pid))
+  {
+    std::cout << "no server publishes stats\n";
+    return 1;
+  }
+  if (!top)
+  {
+    StatsSegment::Write(std::cout, now);
+    return 0;
+  }
+
+  auto last = std::chrono::steady_clock::now();
+  do
+  {
+    auto time = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(time - last).count();
+    last = time;
+    // clear the terminal and start at its top
+    std::cout << "\033[H\033[2J" << "wsSignalServer " << pid << "\n\n";
+    StatsSegment::Write(std::cout, now, &before, seconds);
+    std::cout.flush();
+    before.swap(now);
+    std::this_thread::sleep_for(std::chrono::milliseconds(TOP_INTERVAL));
+  } while (StatsSegment::Read(now, pid));
+  return 0;
+}
+
+// the -c commands that talk to a running server, -1 for the others
+int control(const std::string& command, arg_option& opt)
+{
+  if (command == LOG_LEVEL)
+    return request(MQ_LOG_LEVEL, 0, opt.get("-l", FILTER_INFO));
+  if (command == STATS || command == TOP)
+    return show_stats(command == TOP);
+  if (command == DUMP_STATS)
+    return request(MQ_STATS);
+  if (command == PEERS)
+    return request(MQ_PEERS);
+  if (command == RELOAD_CONFIG)
+  {
+    // the server may run in another directory
+    std::string file = opt.get("-f", "config.json");
+    char path[PATH_MAX];
+    if (!realpath(file.c_str(), path))
+    {
+      std::cout << "cannot find " << file << "\n";
+      return 1;
+    }
+    return request(MQ_RELOAD_CONFIG, 0, path);
+  }
+  if (command == RELOAD_CERTS)
+    return request(MQ_RELOAD_CERTS);
+  if (command == KICK)
+    return request(MQ_KICK, atoi(opt.get("-n", "-1").data()));
+  if (command == PAUSE)
+    return request(MQ_PAUSE_ACCEPT, 1);
+  if (command == RESUME)
+    return request(MQ_PAUSE_ACCEPT, 0);
+  return -1;
+}
+
 
 int main(int argc,char* argv[])
 {
@@ -114,8 +331,22 @@ int main(int argc,char* argv[])
 
   std::string command = opt.get("-c",START);
   std::string log_filter = opt.get("-l",FILTER_INFO);
+  std::string log_overflow = LOG_OVERFLOW_DROP;
   std::string ice_server = opt.get("-i", "turn:115.231.220.242:8101?transport=tcp [ts1:12345678]");
   std::string json_file = opt.get("-f", "config.json");
+  int drain_deadline = atoi(opt.get("-d", "30000").data());
+  bool takeover = opt.has(TAKEOVER);
+  int workers = atoi(opt.get("-w", "1").data());
+  int worker_peers = WorkerGroup::kDefaultPeers;
+  std::string journal_file = JOURNAL_FILE;
+  uint64_t journal_records = JOURNAL_RECORDS;
+
+  // before the config file, whose "command" is the one to start with
+  int result = control(command, opt);
+  if (result >= 0)
+    return result;
+
+  ParseIceServer(ice_server, g_ice_server);
 
   if (json_file != "")
   {
@@ -132,46 +363,46 @@ int main(int argc,char* argv[])
           port = value["port"].asInt();
         if (value.isMember("log_filter"))
           log_filter = value["log_filter"].asString();
-        if (value.isMember("ice_server"))
-          ice_server = value["ice_server"].asString();
+        if (value.isMember("log_overflow"))
+          log_overflow = value["log_overflow"].asString();
+        if (value.isMember("workers"))
+          workers = value["workers"].asInt();
+        if (value.isMember("worker_peers"))
+          worker_peers = value["worker_peers"].asInt();
+        if (value.isMember("journal_file"))
+          journal_file = value["journal_file"].asString();
+        if (value.isMember("journal_records"))
+          journal_records = value["journal_records"].asUInt64();
+        std::string error;
+        if (value.isMember("listeners") && !ApplyListenConfig(value["listeners"], error))
+        {
+          std::cout << json_file << ": " << error << "\n";
+          return 1;
+        }
+        if (!ApplyRuntimeConfig(value, error))
+        {
+          std::cout << json_file << ": " << error << "\n";
+          return 1;
+        }
       }
     }
 
   }
 
-  if (!ice_server.empty())
+  // each worker binds the ports itself, there is nothing to hand over
+  if (takeover && workers > 1)
   {
-    std::cout << ice_server << "\n";
-    // "turn:115.231.220.242:8101?transport=tcp [ts1:12345678]"
-    size_t ef = ice_server.find(' ');
-    const auto NP = std::string::npos;
-    if (ef != NP)
-    {
-      g_ice_server.uri = ice_server.substr(0, ef);
-      ice_server = ice_server.substr(ef);
-      auto i1 = ice_server.find('[');
-      auto i2 = ice_server.find(']');
-      auto i3 = ice_server.find(':');
-
-      if (i1 != NP && i2 != NP && i3 != NP)
-      {
-        g_ice_server.username = ice_server.substr(i1 + 1, i3 - i1 - 1);
-        g_ice_server.password = ice_server.substr(i3 + 1, i2 - i3 - 1);
-      }
-    }
+    std::cout << TAKEOVER << " does not work with " << workers
+              << " workers, run a single process to take over\n";
+    return 1;
   }
 
+  std::cout << g_ice_server.uri << " [" << g_ice_server.username << ":"
+            << g_ice_server.password << "]\n";
+
   boost::log::trivial::severity_level filter = boost::log::trivial::info;
-  if (log_filter == FILTER_DEBUG)
-    filter = boost::log::trivial::debug;
-  else if(log_filter == FILTER_INFO)
-    filter = boost::log::trivial::info;
-  else if(log_filter == FILTER_WARNING)
-    filter = boost::log::trivial::warning;
-  else if(log_filter == FILTER_ERROR)
-    filter = boost::log::trivial::error;
-  else if(log_filter == FILTER_FATAL)
-    filter = boost::log::trivial::fatal;
+  ParseSeverity(log_filter, filter);
+  bool log_block = log_overflow == LOG_OVERFLOW_BLOCK;
 
   if (command == DAEMON) {
 #ifndef WIN32
@@ -179,30 +410,34 @@ int main(int argc,char* argv[])
       std::cout << "daemon error\n";
       exit(-1);
     } else {
-      init_log(LOG_FILE_USER,filter);
-      return listen(port);
+      init_log(LOG_FILE_USER,filter,log_block);
+      return listen(port, takeover, drain_deadline, workers, worker_peers, journal_file, journal_records);
     };
 #else
-    init_log(false,filter);
-    return listen(port);
+    init_log(false,filter,log_block);
+    return listen(port, takeover, drain_deadline, workers, worker_peers, journal_file, journal_records);
 #endif
   }else if(command == START) {
-    init_log(LOG_CONSOLE,filter);
+    init_log(LOG_CONSOLE,filter,log_block);
     BOOST_LOG_TRIVIAL(info) << "";
-    return listen(port);
+    return listen(port, takeover, drain_deadline, workers, worker_peers, journal_file, journal_records);
   }else if(command == STOP) {
     MessageQueue queue(false);
     queue.SendExitMessage();
     return 0;
+  }else if(command == DRAIN) {
+    MessageQueue queue(false);
+    queue.SendMessage(MQ_DRAIN, drain_deadline);
+    return 0;
   } else if(command == SERVICE){
 #ifndef WIN32
     if (-1 == daemon(1, 1)) {
       std::cout << "daemon error\n";
       exit(-1);
     } else {
-    init_log(LOG_FILE_SERVICE,filter);
+    init_log(LOG_FILE_SERVICE,filter,log_block);
 
-    return listen(port);
+    return listen(port, takeover, drain_deadline, workers, worker_peers, journal_file, journal_records);
     }
 #else
   return -1;
@@ -0,0 +1,176 @@
+// dispatch_bench: how long the frames of well-behaved peers wait for the
+// dispatch thread while one peer floods it, with fair_queue against the
+// single FIFO it replaced
+//
+//   dispatch_bench [seconds]
+//
+// The dispatch thread is simulated: time only advances by the cost of each
+// frame served (a fixed part and a part per payload byte), so the numbers
+// depend on the scheduling alone and are the same on every run. The well
+// behaved peers send a candidate every 20ms and sign in again every 2s; the
+// abusive one sends frames back to back, four times what the thread serves.
+// "queued" is the most frames waiting at once, "served" the frames of the
+// well-behaved peers the thread got to.
+
+#include "../fair_queue.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+  const int kPeers = 200;
+  const int64_t kCandidateEvery = 20000;   // us
+  const int64_t kSignInEvery = 2000000;    // us
+  const size_t kCandidateBytes = 300;
+  const size_t kSdpBytes = 4096;
+  const size_t kSignInBytes = 60;
+  const int kAbuser = kPeers;
+  const int kFlood = 4;                    // times what the thread serves
+
+  // us the dispatch thread spends on a frame
+  double Cost(size_t bytes) { return 2.0 + bytes * 0.001; }
+
+  struct frame
+  {
+    int conn;
+    bool control;
+    size_t bytes;
+    double arrived;
+  };
+
+  // the frames of the well-behaved peers in arrival order
+  std::vector<frame> Arrivals(int64_t duration)
+  {
+    std::vector<frame> arrivals;
+    for (int peer = 0; peer < kPeers; ++peer)
+    {
+      // spread over the period, not all at once
+      int64_t offset = peer * kCandidateEvery / kPeers;
+      for (int64_t t = offset; t < duration; t += kCandidateEvery)
+        arrivals.push_back({peer, false, kCandidateBytes, double(t)});
+      for (int64_t t = offset * 97 % kSignInEvery; t < duration;
+           t += kSignInEvery)
+        arrivals.push_back({peer, true, kSignInBytes, double(t)});
+    }
+    std::sort(arrivals.begin(), arrivals.end(),
+              [](const frame& a, const frame& b) { return a.arrived < b.arrived; });
+    return arrivals;
+  }
+
+  // the old m_actions: control and bulk frames in one unbounded FIFO
+  class fifo
+  {
+  public:
+    bool push_control(int, frame f) { m_items.push_back(f); return true; }
+    bool push(int, frame f, size_t) { m_items.push_back(f); return true; }
+    bool empty() const { return m_items.empty(); }
+    size_t size() const { return m_items.size(); }
+    frame pop()
+    {
+      frame f = m_items.front();
+      m_items.pop_front();
+      return f;
+    }
+
+  private:
+    std::deque<frame> m_items;
+  };
+
+  struct result
+  {
+    std::vector<double> bulk;     // waits of the well-behaved peers, us
+    std::vector<double> control;
+    size_t shed = 0;              // frames of well-behaved peers shed
+    size_t peak = 0;              // most frames queued at once
+  };
+
+  // abuser_control: the flood is of sign_in frames instead of SDPs
+  template <typename Queue>
+  result Run(Queue& queue, int64_t duration, bool abuser_control)
+  {
+    std::vector<frame> arrivals = Arrivals(duration);
+    size_t abuser_bytes = abuser_control ? kSignInBytes : kSdpBytes;
+    double abuser_every = Cost(abuser_bytes) / kFlood;
+    double abuser_next = 0;
+    size_t next = 0;
+    double now = 0;
+    result r;
+    while (now < duration)
+    {
+      for (; next < arrivals.size() && arrivals[next].arrived <= now; ++next)
+      {
+        const frame& f = arrivals[next];
+        bool queued = f.control ? queue.push_control(f.conn, f)
+                                : queue.push(f.conn, f, f.bytes);
+        r.shed += !queued;
+      }
+      for (; abuser_next <= now; abuser_next += abuser_every)
+      {
+        frame f = {kAbuser, abuser_control, abuser_bytes, abuser_next};
+        if (abuser_control)
+          queue.push_control(kAbuser, f);
+        else
+          queue.push(kAbuser, f, f.bytes);
+      }
+      r.peak = std::max(r.peak, queue.size());
+      if (queue.empty())
+      {
+        now = std::min(abuser_next,
+                       next < arrivals.size() ? arrivals[next].arrived
+                                              : double(duration));
+        continue;
+      }
+      frame f = queue.pop();
+      if (f.conn != kAbuser)
+        (f.control ? r.control : r.bulk).push_back(now - f.arrived);
+      now += Cost(f.bytes);
+    }
+    return r;
+  }
+
+  double Percentile(std::vector<double>& waits, double p)
+  {
+    if (waits.empty())
+      return 0;
+    size_t i = std::min(waits.size() - 1, size_t(p * waits.size()));
+    std::nth_element(waits.begin(), waits.begin() + i, waits.end());
+    return waits[i];
+  }
+
+  void Print(const std::string& name, result r)
+  {
+    size_t served = r.bulk.size() + r.control.size();
+    std::cout << std::left << std::setw(22) << name << std::right
+              << std::setw(10) << Percentile(r.bulk, 0.5)
+              << std::setw(12) << Percentile(r.bulk, 0.99)
+              << std::setw(12) << Percentile(r.control, 0.99)
+              << std::setw(8) << r.shed << std::setw(10) << r.peak
+              << std::setw(10) << served << "\n";
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int64_t duration = (argc > 1 ? std::atoi(argv[1]) : 2) * int64_t(1000000);
+  std::cout << kPeers << " peers, one flooding at " << kFlood
+            << "x capacity, waits in us\n\n"
+            << std::left << std::setw(22) << "" << std::right << std::setw(10)
+            << "p50" << std::setw(12) << "p99" << std::setw(12)
+            << "sign_in p99" << std::setw(8) << "shed" << std::setw(10)
+            << "queued" << std::setw(10) << "served" << "\n"
+            << std::fixed << std::setprecision(0);
+  for (bool control : {false, true})
+  {
+    std::cout << (control ? "flood of sign_in\n" : "flood of SDPs\n");
+    fifo old_queue;
+    Print("  fifo", Run(old_queue, duration, control));
+    fair_queue<frame, int> queue(256, 4096, 4);
+    Print("  fair_queue", Run(queue, duration, control));
+  }
+  return 0;
+}
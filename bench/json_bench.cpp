@@ -0,0 +1,271 @@
+// json_bench: routing a signalling frame with the event reader against
+// building its DOM, and the DOM round trip with fresh reader and writer
+// objects against the per thread JsonContext
+//
+//   json_bench [iterations]
+//
+// Every frame is routed both ways, the times are per frame. Before timing,
+// each frame is also fed in every split into two fragments and in one byte
+// fragments, and must give the same events as when fed whole.
+
+#include "../json_context.h"
+#include <json/reader.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+  // the fields SignalServer routes a "message" by, see SignalScanner
+  class RouteHandler : public Json::EventHandler
+  {
+  public:
+    bool number(const Json::Value& value) override
+    {
+      if (m_depth == 1 && m_field == "to")
+        m_to = value.asInt();
+      return Next();
+    }
+    bool string(const char* begin, const char* end) override
+    {
+      if (m_depth == 1 && m_field == "signal")
+        m_signal.assign(begin, end);
+      else if (m_depth == 1 && m_field == "type")
+        m_type.assign(begin, end);
+      return Next();
+    }
+    bool null() override { return Next(); }
+    bool boolean(bool) override { return Next(); }
+    bool startObject() override { ++m_depth; return Next(); }
+    bool endObject() override { --m_depth; return Next(); }
+    bool startArray() override { ++m_depth; return Next(); }
+    bool endArray() override { --m_depth; return Next(); }
+    bool key(const char* begin, const char* end) override
+    {
+      if (m_depth == 1)
+        m_field.assign(begin, end);
+      return true;
+    }
+
+    int m_to = -1;
+    std::string m_signal;
+    std::string m_type;
+
+  private:
+    bool Next()
+    {
+      return !(m_depth == 1 && m_to >= 0 && !m_signal.empty()
+               && !m_type.empty());
+    }
+
+    int m_depth = 0;
+    std::string m_field;
+  };
+
+  // every event as text, to compare whole and fragmented reads
+  class RecordHandler : public Json::EventHandler
+  {
+  public:
+    bool null() override { return Add("n"); }
+    bool boolean(bool value) override { return Add(value ? "t" : "f"); }
+    bool number(const Json::Value& value) override
+    {
+      return Add("#" + value.asString());
+    }
+    bool string(const char* begin, const char* end) override
+    {
+      return Add("s" + std::string(begin, end));
+    }
+    bool startObject() override { return Add("{"); }
+    bool key(const char* begin, const char* end) override
+    {
+      return Add("k" + std::string(begin, end));
+    }
+    bool endObject() override { return Add("}"); }
+    bool startArray() override { return Add("["); }
+    bool endArray() override { return Add("]"); }
+
+    std::string m_events;
+
+  private:
+    bool Add(const std::string& event)
+    {
+      m_events += event;
+      m_events += '\n';
+      return true;
+    }
+  };
+
+  std::string Sdp(const char* type)
+  {
+    std::string sdp = "v=0\\r\\no=- 4611731400430051336 2 IN IP4 127.0.0.1"
+                      "\\r\\ns=-\\r\\nt=0 0\\r\\na=group:BUNDLE 0 1\\r\\n";
+    for (const char* media : {"audio", "video"})
+    {
+      sdp += std::string("m=") + media
+        + " 9 UDP/TLS/RTP/SAVPF 111 103 104 9 0 8 106 105 13 110 112 113 126"
+          "\\r\\nc=IN IP4 0.0.0.0\\r\\na=rtcp:9 IN IP4 0.0.0.0\\r\\n"
+          "a=ice-ufrag:khLS\\r\\na=ice-pwd:cxLzteJaJBou3DspNaPsJhlQ\\r\\n"
+          "a=fingerprint:sha-256 FA:14:42:3B:C7:97:1B:E8:AE:0C:2E:D8:"
+          "E2:0D:A2:29:F8:50:72:1D:1A:39:14:0E:AE:70:9E:F7:71:0F:60:44"
+          "\\r\\na=setup:";
+      sdp += std::string(type) == "offer" ? "actpass" : "active";
+      sdp += "\\r\\na=extmap:1 urn:ietf:params:rtp-hdrext:ssrc-audio-level"
+             "\\r\\na=sendrecv\\r\\na=rtcp-mux\\r\\n";
+      for (int pt = 96; pt < 110; ++pt)
+        sdp += "a=rtpmap:" + std::to_string(pt) + " VP8/90000\\r\\n"
+          "a=rtcp-fb:" + std::to_string(pt) + " nack pli\\r\\n";
+    }
+    return sdp;
+  }
+
+  // what clients send, the relayed ones with "signal" first as they do
+  std::vector<std::pair<std::string, std::string> > Frames()
+  {
+    std::vector<std::pair<std::string, std::string> > frames;
+    for (const char* type : {"offer", "answer"})
+    {
+      frames.emplace_back(type,
+        std::string("{\"signal\":\"message\",\"to\":17,\"from\":4,\"type\":\"")
+        + type + "\",\"sdp\":{\"type\":\"" + type + "\",\"sdp\":\""
+        + Sdp(type) + "\"}}");
+    }
+    frames.emplace_back("candidate",
+      "{\"signal\":\"message\",\"to\":17,\"from\":4,\"type\":\"candidate\","
+      "\"candidate\":{\"candidate\":\"candidate:842163049 1 udp 1677729535 "
+      "203.0.113.7 52315 typ srflx raddr 192.168.1.20 rport 52315 generation 0"
+      " ufrag khLS network-cost 999\",\"sdpMid\":\"0\",\"sdpMLineIndex\":0}}");
+    frames.emplace_back("sign_in",
+      "{\"signal\":\"sign_in\",\"name\":\"meeting-room-3\",\"batch\":true}");
+    return frames;
+  }
+
+  std::string Events(const std::string& frame, size_t split, size_t step)
+  {
+    RecordHandler handler;
+    Json::EventReader reader(handler);
+    const char* p = frame.data();
+    const char* end = p + frame.size();
+    Json::EventReader::Status status = reader.feed(p, p + split);
+    for (p += split; p < end && status == Json::EventReader::needMore;)
+    {
+      const char* next = p + std::min<size_t>(step, end - p);
+      status = reader.feed(p, next);
+      p = next;
+    }
+    if (status == Json::EventReader::needMore)
+      status = reader.finish();
+    return status == Json::EventReader::complete ? handler.m_events : "failed";
+  }
+
+  bool CheckFragments(const std::string& frame)
+  {
+    std::string whole = Events(frame, frame.size(), frame.size());
+    if (whole == "failed")
+      return false;
+    for (size_t split = 0; split <= frame.size(); ++split)
+    {
+      if (Events(frame, split, frame.size()) != whole)
+        return false;
+    }
+    return Events(frame, 0, 1) == whole;
+  }
+
+  template <typename F>
+  double NsPerFrame(size_t iterations, F f)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      f();
+    std::chrono::duration<double, std::nano> took =
+      std::chrono::steady_clock::now() - start;
+    return took.count() / iterations;
+  }
+
+  // keeps the result of f from being optimized away
+  volatile int g_sink;
+}
+
+int main(int argc, char* argv[])
+{
+  size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+  auto frames = Frames();
+
+  for (const auto& frame : frames)
+  {
+    if (!CheckFragments(frame.second))
+    {
+      std::cerr << frame.first << ": fragmented read differs\n";
+      return 1;
+    }
+  }
+
+  Json::CharReaderBuilder builder;
+  builder["collectComments"] = false;
+  std::unique_ptr<Json::CharReader> dom(builder.newCharReader());
+  RouteHandler no_handler;
+  Json::EventReader events(no_handler);
+
+  std::cout << std::left << std::setw(10) << "frame" << std::right
+            << std::setw(8) << "bytes" << std::setw(12) << "dom ns"
+            << std::setw(12) << "event ns" << std::setw(10) << "speedup"
+            << "\n" << std::fixed << std::setprecision(0);
+  for (const auto& frame : frames)
+  {
+    const char* begin = frame.second.data();
+    const char* end = begin + frame.second.size();
+    double dom_ns = NsPerFrame(iterations, [&] {
+      Json::Value root;
+      dom->parse(begin, end, &root, nullptr);
+      g_sink = root["to"].asInt();
+    });
+    double event_ns = NsPerFrame(iterations, [&] {
+      RouteHandler route;
+      events.reset(route);
+      if (events.feed(begin, end) == Json::EventReader::needMore)
+        events.finish();
+      g_sink = route.m_to;
+    });
+    std::cout << std::left << std::setw(10) << frame.first << std::right
+              << std::setw(8) << frame.second.size() << std::setw(12) << dom_ns
+              << std::setw(12) << event_ns << std::setw(9)
+              << std::setprecision(1) << dom_ns / event_ns << "x\n"
+              << std::setprecision(0);
+  }
+
+  // parse and write back, as for the frames that are not relayed as they
+  // are: a Json::Reader and toStyledString() per frame as before, against
+  // JsonContext. Both parse a copy, the in situ parse writes into it.
+  std::cout << "\n" << std::left << std::setw(10) << "frame" << std::right
+            << std::setw(8) << "bytes" << std::setw(12) << "fresh ns"
+            << std::setw(12) << "context ns" << std::setw(10) << "speedup"
+            << "\n";
+  std::string copy;
+  for (const auto& frame : frames)
+  {
+    double fresh_ns = NsPerFrame(iterations, [&] {
+      copy.assign(frame.second);
+      Json::Reader reader;
+      Json::Value root;
+      reader.parse(copy, root);
+      g_sink = static_cast<int>(root.toStyledString().size());
+    });
+    double context_ns = NsPerFrame(iterations, [&] {
+      copy.assign(frame.second);
+      JsonContext& json = JsonContext::Local();
+      Json::Value root;
+      json.Parse(&copy[0], &copy[0] + copy.size(), &root);
+      g_sink = static_cast<int>(json.Write(root).size());
+    });
+    std::cout << std::left << std::setw(10) << frame.first << std::right
+              << std::setw(8) << frame.second.size() << std::setw(12)
+              << fresh_ns << std::setw(12) << context_ns << std::setw(9)
+              << std::setprecision(1) << fresh_ns / context_ns << "x\n"
+              << std::setprecision(0);
+  }
+  return 0;
+}
@@ -0,0 +1,641 @@
+// ws_load: websocket clients against a running wsSignalServer
+//
+//   ws_load storm [options]   connects n clients at once, rounds times, and
+//                             prints the connect + upgrade latency
+//   ws_load idle [options]    signs n clients in and keeps them open, prints
+//                             the growth of the server's resident memory
+//   ws_load relay [options]   signs n clients in, each of the n / 2 pairs
+//                             sends m messages one way, prints the heap
+//                             allocations of the server per relayed frame
+//
+//   -h <host>        IPv4 address of the server, 127.0.0.1
+//   -p <port>        its plain port, 2000
+//   -n <clients>     1000
+//   -c <in flight>   connects started and not yet upgraded at most, all n
+//   -r <rounds>      storm: how often all n reconnect, 1
+//   -t <ms>          a connect not upgraded by then failed, 10000
+//   -b <a,b,...>     local addresses to connect from in turn, each one has
+//                    its own ephemeral ports (127.0.0.x for loopback)
+//   -m <messages>    relay: per pair, 100
+//   --pid <pid>      idle: the server whose VmRSS is read; relay: the server
+//                    running with libmalloc_count.so preloaded
+//   --hold <s>       idle: keep the clients open that long afterwards, 0
+//
+// Pings of the server are answered, so idle clients are not timed out. The
+// server's descriptor limit and ours have to allow n connections.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+  typedef std::chrono::steady_clock Clock;
+
+  enum State
+  {
+    CONNECTING,
+    UPGRADING,    // request sent, reading the response
+    SIGNING_IN,   // idle: sign_in sent, waiting for its reply
+    OPEN,
+    FAILED
+  };
+
+  struct client
+  {
+    int fd = -1;
+    State state = FAILED;
+    Clock::time_point started;
+    std::string in;
+    std::string out;
+    int id = -1;              // the peer id of its sign in
+    size_t received = 0;      // frames other than pings and the sign in reply
+  };
+
+  struct options
+  {
+    std::string host = "127.0.0.1";
+    int port = 2000;
+    size_t clients = 1000;
+    size_t in_flight = 0;
+    int rounds = 1;
+    int timeout = 10000;
+    std::vector<in_addr> sources;
+    int pid = 0;
+    int hold = 0;
+    size_t messages = 100;
+  };
+
+  struct counts
+  {
+    size_t open = 0;
+    size_t refused = 0;
+    size_t timed_out = 0;
+    size_t failed = 0;      // any other error, or no 101 reply
+    std::vector<double> latency;   // ms
+  };
+
+  // a masked client frame, opcode 0x1 text, 0xA pong
+  std::string Frame(int opcode, const std::string& payload)
+  {
+    std::string frame;
+    frame += static_cast<char>(0x80 | opcode);
+    if (payload.size() < 126)
+      frame += static_cast<char>(0x80 | payload.size());
+    else
+    {
+      frame += static_cast<char>(0x80 | 126);
+      frame += static_cast<char>(payload.size() >> 8);
+      frame += static_cast<char>(payload.size() & 0xff);
+    }
+    const char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    frame.append(mask, 4);
+    for (size_t i = 0; i < payload.size(); ++i)
+      frame += static_cast<char>(payload[i] ^ mask[i % 4]);
+    return frame;
+  }
+
+  // answers the pings in c.in, keeps a partial frame, true if a whole frame
+  // other than a ping was read. The first one while signing in is the reply
+  // and has the peer id.
+  bool ReadFrames(client& c)
+  {
+    bool data = false;
+    while (c.in.size() >= 2)
+    {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(c.in.data());
+      int opcode = p[0] & 0x0f;
+      uint64_t size = p[1] & 0x7f;
+      size_t header = 2;
+      if (size == 126)
+      {
+        if (c.in.size() < 4)
+          return data;
+        size = (uint64_t(p[2]) << 8) | p[3];
+        header = 4;
+      }
+      else if (size == 127)
+      {
+        if (c.in.size() < 10)
+          return data;
+        size = 0;
+        for (int i = 0; i < 8; ++i)
+          size = (size << 8) | p[2 + i];
+        header = 10;
+      }
+      if (c.in.size() < header + size)
+        return data;
+      if (opcode == 0x9)
+        c.out += Frame(0xA, c.in.substr(header, size));
+      else if (c.state == SIGNING_IN && !data)
+      {
+        size_t id = c.in.find("\"id\":", header);
+        if (id != std::string::npos && id < header + size)
+          c.id = std::atoi(c.in.c_str() + id + 5);
+        data = true;
+      }
+      else
+      {
+        ++c.received;
+        data = true;
+      }
+      c.in.erase(0, header + size);
+    }
+    return data;
+  }
+
+  long ResidentKB(int pid)
+  {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+      if (line.compare(0, 6, "VmRSS:") == 0)
+        return std::atol(line.c_str() + 6);
+    }
+    return -1;
+  }
+
+  // asks libmalloc_count.so in pid for its count, -1 if it did not answer
+  long long Allocations(int pid)
+  {
+    std::string path = "/tmp/malloc_count." + std::to_string(pid);
+    ::unlink(path.c_str());
+    if (::kill(pid, SIGUSR2) != 0)
+      return -1;
+    for (int wait = 0; wait < 50; ++wait)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      std::ifstream file(path);
+      long long count = -1;
+      if (file >> count)
+        return count;
+    }
+    return -1;
+  }
+
+  void RaiseFileLimit(size_t needed)
+  {
+    rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) != 0)
+      return;
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < needed + 16)
+      std::cerr << "only " << limit.rlim_cur << " descriptors allowed\n";
+  }
+
+  class load
+  {
+  public:
+    explicit load(const options& opt) : m_opt(opt), m_epoll(::epoll_create1(0))
+    {
+      std::memset(&m_server, 0, sizeof(m_server));
+      m_server.sin_family = AF_INET;
+      m_server.sin_port = htons(opt.port);
+      ::inet_pton(AF_INET, opt.host.c_str(), &m_server.sin_addr);
+      m_clients.resize(opt.clients);
+      std::ostringstream request;
+      request << "GET / HTTP/1.1\r\nHost: " << opt.host << ":" << opt.port
+              << "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n";
+      m_request = request.str();
+    }
+    ~load()
+    {
+      CloseAll();
+      ::close(m_epoll);
+    }
+
+    // connects every client, sign_in: signs them in too, until all are open
+    // or failed
+    counts Connect(bool sign_in)
+    {
+      m_sign_in = sign_in;
+      m_counts = counts();
+      size_t in_flight = m_opt.in_flight ? m_opt.in_flight : m_opt.clients;
+      size_t next = 0;
+      size_t pending = 0;
+      std::deque<size_t> started;
+      std::vector<epoll_event> events(1024);
+      while (next < m_clients.size() || pending > 0)
+      {
+        for (; next < m_clients.size() && pending < in_flight; ++next)
+        {
+          if (Start(next))
+          {
+            started.push_back(next);
+            ++pending;
+          }
+        }
+        int n = ::epoll_wait(m_epoll, events.data(), events.size(), 10);
+        for (int i = 0; i < n; ++i)
+        {
+          client& c = m_clients[events[i].data.u64];
+          State before = c.state;
+          Handle(events[i].data.u64, events[i].events);
+          pending -= Settled(before) != Settled(c.state);
+        }
+        // the oldest are at the front
+        Clock::time_point now = Clock::now();
+        while (!started.empty())
+        {
+          client& c = m_clients[started.front()];
+          if (Settled(c.state))
+            started.pop_front();
+          else if (now - c.started > std::chrono::milliseconds(m_opt.timeout))
+          {
+            Fail(c, ETIMEDOUT);
+            --pending;
+            started.pop_front();
+          }
+          else
+            break;
+        }
+      }
+      return m_counts;
+    }
+
+    // answers pings for seconds
+    void Serve(int seconds)
+    {
+      std::vector<epoll_event> events(1024);
+      Clock::time_point end = Clock::now() + std::chrono::seconds(seconds);
+      while (Clock::now() < end)
+      {
+        int n = ::epoll_wait(m_epoll, events.data(), events.size(), 100);
+        for (int i = 0; i < n; ++i)
+          Handle(events[i].data.u64, events[i].events);
+      }
+    }
+
+    // every even client sends messages frames to the odd one after it,
+    // returns how many arrived before timeout ms passed without progress
+    size_t Relay(size_t messages)
+    {
+      size_t expected = 0;
+      for (client& c : m_clients)
+        c.received = 0;
+      for (size_t i = 0; i + 1 < m_clients.size(); i += 2)
+      {
+        client& from = m_clients[i];
+        const client& to = m_clients[i + 1];
+        if (from.state != OPEN || to.state != OPEN || to.id < 0)
+          continue;
+        std::string frame = Frame(0x1,
+          "{\"signal\":\"message\",\"to\":" + std::to_string(to.id)
+          + ",\"type\":\"candidate\",\"candidate\":{\"candidate\":"
+            "\"candidate:842163049 1 udp 1677729535 203.0.113.7 52315 typ "
+            "srflx raddr 192.168.1.20 rport 52315 generation 0\","
+            "\"sdpMid\":\"0\",\"sdpMLineIndex\":0}}");
+        for (size_t m = 0; m < messages; ++m)
+          from.out += frame;
+        expected += messages;
+        Handle(i, EPOLLOUT);
+      }
+
+      std::vector<epoll_event> events(1024);
+      size_t received = 0;
+      Clock::time_point progress = Clock::now();
+      while (received < expected && Clock::now() - progress
+                                    < std::chrono::milliseconds(m_opt.timeout))
+      {
+        int n = ::epoll_wait(m_epoll, events.data(), events.size(), 100);
+        for (int i = 0; i < n; ++i)
+          Handle(events[i].data.u64, events[i].events);
+        size_t now = 0;
+        for (const client& c : m_clients)
+          now += c.received;
+        if (now != received)
+          progress = Clock::now();
+        received = now;
+      }
+      return received;
+    }
+
+    void CloseAll()
+    {
+      for (client& c : m_clients)
+      {
+        if (c.fd >= 0)
+          ::close(c.fd);
+        c = client();
+      }
+    }
+
+  private:
+    static bool Settled(State state) { return state == OPEN || state == FAILED; }
+
+    bool Start(size_t index)
+    {
+      client& c = m_clients[index];
+      c = client();
+      c.started = Clock::now();
+      c.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (c.fd < 0)
+      {
+        Fail(c, errno);
+        return false;
+      }
+      int one = 1;
+      ::setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (!m_opt.sources.empty())
+      {
+        sockaddr_in local;
+        std::memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr = m_opt.sources[index % m_opt.sources.size()];
+        ::setsockopt(c.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one,
+                     sizeof(one));
+        if (::bind(c.fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)))
+        {
+          Fail(c, errno);
+          return false;
+        }
+      }
+      c.state = CONNECTING;
+      if (::connect(c.fd, reinterpret_cast<sockaddr*>(&m_server),
+                    sizeof(m_server)) != 0 && errno != EINPROGRESS)
+      {
+        Fail(c, errno);
+        return false;
+      }
+      epoll_event event;
+      event.events = EPOLLIN | EPOLLOUT;
+      event.data.u64 = index;
+      ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, c.fd, &event);
+      return true;
+    }
+
+    void Handle(size_t index, uint32_t events)
+    {
+      client& c = m_clients[index];
+      if (c.state == FAILED)
+        return;
+      Step(index, events);
+      if (c.state == FAILED)
+        return;
+      // writable only matters while connecting or with something to send
+      epoll_event event;
+      event.events = EPOLLIN
+        | (c.state == CONNECTING || !c.out.empty() ? EPOLLOUT : 0);
+      event.data.u64 = index;
+      ::epoll_ctl(m_epoll, EPOLL_CTL_MOD, c.fd, &event);
+    }
+
+    void Step(size_t index, uint32_t events)
+    {
+      client& c = m_clients[index];
+      if (c.state == CONNECTING)
+      {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        ::getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+          Fail(c, error ? error : ECONNRESET);
+          return;
+        }
+        if (!(events & EPOLLOUT))
+          return;
+        c.state = UPGRADING;
+        c.out = m_request;
+      }
+      if (!Flush(c) || !Read(c))
+        return;
+      if (c.state == UPGRADING)
+      {
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == std::string::npos)
+          return;
+        if (c.in.compare(0, 12, "HTTP/1.1 101") != 0)
+        {
+          Fail(c, 0);
+          return;
+        }
+        c.in.erase(0, end + 4);
+        if (m_sign_in)
+        {
+          c.state = SIGNING_IN;
+          c.out += Frame(0x1, "{\"signal\":\"sign_in\",\"name\":\"idle-"
+                              + std::to_string(index) + "\",\"nolist\":true}");
+        }
+        else
+          Open(c);
+      }
+      if (ReadFrames(c) && c.state == SIGNING_IN)
+        Open(c);
+      Flush(c);
+    }
+
+    bool Flush(client& c)
+    {
+      while (!c.out.empty())
+      {
+        ssize_t n = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+          if (errno == EAGAIN)
+            return true;
+          Fail(c, errno);
+          return false;
+        }
+        c.out.erase(0, n);
+      }
+      return true;
+    }
+
+    bool Read(client& c)
+    {
+      char buffer[4096];
+      while (true)
+      {
+        ssize_t n = ::recv(c.fd, buffer, sizeof(buffer), 0);
+        if (n > 0)
+          c.in.append(buffer, n);
+        else if (n < 0 && errno == EAGAIN)
+          return true;
+        else
+        {
+          Fail(c, n == 0 ? ECONNRESET : errno);
+          return false;
+        }
+      }
+    }
+
+    void Open(client& c)
+    {
+      c.state = OPEN;
+      ++m_counts.open;
+      std::chrono::duration<double, std::milli> took = Clock::now() - c.started;
+      m_counts.latency.push_back(took.count());
+    }
+
+    void Fail(client& c, int error)
+    {
+      if (c.state == OPEN)
+        --m_counts.open;
+      if (error == ECONNREFUSED)
+        ++m_counts.refused;
+      else if (error == ETIMEDOUT)
+        ++m_counts.timed_out;
+      else
+        ++m_counts.failed;
+      if (c.fd >= 0)
+        ::close(c.fd);
+      c.fd = -1;
+      c.state = FAILED;
+    }
+
+    const options& m_opt;
+    int m_epoll;
+    sockaddr_in m_server;
+    std::string m_request;
+    std::vector<client> m_clients;
+    counts m_counts;
+    bool m_sign_in = false;
+  };
+
+  double Percentile(std::vector<double> values, double p)
+  {
+    if (values.empty())
+      return 0;
+    size_t i = std::min(values.size() - 1, size_t(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+  }
+
+  void PrintCounts(const counts& c)
+  {
+    std::cout << "open " << c.open << ", refused " << c.refused
+              << ", timed out " << c.timed_out << ", failed " << c.failed
+              << std::fixed << std::setprecision(2) << ", ms p50 "
+              << Percentile(c.latency, 0.5) << " p99 "
+              << Percentile(c.latency, 0.99) << " max "
+              << Percentile(c.latency, 1.0) << "\n";
+  }
+
+  bool ParseOptions(int argc, char* argv[], options& opt)
+  {
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+      std::string flag = argv[i];
+      std::string value = argv[i + 1];
+      if (flag == "-h")
+        opt.host = value;
+      else if (flag == "-p")
+        opt.port = std::atoi(value.c_str());
+      else if (flag == "-n")
+        opt.clients = std::strtoul(value.c_str(), nullptr, 10);
+      else if (flag == "-c")
+        opt.in_flight = std::strtoul(value.c_str(), nullptr, 10);
+      else if (flag == "-r")
+        opt.rounds = std::atoi(value.c_str());
+      else if (flag == "-t")
+        opt.timeout = std::atoi(value.c_str());
+      else if (flag == "-m")
+        opt.messages = std::strtoul(value.c_str(), nullptr, 10);
+      else if (flag == "--pid")
+        opt.pid = std::atoi(value.c_str());
+      else if (flag == "--hold")
+        opt.hold = std::atoi(value.c_str());
+      else if (flag == "-b")
+      {
+        std::istringstream list(value);
+        std::string address;
+        while (std::getline(list, address, ','))
+        {
+          in_addr a;
+          if (::inet_pton(AF_INET, address.c_str(), &a) != 1)
+            return false;
+          opt.sources.push_back(a);
+        }
+      }
+      else
+        return false;
+    }
+    return true;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  options opt;
+  std::string mode = argc > 1 ? argv[1] : "";
+  if ((mode != "storm" && mode != "idle" && mode != "relay")
+      || !ParseOptions(argc, argv, opt) || (mode != "storm" && opt.pid <= 0))
+  {
+    std::cerr << "usage: " << argv[0] << " storm|idle|relay [-h host] "
+                 "[-p port] [-n clients] [-c in flight] [-r rounds] [-t ms] "
+                 "[-b addresses] [-m messages] [--pid server] [--hold s]\n";
+    return 2;
+  }
+  RaiseFileLimit(opt.clients);
+  load clients(opt);
+
+  if (mode == "storm")
+  {
+    for (int round = 0; round < opt.rounds; ++round)
+    {
+      std::cout << "round " << round + 1 << ": ";
+      PrintCounts(clients.Connect(false));
+      // all of them drop at once and come back, as after a restart
+      clients.CloseAll();
+    }
+    return 0;
+  }
+
+  if (mode == "relay")
+  {
+    counts c = clients.Connect(true);
+    PrintCounts(c);
+    long long before = Allocations(opt.pid);
+    size_t relayed = clients.Relay(opt.messages);
+    long long after = Allocations(opt.pid);
+    std::cout << "relayed " << relayed << " of " << opt.clients / 2 * opt.messages
+              << " frames";
+    if (before < 0 || after < 0)
+      std::cout << ", no allocation count from " << opt.pid
+                << ", is libmalloc_count.so preloaded?";
+    else if (relayed > 0)
+      std::cout << std::setprecision(2) << ", " << after - before
+                << " allocations, " << double(after - before) / relayed
+                << " per frame";
+    std::cout << "\n";
+    return 0;
+  }
+
+  long before = ResidentKB(opt.pid);
+  counts c = clients.Connect(true);
+  // let the server settle, its pings arrive meanwhile
+  clients.Serve(2);
+  long after = ResidentKB(opt.pid);
+  PrintCounts(c);
+  std::cout << "server VmRSS " << before << " kB -> " << after << " kB";
+  if (c.open > 0 && before >= 0 && after >= 0)
+    std::cout << ", " << (after - before) * 1024 / long(c.open)
+              << " bytes per idle peer";
+  std::cout << "\n";
+  clients.Serve(opt.hold);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include "candidate_batch.h"
+#include <algorithm>
+#include <vector>
+
+batch_limits g_batch_limits;
+
+void CandidateBatcher::Add(int from, int to, const std::string& text,
+                           Clock::time_point now, const Send& send)
+{
+  auto it = m_batches.find(std::make_pair(from, to));
+  if (it == m_batches.end())
+  {
+    it = m_batches.emplace(std::make_pair(from, to), Batch()).first;
+    Batch& batch = it->second;
+    batch.deadline = now + std::chrono::milliseconds(g_batch_limits.window);
+    batch.frame = "{\"signal\":\"candidates\",\"from\":" + std::to_string(from)
+      + ",\"to\":" + std::to_string(to) + ",\"messages\":[";
+    batch.head = batch.frame.size();
+  }
+  Batch& batch = it->second;
+  if (batch.count != 0)
+    batch.frame += ',';
+  batch.frame += text;
+  ++batch.count;
+  if (batch.count >= g_batch_limits.frames
+      || batch.frame.size() - batch.head >= g_batch_limits.bytes)
+    Release(it, send);
+}
+
+void CandidateBatcher::Flush(int from, int to, const Send& send)
+{
+  if (m_batches.empty())
+    return;
+  auto it = m_batches.find(std::make_pair(from, to));
+  if (it != m_batches.end())
+    Release(it, send);
+}
+
+CandidateBatcher::Clock::time_point
+CandidateBatcher::Expire(Clock::time_point now, const Send& send)
+{
+  // sending may flush or start other batches, the due ones are looked up
+  // again and the next deadline is taken afterwards
+  std::vector<std::pair<int, int>> due;
+  for (const auto& entry : m_batches)
+  {
+    if (entry.second.deadline <= now)
+      due.push_back(entry.first);
+  }
+  for (const auto& key : due)
+  {
+    auto it = m_batches.find(key);
+    if (it != m_batches.end())
+      Release(it, send);
+  }
+  Clock::time_point next = Clock::time_point::max();
+  for (const auto& entry : m_batches)
+    next = std::min(next, entry.second.deadline);
+  return next;
+}
+
+void CandidateBatcher::Release(Batches::iterator it, const Send& send)
+{
+  int from = it->first.first;
+  int to = it->first.second;
+  Batch batch = std::move(it->second);
+  m_batches.erase(it);
+  if (batch.count == 1)
+    batch.frame.erase(0, batch.head);
+  else
+    batch.frame += "]}";
+  send(from, to, batch.frame, batch.count);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+
+/* Trickle ICE candidates relayed in batches.
+ *
+ * During call setup a client sends its candidates one frame each. For a
+ * recipient that asked for it, the candidates from one peer are held for
+ * window ms after the first and then relayed as one frame
+ *
+ *   {"signal":"candidates","from":F,"to":T,"messages":[frame,...]}
+ *
+ * with the frames as they were received. A batch goes out early once it
+ * holds frames / bytes, or ahead of any other frame between the same two
+ * peers so that nothing overtakes it. A batch of one is relayed as the
+ * frame itself.
+ */
+struct batch_limits {
+  int window = 0;           // ms, 0 relays every candidate at once
+  size_t frames = 32;
+  size_t bytes = 16 * 1024;
+};
+
+extern batch_limits g_batch_limits;
+
+class CandidateBatcher
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+  // count is the number of candidates in frame
+  typedef std::function<void(int from, int to, const std::string& frame,
+                             size_t count)> Send;
+
+  // text joins the batch from from to to, send gets the batch once full
+  void Add(int from, int to, const std::string& text, Clock::time_point now,
+           const Send& send);
+  // sends the batch from from to to, if there is one
+  void Flush(int from, int to, const Send& send);
+  // sends the batches whose window is over at now; when the next one is
+  // due, Clock::time_point::max() if none waits
+  Clock::time_point Expire(Clock::time_point now, const Send& send);
+
+  size_t Size() const { return m_batches.size(); }
+
+private:
+  struct Batch
+  {
+    Clock::time_point deadline;
+    std::string frame;      // the head and the frames so far
+    size_t head = 0;        // length of the head
+    size_t count = 0;
+  };
+
+  typedef std::map<std::pair<int, int>, Batch> Batches;
+
+  // removes the batch at it and sends it
+  void Release(Batches::iterator it, const Send& send);
+
+  Batches m_batches;
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/* Ids of open connections.
+ *
+ * An id is a slot index in the low 32 bits and the slot's generation in the
+ * high ones. Slots are dense and the most recently freed one is reused
+ * first, so per connection state lives in vectors indexed by the slot
+ * instead of maps keyed by connection_hdl. A slot's generation changes when
+ * it is released, an id kept past its connection's close matches nothing.
+ * 0 is never an id.
+ */
+typedef uint64_t connection_id;
+
+inline uint32_t connection_slot(connection_id id) {
+  return static_cast<uint32_t>(id);
+}
+
+class connection_slots {
+public:
+  connection_id claim() {
+    std::lock_guard<std::mutex> guard(lock_);
+    uint32_t slot;
+    if (!free_.empty()) {
+      slot = free_.back();
+      free_.pop_back();
+    } else {
+      slot = static_cast<uint32_t>(generations_.size());
+      generations_.push_back(1);
+    }
+    return static_cast<connection_id>(generations_[slot]) << 32 | slot;
+  }
+
+  // id's state is gone from every slab, the slot may be handed out again
+  void release(connection_id id) {
+    std::lock_guard<std::mutex> guard(lock_);
+    uint32_t& generation = generations_[connection_slot(id)];
+    if (++generation == 0)
+      generation = 1;
+    free_.push_back(connection_slot(id));
+  }
+
+private:
+  std::mutex lock_;
+  std::vector<uint32_t> generations_;
+  std::vector<uint32_t> free_;
+};
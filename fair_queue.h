@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <utility>
+#include "small_block.h"
+
+/* Work queue of the dispatch thread.
+ *
+ * Control items of no connection (connection events, timers) are served
+ * first, in arrival order. The items of a connection wait in one sub-queue
+ * per connection and are always served in the order they came in. The
+ * sub-queues are served by deficit round robin, each turn a connection may
+ * use quantum bytes of payload. A sub-queue holding a control item of its
+ * connection (sign in/out) is urgent: the urgent sub-queues take turns with
+ * the others, one item a turn, until their control items are served. A
+ * connection has at most control_depth control items queued and they count
+ * against its depth (its close is never refused), so sending them neither grows the queue nor holds the
+ * other connections back. A connection whose sub-queue is full has its new
+ * items shed, the other connections are unaffected. A sub-queue only exists
+ * while it holds items, idle connections cost nothing here. Its nodes are
+ * made and freed that often, they come from small_block_pool.
+ * Key identifies the connection.
+ */
+template <typename T, typename Key>
+class fair_queue {
+public:
+  fair_queue(size_t depth, size_t quantum, size_t control_depth)
+    : depth_(depth), quantum_(std::max<size_t>(quantum, 1)),
+      control_depth_(control_depth), shed_(0), size_(0), urgent_last_(false) {}
+
+  // an item of no connection, never refused
+  void push_control(T item) {
+    control_.push_back(std::move(item));
+    ++size_;
+  }
+
+  // false if key has control_depth control items or depth items in all
+  // queued already, item is dropped
+  bool push_control(const Key& key, T item) {
+    if (controlled(key) >= control_depth_ || queued(key) >= depth_) {
+      ++shed_;
+      return false;
+    }
+    add(key, std::move(item), 0, true);
+    return true;
+  }
+
+  // false if key has depth items queued already, item is dropped
+  bool push(const Key& key, T item, size_t cost) {
+    if (queued(key) >= depth_) {
+      ++shed_;
+      return false;
+    }
+    add(key, std::move(item), cost, false);
+    return true;
+  }
+
+  bool empty() const {
+    return control_.empty() && urgent_.empty() && active_.empty();
+  }
+
+  // the next item, the queue must not be empty
+  T pop() {
+    --size_;
+    if (!control_.empty()) {
+      T item = std::move(control_.front());
+      control_.pop_front();
+      return item;
+    }
+    urgent_last_ = !urgent_.empty() && (!urgent_last_ || active_.empty());
+    if (urgent_last_) {
+      flow_ref it = urgent_.front();
+      flow& f = it->second;
+      entry& e = f.items.front();
+      T item = std::move(e.item);
+      if (e.control && --f.controls == 0)
+        active_.splice(active_.end(), urgent_, urgent_.begin());
+      else
+        urgent_.splice(urgent_.end(), urgent_, urgent_.begin());
+      f.items.pop_front();
+      if (f.items.empty())
+        drop(it, f.controls ? urgent_ : active_);
+      return item;
+    }
+    while (true) {
+      flow_ref it = active_.front();
+      flow& f = it->second;
+      if (f.deficit < f.items.front().cost) {
+        f.deficit += quantum_;
+        active_.splice(active_.end(), active_, active_.begin());
+        continue;
+      }
+      f.deficit -= f.items.front().cost;
+      T item = std::move(f.items.front().item);
+      f.items.pop_front();
+      if (f.items.empty())
+        drop(it, active_);
+      return item;
+    }
+  }
+
+  // the last item of key, served after everything key queued before it
+  // and as urgently as a control item, never refused
+  void push_last(const Key& key, T item) {
+    add(key, std::move(item), 0, true);
+  }
+
+  // items queued for key, control items included
+  size_t queued(const Key& key) const {
+    auto it = flows_.find(key);
+    return it == flows_.end() ? 0 : it->second.items.size();
+  }
+
+  size_t controlled(const Key& key) const {
+    auto it = flows_.find(key);
+    return it == flows_.end() ? 0 : it->second.controls;
+  }
+
+  // new limits, items queued past them stay and are served
+  void limit(size_t depth, size_t quantum, size_t control_depth) {
+    depth_ = depth;
+    quantum_ = std::max<size_t>(quantum, 1);
+    control_depth_ = control_depth;
+  }
+
+  // items of all connections and control items
+  size_t size() const { return size_; }
+
+  // items dropped because their connection's queue was full
+  uint64_t shed() const { return shed_; }
+
+private:
+  struct entry {
+    entry(T&& i, size_t c, bool k) : item(std::move(i)), cost(c), control(k) {}
+    T item;
+    size_t cost;
+    bool control;
+  };
+  struct flow;
+  typedef std::pair<const Key, flow> flow_node;
+  typedef std::map<Key, flow, std::less<Key>,
+                   small_block_allocator<flow_node> > flow_map;
+  typedef typename flow_map::iterator flow_ref;
+  typedef std::list<flow_ref, small_block_allocator<flow_ref> > flow_list;
+  struct flow {
+    std::deque<entry, small_block_allocator<entry> > items;
+    size_t deficit = 0;
+    size_t controls = 0;
+    // where the flow is in urgent_ or active_
+    typename flow_list::iterator turn;
+  };
+
+  void add(const Key& key, T&& item, size_t cost, bool control) {
+    auto it = flows_.find(key);
+    if (it == flows_.end()) {
+      it = flows_.emplace(key, flow()).first;
+      flow_list& list = control ? urgent_ : active_;
+      it->second.turn = list.insert(list.end(), it);
+    } else if (control && it->second.controls == 0) {
+      urgent_.splice(urgent_.end(), active_, it->second.turn);
+    }
+    flow& f = it->second;
+    f.items.emplace_back(std::move(item), cost, control);
+    f.controls += control;
+    ++size_;
+  }
+
+  void drop(flow_ref it, flow_list& list) {
+    list.erase(it->second.turn);
+    flows_.erase(it);
+  }
+
+  size_t depth_;
+  size_t quantum_;
+  size_t control_depth_;
+  uint64_t shed_;
+  size_t size_;
+  std::deque<T, small_block_allocator<T> > control_;
+  // the last item served came from urgent_
+  bool urgent_last_;
+  flow_map flows_;
+  // the flows holding control items of their connection, in turn order
+  flow_list urgent_;
+  // the other flows that hold items, in round robin order
+  flow_list active_;
+};
@@ -0,0 +1,170 @@
+#include "handoff.h"
+#include "message_queue.h"
+#include <boost/log/trivial.hpp>
+
+#ifndef WIN32
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+  const int kHandoffTimeout = 5000; // ms
+
+  // which of the passed descriptors is which
+  struct handoff_header {
+    int plain;  // index into the descriptors, -1 if none
+    int tls;
+  };
+
+  void HandoffAddress(sockaddr_un& addr, const char* path)
+  {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  }
+
+  bool ReceiveFds(int sock, listen_fds& fds)
+  {
+    handoff_header header;
+    iovec iov = {&header, sizeof(header)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (::recvmsg(sock, &msg, 0) != sizeof(header))
+      return false;
+
+    int passed[2] = {-1, -1};
+    int count = 0;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        continue;
+      count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      std::memcpy(passed, CMSG_DATA(c), count * sizeof(int));
+    }
+    if (header.plain >= 0 && header.plain < count)
+      fds.plain = passed[header.plain];
+    if (header.tls >= 0 && header.tls < count)
+      fds.tls = passed[header.tls];
+    return fds.plain >= 0;
+  }
+}
+
+bool TakeOverListenSockets(listen_fds& fds, int drain_deadline,
+                           const char* queue_name, const char* path)
+{
+  sockaddr_un addr;
+  HandoffAddress(addr, path);
+  int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    return false;
+  ::unlink(path);
+  if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+      || ::listen(sock, 1) != 0)
+  {
+    BOOST_LOG_TRIVIAL(error) << "handoff: " << std::strerror(errno);
+    ::close(sock);
+    return false;
+  }
+
+  bool taken = false;
+  MessageQueue queue(false, queue_name);
+  if (queue.SendMessage(MQ_HANDOFF))
+  {
+    pollfd p = {sock, POLLIN, 0};
+    if (::poll(&p, 1, kHandoffTimeout) == 1)
+    {
+      int peer = ::accept(sock, nullptr, nullptr);
+      if (peer >= 0)
+      {
+        taken = ReceiveFds(peer, fds);
+        ::close(peer);
+      }
+    }
+  }
+  ::close(sock);
+  ::unlink(path);
+
+  if (!taken)
+  {
+    BOOST_LOG_TRIVIAL(warning) << "handoff: no running server answered";
+    return false;
+  }
+  BOOST_LOG_TRIVIAL(info) << "handoff: took over listen sockets "
+                          << fds.plain << " " << fds.tls;
+  // we accept on them already, the old server may go
+  queue.SendMessage(MQ_DRAIN, drain_deadline);
+  return true;
+}
+
+bool SendListenSockets(const listen_fds& fds, const char* path)
+{
+  sockaddr_un addr;
+  HandoffAddress(addr, path);
+  int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    return false;
+  if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+  {
+    BOOST_LOG_TRIVIAL(error) << "handoff: " << std::strerror(errno);
+    ::close(sock);
+    return false;
+  }
+
+  handoff_header header = {-1, -1};
+  int passed[2];
+  int count = 0;
+  if (fds.plain >= 0)
+  {
+    header.plain = count;
+    passed[count++] = fds.plain;
+  }
+  if (fds.tls >= 0)
+  {
+    header.tls = count;
+    passed[count++] = fds.tls;
+  }
+
+  iovec iov = {&header, sizeof(header)};
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (count > 0)
+  {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(c), passed, count * sizeof(int));
+  }
+
+  bool sent = ::sendmsg(sock, &msg, 0) == sizeof(header);
+  ::close(sock);
+  BOOST_LOG_TRIVIAL(info) << "handoff: " << (sent ? "sent" : "failed to send")
+                          << " listen sockets";
+  return sent;
+}
+#else
+bool TakeOverListenSockets(listen_fds& fds, int drain_deadline,
+                           const char* queue_name, const char* path)
+{
+  return false;
+}
+
+bool SendListenSockets(const listen_fds& fds, const char* path)
+{
+  return false;
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+/* Hands the listening sockets of a running server to the process replacing
+ * it, so that no connect attempt is refused during a restart.
+ *
+ * The new process binds HANDOFF_PATH and sends MQ_HANDOFF on the control
+ * queue, the running server connects and passes its sockets with
+ * SCM_RIGHTS. Both then accept on the same sockets until the old one has
+ * drained.
+ */
+
+#define HANDOFF_PATH "/tmp/wsSignalServer.handoff"
+
+struct listen_fds {
+  int plain = -1;
+  int tls = -1;
+};
+
+// new process: takes the sockets over from the running server and asks it
+// to drain within drain_deadline ms, false if there was nothing to take.
+// queue and path default to those of the one server process.
+bool TakeOverListenSockets(listen_fds& fds, int drain_deadline,
+                           const char* queue = nullptr,
+                           const char* path = HANDOFF_PATH);
+
+// running server: passes fds to the process waiting on path
+bool SendListenSockets(const listen_fds& fds, const char* path = HANDOFF_PATH);
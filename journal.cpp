@@ -0,0 +1,154 @@
+#include "journal.h"
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+  const uint32_t kJournalMagic = 0x776a726e; // "wjrn"
+  const uint32_t kJournalVersion = 1;
+  // records start one record size in, the header fits in that
+  const size_t kHeaderSize = sizeof(JournalRecord);
+  static_assert(sizeof(JournalHeader) <= kHeaderSize, "journal header too big");
+}
+
+EventJournal* g_journal = nullptr;
+
+EventJournal::EventJournal(const std::string& file, uint64_t capacity)
+  : m_header(nullptr), m_records(nullptr), m_size(0), m_pid(getpid())
+{
+  if (capacity == 0)
+    return;
+  int fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    BOOST_LOG_TRIVIAL(error) << "journal " << file << ": " << std::strerror(errno);
+    return;
+  }
+  size_t size = kHeaderSize + sizeof(JournalRecord) * capacity;
+  struct stat st;
+  bool fresh = ::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != size;
+  if (fresh && ::ftruncate(fd, 0) != 0)
+    fresh = false;
+  if (::ftruncate(fd, size) != 0)
+  {
+    BOOST_LOG_TRIVIAL(error) << "journal " << file << ": " << std::strerror(errno);
+    ::close(fd);
+    return;
+  }
+  void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED)
+  {
+    BOOST_LOG_TRIVIAL(error) << "journal " << file << ": " << std::strerror(errno);
+    return;
+  }
+
+  m_header = static_cast<JournalHeader*>(base);
+  m_records = reinterpret_cast<JournalRecord*>(static_cast<char*>(base) + kHeaderSize);
+  m_size = size;
+  if (fresh || m_header->magic != kJournalMagic
+      || m_header->version != kJournalVersion || m_header->capacity != capacity)
+  {
+    // a zero filled file is an empty ring
+    m_header->magic = kJournalMagic;
+    m_header->version = kJournalVersion;
+    m_header->capacity = capacity;
+    m_header->next.store(0, std::memory_order_release);
+  }
+  BOOST_LOG_TRIVIAL(info) << "journal " << file << " at record "
+                          << m_header->next.load(std::memory_order_relaxed);
+}
+
+EventJournal::~EventJournal()
+{
+  if (m_header)
+    ::munmap(m_header, m_size);
+}
+
+void EventJournal::Attach()
+{
+  m_pid = getpid();
+}
+
+void EventJournal::Write(JournalEvent event, uint64_t connection, int id,
+                         int other, const std::string& name)
+{
+  if (!m_header)
+    return;
+  uint64_t position = m_header->next.fetch_add(1, std::memory_order_relaxed);
+  JournalRecord& record = m_records[position % m_header->capacity];
+  record.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  record.connection = connection;
+  record.pid = m_pid;
+  record.event = event;
+  record.id = id;
+  record.other = other;
+  size_t size = std::min(name.size(), sizeof(record.name));
+  record.name_size = static_cast<uint16_t>(size);
+  std::memcpy(record.name, name.data(), size);
+  record.seq.store(position + 1, std::memory_order_release);
+}
+
+const JournalHeader* EventJournal::Map(const std::string& file, size_t& size)
+{
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderSize)
+  {
+    ::close(fd);
+    return nullptr;
+  }
+  size = st.st_size;
+  void* base = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED)
+    return nullptr;
+  const JournalHeader* header = static_cast<const JournalHeader*>(base);
+  if (header->magic != kJournalMagic || header->version != kJournalVersion
+      || size < kHeaderSize + sizeof(JournalRecord) * header->capacity)
+  {
+    ::munmap(base, size);
+    return nullptr;
+  }
+  return header;
+}
+
+void EventJournal::Unmap(const JournalHeader* header, size_t size)
+{
+  ::munmap(const_cast<JournalHeader*>(header), size);
+}
+
+const JournalRecord* EventJournal::Records(const JournalHeader* header)
+{
+  return reinterpret_cast<const JournalRecord*>(
+    reinterpret_cast<const char*>(header) + kHeaderSize);
+}
+
+const char* EventJournal::Name(uint16_t event)
+{
+  switch (event)
+  {
+  case JOURNAL_OPEN: return "open";
+  case JOURNAL_CLOSE: return "close";
+  case JOURNAL_SIGN_IN: return "sign_in";
+  case JOURNAL_SIGN_OUT: return "sign_out";
+  case JOURNAL_PAIR: return "pair";
+  case JOURNAL_UNPAIR: return "unpair";
+  case JOURNAL_KICK: return "kick";
+  case JOURNAL_DETACH: return "detach";
+  case JOURNAL_RESUME: return "resume";
+  case JOURNAL_EXPIRE: return "expire";
+  default: return "unknown";
+  }
+}
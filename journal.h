@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/* Binary journal of connection and signaling events, for audits and
+ * forensics without parsing log lines.
+ *
+ * The journal is a file mapped MAP_SHARED: a header page, then a ring of
+ * fixed size records. A writer claims a position with one atomic add on the
+ * header and fills the record in place, so workers and a process taking over
+ * write to the same file without locks. The ring outlives the process and
+ * is read offline by wsJournal.
+ */
+
+enum JournalEvent : uint16_t
+{
+  JOURNAL_OPEN = 1,     // connection
+  JOURNAL_CLOSE,        // connection, id of its peer or -1
+  JOURNAL_SIGN_IN,      // connection, id, name
+  JOURNAL_SIGN_OUT,     // connection, id
+  JOURNAL_PAIR,         // id offered to other
+  JOURNAL_UNPAIR,       // id left, other was its pair
+  JOURNAL_KICK,         // connection, id
+  JOURNAL_DETACH,       // connection, id kept for resumption
+  JOURNAL_RESUME,       // connection, id
+  JOURNAL_EXPIRE        // id, its session was not resumed in time
+};
+
+struct JournalRecord
+{
+  std::atomic<uint64_t> seq;  // position + 1 once written, 0 while writing
+  int64_t time;               // ns since the epoch
+  uint64_t connection;        // connection_id, 0 for none
+  int32_t pid;
+  uint16_t event;
+  uint16_t name_size;
+  int32_t id;
+  int32_t other;
+  char name[24];              // truncated
+};
+static_assert(sizeof(JournalRecord) == 64, "journal records are 64 bytes");
+
+struct JournalHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;          // records in the ring
+  std::atomic<uint64_t> next; // position of the next record
+};
+
+class EventJournal
+{
+public:
+  // maps file, creating it for capacity records or continuing the ring it
+  // holds if that has the same capacity
+  EventJournal(const std::string& file, uint64_t capacity);
+  ~EventJournal();
+
+  bool IsOpen() const { return m_header != nullptr; }
+  // in a forked worker, its records carry its own pid
+  void Attach();
+
+  void Write(JournalEvent event, uint64_t connection, int id, int other = -1,
+             const std::string& name = std::string());
+
+  // reader: maps file read only
+  static const JournalHeader* Map(const std::string& file, size_t& size);
+  static void Unmap(const JournalHeader* header, size_t size);
+  static const JournalRecord* Records(const JournalHeader* header);
+  static const char* Name(uint16_t event);
+
+private:
+  JournalHeader* m_header;
+  JournalRecord* m_records;
+  size_t m_size;
+  int32_t m_pid;
+};
+
+// the server's journal, nullptr when journaling is off
+extern EventJournal* g_journal;
+
+inline void Journal(JournalEvent event, uint64_t connection, int id,
+                    int other = -1, const std::string& name = std::string())
+{
+  if (g_journal)
+    g_journal->Write(event, connection, id, other, name);
+}
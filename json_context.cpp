@@ -0,0 +1,57 @@
+#include "json_context.h"
+
+JsonContext& JsonContext::Local()
+{
+  static thread_local JsonContext context;
+  return context;
+}
+
+JsonContext::JsonContext()
+  : m_events(m_no_handler), m_buf(m_out), m_stream(&m_buf)
+{
+  Json::CharReaderBuilder reader;
+  reader["collectComments"] = false;
+  m_reader.reset(reader.newCharReader());
+
+  Json::StreamWriterBuilder writer;
+  writer["indentation"] = "";
+  writer["emitUTF8"] = true;
+  m_writer.reset(writer.newStreamWriter());
+}
+
+bool JsonContext::Parse(char* begin, char* end, Json::Value* root)
+{
+  return m_reader->parseInSitu(begin, end, root, nullptr);
+}
+
+Json::EventReader::Status JsonContext::Scan(const char* begin,
+                                            const char* end,
+                                            Json::EventHandler& handler)
+{
+  m_events.reset(handler);
+  Json::EventReader::Status status = m_events.feed(begin, end);
+  if (status == Json::EventReader::needMore)
+    status = m_events.finish();
+  m_events.reset(m_no_handler);
+  return status;
+}
+
+const std::string& JsonContext::Write(const Json::Value& value)
+{
+  m_out.clear();
+  m_writer->write(value, &m_stream);
+  return m_out;
+}
+
+JsonContext::StringBuf::int_type JsonContext::StringBuf::overflow(int_type c)
+{
+  if (!traits_type::eq_int_type(c, traits_type::eof()))
+    m_out += traits_type::to_char_type(c);
+  return traits_type::not_eof(c);
+}
+
+std::streamsize JsonContext::StringBuf::xsputn(const char* s, std::streamsize n)
+{
+  m_out.append(s, static_cast<size_t>(n));
+  return n;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <json/reader.h>
+#include <json/writer.h>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+/* JSON reader and writer state of one thread.
+ *
+ * Kept across frames so that the reader's node stack, the event reader's
+ * buffers and the output string are allocated once per thread instead of once
+ * per message. Everything handed out stays valid until the next call on the
+ * same thread.
+ */
+class JsonContext
+{
+public:
+  static JsonContext& Local();
+
+  // in situ parse, see Json::CharReader::parseInSitu
+  bool Parse(char* begin, char* end, Json::Value* root);
+
+  // feeds [begin, end) as a whole document to handler
+  Json::EventReader::Status Scan(const char* begin, const char* end,
+                                 Json::EventHandler& handler);
+
+  // compact JSON text of value
+  const std::string& Write(const Json::Value& value);
+
+private:
+  // appends everything written to the stream to m_out
+  class StringBuf : public std::streambuf
+  {
+  public:
+    explicit StringBuf(std::string& out) : m_out(out) {}
+
+  protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+  private:
+    std::string& m_out;
+  };
+
+  JsonContext();
+  JsonContext(const JsonContext&) = delete;
+  JsonContext& operator=(const JsonContext&) = delete;
+
+  std::unique_ptr<Json::CharReader> m_reader;
+  std::unique_ptr<Json::StreamWriter> m_writer;
+  Json::EventHandler m_no_handler;
+  Json::EventReader m_events;
+  std::string m_out;
+  StringBuf m_buf;
+  std::ostream m_stream;
+};
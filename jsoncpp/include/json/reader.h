@@ -263,6 +263,24 @@ public:
   virtual bool parse(char const* beginDoc, char const* endDoc, Value* root,
                      String* errs) = 0;
 
+  /** \brief Read a Value from a mutable <a HREF="http://www.json.org">JSON</a>
+   * document without copying its strings.
+   *
+   * String values and object member names are unescaped in place inside
+   * [beginDoc, endDoc), null-terminated over their closing quote and then
+   * referenced by \p root the same way a StaticString is. The document must
+   * therefore outlive \p root and every copy made of it, and it is no longer
+   * valid JSON once parsed. A string containing an embedded zero is still
+   * copied.
+   *
+   * The default implementation forwards to parse().
+   *
+   * \return \c true if the document was successfully parsed, \c false if an
+   * error occurred.
+   */
+  virtual bool parseInSitu(char* beginDoc, char* endDoc, Value* root,
+                           String* errs);
+
   class JSON_API Factory {
   public:
     virtual ~Factory() = default;
@@ -361,6 +379,129 @@ public:
   static void strictMode(Json::Value* settings);
 };
 
+/** \brief Receives the events of an EventReader.
+ *
+ * Every callback returns \c true to continue and \c false to stop the parse
+ * early, in which case EventReader::feed() returns EventReader::stopped.
+ * The [begin, end) ranges passed to key() and string() hold the unescaped
+ * UTF-8 text and are only valid during the call.
+ */
+class JSON_API EventHandler {
+public:
+  virtual ~EventHandler() = default;
+
+  virtual bool null() { return true; }
+  virtual bool boolean(bool /*value*/) { return true; }
+  /// \p value is an intValue, uintValue or realValue.
+  virtual bool number(const Value& /*value*/) { return true; }
+  virtual bool string(char const* /*begin*/, char const* /*end*/) {
+    return true;
+  }
+  virtual bool startObject() { return true; }
+  virtual bool key(char const* /*begin*/, char const* /*end*/) {
+    return true;
+  }
+  virtual bool endObject() { return true; }
+  virtual bool startArray() { return true; }
+  virtual bool endArray() { return true; }
+};
+
+/** \brief Incremental <a HREF="http://www.json.org">JSON</a> reader that
+ * reports the document to an EventHandler instead of building a Value.
+ *
+ * The document may be split into any number of fragments, each passed to
+ * feed() in order. A token cut by a fragment boundary is kept until the
+ * fragment that completes it arrives. Strings without escape sequences that
+ * lie within a single fragment are reported without being copied.
+ *
+ * Usage:
+ *   \code
+ *   Json::EventReader reader(handler);
+ *   for (auto& fragment : fragments)
+ *     if (reader.feed(fragment.data(), fragment.data() + fragment.size()) !=
+ *         Json::EventReader::needMore)
+ *       break;
+ *   if (reader.finish() == Json::EventReader::failed)
+ *     std::cerr << reader.getFormattedErrorMessages();
+ *   \endcode
+ *
+ * Only standard JSON is accepted: no comments, trailing commas or special
+ * floats. Parsing ends with the first complete value; anything after it is
+ * ignored.
+ */
+class JSON_API EventReader {
+public:
+  enum Status {
+    needMore = 0, ///< the value is not complete yet, feed() more input
+    complete,     ///< a whole value was read
+    stopped,      ///< a handler callback returned false
+    failed        ///< syntax error, see getFormattedErrorMessages()
+  };
+
+  /** \param stackLimit Maximum nesting of objects and arrays. Deeper input
+   *                   fails instead of growing the stack without bound.
+   */
+  explicit EventReader(EventHandler& handler, size_t stackLimit = 1000);
+
+  /// Parse the next fragment of the document.
+  Status feed(char const* begin, char const* end);
+  /// Signal the end of the input. A value that is still incomplete fails.
+  Status finish();
+  /// Forget all state to read a new document with the same handler.
+  void reset();
+  /// Forget all state to read a new document with another handler. The
+  /// buffers grown by earlier documents are kept.
+  void reset(EventHandler& handler);
+
+  Status status() const { return status_; }
+  /// Number of input bytes fed so far, over all fragments.
+  ptrdiff_t offset() const { return offset_; }
+  /// An empty string unless status() is #failed.
+  String getFormattedErrorMessages() const;
+
+private:
+  enum State {
+    expectValue = 0,
+    expectValueOrArrayEnd,
+    expectCommaOrArrayEnd,
+    expectKeyOrObjectEnd,
+    expectKey,
+    expectColon,
+    expectCommaOrObjectEnd,
+    expectNothing
+  };
+
+  EventReader(EventReader const&);      // no impl
+  void operator=(EventReader const&); // no impl
+
+  static const char* scanToken(const char* current, const char* end,
+                               char kind, bool escaped);
+  bool readToken(const char* begin, const char* end);
+  bool readString(const char* begin, const char* end);
+  bool readNumber(const char* begin, const char* end);
+  bool readLiteral(const char* begin, const char* end);
+  bool unescape(const char* current, const char* end);
+  bool endValue();
+  bool expectingValue() const;
+  bool stop();
+  bool unexpectedToken();
+  bool addError(const String& message);
+
+  EventHandler* handler_;
+  size_t const stackLimit_;
+  std::vector<char> stack_;
+  State state_{expectValue};
+  Status status_{needMore};
+  // Start of a token cut at the end of the previous fragment.
+  String pending_;
+  // Unescaped text of the current string token, if it needed unescaping.
+  String decoded_;
+  String error_;
+  ptrdiff_t offset_{};
+  // Offset of the token being read, for error messages.
+  ptrdiff_t tokenOffset_{};
+};
+
 /** Consume entire stream and use its begin/end.
  * Someday we might have a real StreamReader, but for now this
  * is convenient.
@@ -892,6 +892,8 @@ public:
   explicit OurReader(OurFeatures const& features);
   bool parse(const char* beginDoc, const char* endDoc, Value& root,
              bool collectComments = true);
+  bool parseInSitu(char* beginDoc, char* endDoc, Value& root,
+                   bool collectComments = true);
   String getFormattedErrorMessages() const;
   std::vector<StructuredError> getStructuredErrors() const;
 
@@ -935,6 +937,8 @@ private:
 
   using Errors = std::deque<ErrorInfo>;
 
+  bool readDocument(const char* beginDoc, const char* endDoc, Value& root,
+                    bool collectComments);
   bool readToken(Token& token);
   void skipSpaces();
   void skipBom(bool skipBom);
@@ -952,6 +956,7 @@ private:
   bool decodeNumber(Token& token, Value& decoded);
   bool decodeString(Token& token);
   bool decodeString(Token& token, String& decoded);
+  bool decodeStringInSitu(Token& token, Location& decoded, size_t& length);
   bool decodeDouble(Token& token);
   bool decodeDouble(Token& token, Value& decoded);
   bool decodeUnicodeCodePoint(Token& token, Location& current, Location end,
@@ -984,6 +989,8 @@ private:
   Location current_ = nullptr;
   Location lastValueEnd_ = nullptr;
   Value* lastValue_ = nullptr;
+  // Writable alias of begin_ while parsing in situ, nullptr otherwise.
+  Char* inSitu_ = nullptr;
   bool lastValueHasAComment_ = false;
   String commentsBefore_{};
 
@@ -1002,6 +1009,18 @@ OurReader::OurReader(OurFeatures const& features) : features_(features) {}
 
 bool OurReader::parse(const char* beginDoc, const char* endDoc, Value& root,
                       bool collectComments) {
+  inSitu_ = nullptr;
+  return readDocument(beginDoc, endDoc, root, collectComments);
+}
+
+bool OurReader::parseInSitu(char* beginDoc, char* endDoc, Value& root,
+                            bool collectComments) {
+  inSitu_ = beginDoc;
+  return readDocument(beginDoc, endDoc, root, collectComments);
+}
+
+bool OurReader::readDocument(const char* beginDoc, const char* endDoc,
+                             Value& root, bool collectComments) {
   if (!features_.allowComments_) {
     collectComments = false;
   }
@@ -1439,6 +1458,8 @@ bool OurReader::readStringSingleQuote() {
 bool OurReader::readObject(Token& token) {
   Token tokenName;
   String name;
+  // In situ member name, used instead of 'name' when not null.
+  Location view = nullptr;
   Value init(objectValue);
   currentValue().swapPayload(init);
   currentValue().setOffsetStart(token.start_ - begin_);
@@ -1449,11 +1470,22 @@ bool OurReader::readObject(Token& token) {
     if (!initialTokenOk)
       break;
     if (tokenName.type_ == tokenObjectEnd &&
-        (name.empty() ||
+        ((name.empty() && view == nullptr) ||
          features_.allowTrailingCommas_)) // empty object or trailing comma
       return true;
     name.clear();
-    if (tokenName.type_ == tokenString) {
+    view = nullptr;
+    if (tokenName.type_ == tokenString && inSitu_ != nullptr) {
+      size_t length;
+      if (!decodeStringInSitu(tokenName, view, length))
+        return recoverFromError(tokenObjectEnd);
+      if (length >= (1U << 30))
+        throwRuntimeError("keylength >= 2^30");
+      if (std::memchr(view, 0, length) != nullptr) {
+        name.assign(view, length);
+        view = nullptr;
+      }
+    } else if (tokenName.type_ == tokenString) {
       if (!decodeString(tokenName, name))
         return recoverFromError(tokenObjectEnd);
     } else if (tokenName.type_ == tokenNumber && features_.allowNumericKeys_) {
@@ -1466,8 +1498,11 @@ bool OurReader::readObject(Token& token) {
     }
     if (name.length() >= (1U << 30))
       throwRuntimeError("keylength >= 2^30");
-    if (features_.rejectDupKeys_ && currentValue().isMember(name)) {
-      String msg = "Duplicate key: '" + name + "'";
+    if (features_.rejectDupKeys_ &&
+        (view != nullptr ? currentValue().isMember(view)
+                         : currentValue().isMember(name))) {
+      String msg = "Duplicate key: '" +
+                   (view != nullptr ? String(view) : name) + "'";
       return addErrorAndRecover(msg, tokenName, tokenObjectEnd);
     }
 
@@ -1476,7 +1511,8 @@ bool OurReader::readObject(Token& token) {
       return addErrorAndRecover("Missing ':' after object member name", colon,
                                 tokenObjectEnd);
     }
-    Value& value = currentValue()[name];
+    Value& value = view != nullptr ? currentValue()[StaticString(view)]
+                                   : currentValue()[name];
     nodes_.push(&value);
     bool ok = readValue();
     nodes_.pop();
@@ -1655,10 +1691,23 @@ bool OurReader::decodeDouble(Token& token, Value& decoded) {
 }
 
 bool OurReader::decodeString(Token& token) {
-  String decoded_string;
-  if (!decodeString(token, decoded_string))
-    return false;
-  Value decoded(decoded_string);
+  Value decoded;
+  if (inSitu_ != nullptr) {
+    Location view;
+    size_t length;
+    if (!decodeStringInSitu(token, view, length))
+      return false;
+    // A static string is null-terminated, so embedded zeroes need a copy.
+    if (std::memchr(view, 0, length) == nullptr)
+      decoded = Value(StaticString(view));
+    else
+      decoded = Value(view, view + length);
+  } else {
+    String decoded_string;
+    if (!decodeString(token, decoded_string))
+      return false;
+    decoded = Value(decoded_string);
+  }
   currentValue().swapPayload(decoded);
   currentValue().setOffsetStart(token.start_ - begin_);
   currentValue().setOffsetLimit(token.end_ - begin_);
@@ -1718,6 +1767,68 @@ bool OurReader::decodeString(Token& token, String& decoded) {
   return true;
 }
 
+// Unescapes the string token over its own bytes and null-terminates it in
+// place of the closing quote. An escape sequence never decodes to more bytes
+// than it occupies, so the output can never overtake the input.
+bool OurReader::decodeStringInSitu(Token& token, Location& decoded,
+                                   size_t& length) {
+  Location current = token.start_ + 1; // skip '"'
+  Location end = token.end_ - 1;       // do not include '"'
+  Char* const begin = inSitu_ + (current - begin_);
+  Char* out = begin;
+  while (current != end) {
+    Char c = *current++;
+    if (c == '"')
+      break;
+    if (c == '\\') {
+      if (current == end)
+        return addError("Empty escape sequence in string", token, current);
+      Char escape = *current++;
+      switch (escape) {
+      case '"':
+        *out++ = '"';
+        break;
+      case '/':
+        *out++ = '/';
+        break;
+      case '\\':
+        *out++ = '\\';
+        break;
+      case 'b':
+        *out++ = '\b';
+        break;
+      case 'f':
+        *out++ = '\f';
+        break;
+      case 'n':
+        *out++ = '\n';
+        break;
+      case 'r':
+        *out++ = '\r';
+        break;
+      case 't':
+        *out++ = '\t';
+        break;
+      case 'u': {
+        unsigned int unicode;
+        if (!decodeUnicodeCodePoint(token, current, end, unicode))
+          return false;
+        String utf8 = codePointToUTF8(unicode);
+        out = std::copy(utf8.begin(), utf8.end(), out);
+      } break;
+      default:
+        return addError("Bad escape sequence in string", token, current);
+      }
+    } else {
+      *out++ = c;
+    }
+  }
+  *out = 0;
+  decoded = begin;
+  length = static_cast<size_t>(out - begin);
+  return true;
+}
+
 bool OurReader::decodeUnicodeCodePoint(Token& token, Location& current,
                                        Location end, unsigned int& unicode) {
 
@@ -1875,8 +1986,21 @@ public:
     }
     return ok;
   }
+  bool parseInSitu(char* beginDoc, char* endDoc, Value* root,
+                   String* errs) override {
+    bool ok = reader_.parseInSitu(beginDoc, endDoc, *root, collectComments_);
+    if (errs) {
+      *errs = reader_.getFormattedErrorMessages();
+    }
+    return ok;
+  }
 };
 
+bool CharReader::parseInSitu(char* beginDoc, char* endDoc, Value* root,
+                             String* errs) {
+  return parse(beginDoc, endDoc, root, errs);
+}
+
 CharReaderBuilder::CharReaderBuilder() { setDefaults(&settings_); }
 CharReaderBuilder::~CharReaderBuilder() = default;
 CharReader* CharReaderBuilder::newCharReader() const {
@@ -1964,6 +2088,393 @@ void CharReaderBuilder::setDefaults(Json::Value* settings) {
   //! [CharReaderBuilderDefaults]
 }
 
+// Implementation of class EventReader
+// ////////////////////////////////
+
+// Classifies the first character of a token that can span several bytes:
+// '"' for strings, '0' for numbers, 'a' for literals and 0 otherwise.
+static char eventTokenKind(char c) {
+  if (c == '"')
+    return '"';
+  if (c == '-' || (c >= '0' && c <= '9'))
+    return '0';
+  if (c >= 'a' && c <= 'z')
+    return 'a';
+  return 0;
+}
+
+static bool decodeHexQuad(const char*& current, const char* end,
+                          unsigned int& unicode) {
+  if (end - current < 4)
+    return false;
+  unicode = 0;
+  for (int index = 0; index < 4; ++index) {
+    char c = *current++;
+    unicode *= 16;
+    if (c >= '0' && c <= '9')
+      unicode += static_cast<unsigned int>(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      unicode += static_cast<unsigned int>(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F')
+      unicode += static_cast<unsigned int>(c - 'A' + 10);
+    else
+      return false;
+  }
+  return true;
+}
+
+// Same result as OurReader::decodeNumber(): integers that fit are kept
+// exact, everything else is read as a double.
+static bool decodeEventNumber(const char* begin, const char* end,
+                              Value& decoded) {
+  const char* current = begin;
+  const bool isNegative = *current == '-';
+  if (isNegative)
+    ++current;
+  if (current == end)
+    return false;
+  const Value::LargestUInt limit =
+      isNegative ? Value::LargestUInt(Value::maxLargestInt) + 1
+                 : Value::maxLargestUInt;
+  Value::LargestUInt value = 0;
+  for (; current != end; ++current) {
+    if (*current < '0' || *current > '9')
+      break;
+    const auto digit = static_cast<Value::UInt>(*current - '0');
+    if (value > (limit - digit) / 10)
+      break;
+    value = value * 10 + digit;
+  }
+  if (current == end) {
+    if (isNegative)
+      decoded = value == 0 ? Value::LargestInt(0)
+                           : -Value::LargestInt(value - 1) - 1;
+    else if (value <= Value::LargestUInt(Value::maxLargestInt))
+      decoded = Value::LargestInt(value);
+    else
+      decoded = value;
+    return true;
+  }
+  double real = 0;
+  IStringStream is(String(begin, end));
+  if (!(is >> real) || !is.eof())
+    return false;
+  decoded = real;
+  return true;
+}
+
+EventReader::EventReader(EventHandler& handler, size_t stackLimit)
+    : handler_(&handler), stackLimit_(stackLimit) {}
+
+EventReader::Status EventReader::feed(char const* begin, char const* end) {
+  if (status_ != needMore)
+    return status_;
+  const char* current = begin;
+  if (!pending_.empty()) {
+    bool escaped = false;
+    char kind = eventTokenKind(pending_[0]);
+    if (kind == '"') {
+      for (size_t index = 1; index < pending_.size(); ++index)
+        escaped = !escaped && pending_[index] == '\\';
+    }
+    const char* stop = scanToken(current, end, kind, escaped);
+    if (stop == nullptr) {
+      pending_.append(begin, end);
+      offset_ += end - begin;
+      return status_;
+    }
+    pending_.append(begin, stop);
+    current = stop;
+    readToken(pending_.data(), pending_.data() + pending_.size());
+    pending_.clear();
+  }
+  while (status_ == needMore) {
+    while (current != end && (*current == ' ' || *current == '\t' ||
+                              *current == '\r' || *current == '\n'))
+      ++current;
+    if (current == end)
+      break;
+    tokenOffset_ = offset_ + (current - begin);
+    char kind = eventTokenKind(*current);
+    const char* stop =
+        kind == 0 ? current + 1 : scanToken(current + 1, end, kind, false);
+    if (stop == nullptr) {
+      pending_.assign(current, end);
+      break;
+    }
+    readToken(current, stop);
+    current = stop;
+  }
+  offset_ += end - begin;
+  return status_;
+}
+
+EventReader::Status EventReader::finish() {
+  if (status_ == needMore && !pending_.empty() &&
+      eventTokenKind(pending_[0]) != '"') {
+    readToken(pending_.data(), pending_.data() + pending_.size());
+    pending_.clear();
+  }
+  if (status_ == needMore) {
+    tokenOffset_ = offset_;
+    addError("Unexpected end of input.");
+  }
+  return status_;
+}
+
+void EventReader::reset(EventHandler& handler) {
+  handler_ = &handler;
+  reset();
+}
+
+void EventReader::reset() {
+  stack_.clear();
+  state_ = expectValue;
+  status_ = needMore;
+  pending_.clear();
+  error_.clear();
+  offset_ = 0;
+  tokenOffset_ = 0;
+}
+
+String EventReader::getFormattedErrorMessages() const { return error_; }
+
+// Returns the end of the token of the given kind that continues at current,
+// or nullptr if the input ends before the token does.
+const char* EventReader::scanToken(const char* current, const char* end,
+                                   char kind, bool escaped) {
+  for (; current != end; ++current) {
+    char c = *current;
+    if (kind == '"') {
+      if (escaped)
+        escaped = false;
+      else if (c == '\\')
+        escaped = true;
+      else if (c == '"')
+        return current + 1;
+    } else if (kind == '0') {
+      if ((c < '0' || c > '9') && c != '.' && c != 'e' && c != 'E' &&
+          c != '+' && c != '-')
+        return current;
+    } else if (c < 'a' || c > 'z') {
+      return current;
+    }
+  }
+  return nullptr;
+}
+
+bool EventReader::readToken(const char* begin, const char* end) {
+  switch (*begin) {
+  case '{':
+    if (!expectingValue())
+      return unexpectedToken();
+    if (stack_.size() >= stackLimit_)
+      return addError("Exceeded stackLimit.");
+    stack_.push_back('{');
+    state_ = expectKeyOrObjectEnd;
+    return handler_->startObject() || stop();
+  case '[':
+    if (!expectingValue())
+      return unexpectedToken();
+    if (stack_.size() >= stackLimit_)
+      return addError("Exceeded stackLimit.");
+    stack_.push_back('[');
+    state_ = expectValueOrArrayEnd;
+    return handler_->startArray() || stop();
+  case '}':
+    if (state_ != expectKeyOrObjectEnd && state_ != expectCommaOrObjectEnd)
+      return unexpectedToken();
+    stack_.pop_back();
+    if (!handler_->endObject())
+      return stop();
+    return endValue();
+  case ']':
+    if (state_ != expectValueOrArrayEnd && state_ != expectCommaOrArrayEnd)
+      return unexpectedToken();
+    stack_.pop_back();
+    if (!handler_->endArray())
+      return stop();
+    return endValue();
+  case ':':
+    if (state_ != expectColon)
+      return unexpectedToken();
+    state_ = expectValue;
+    return true;
+  case ',':
+    if (state_ == expectCommaOrObjectEnd)
+      state_ = expectKey;
+    else if (state_ == expectCommaOrArrayEnd)
+      state_ = expectValue;
+    else
+      return unexpectedToken();
+    return true;
+  case '"':
+    return readString(begin, end);
+  default:
+    break;
+  }
+  if (eventTokenKind(*begin) == '0')
+    return readNumber(begin, end);
+  if (eventTokenKind(*begin) == 'a')
+    return readLiteral(begin, end);
+  return unexpectedToken();
+}
+
+bool EventReader::readString(const char* begin, const char* end) {
+  const bool isKey = state_ == expectKey || state_ == expectKeyOrObjectEnd;
+  if (!isKey && !expectingValue())
+    return unexpectedToken();
+  ++begin; // skip '"'
+  --end;   // do not include '"'
+  if (std::find(begin, end, '\\') != end) {
+    if (!unescape(begin, end))
+      return false;
+    begin = decoded_.data();
+    end = begin + decoded_.size();
+  }
+  if (isKey) {
+    state_ = expectColon;
+    return handler_->key(begin, end) || stop();
+  }
+  if (!handler_->string(begin, end))
+    return stop();
+  return endValue();
+}
+
+bool EventReader::readNumber(const char* begin, const char* end) {
+  if (!expectingValue())
+    return unexpectedToken();
+  Value decoded;
+  if (!decodeEventNumber(begin, end, decoded))
+    return addError("'" + String(begin, end) + "' is not a number.");
+  if (!handler_->number(decoded))
+    return stop();
+  return endValue();
+}
+
+bool EventReader::readLiteral(const char* begin, const char* end) {
+  if (!expectingValue())
+    return unexpectedToken();
+  const String literal(begin, end);
+  bool proceed;
+  if (literal == "true")
+    proceed = handler_->boolean(true);
+  else if (literal == "false")
+    proceed = handler_->boolean(false);
+  else if (literal == "null")
+    proceed = handler_->null();
+  else
+    return unexpectedToken();
+  if (!proceed)
+    return stop();
+  return endValue();
+}
+
+bool EventReader::unescape(const char* current, const char* end) {
+  decoded_.clear();
+  while (current != end) {
+    const char* escape = std::find(current, end, '\\');
+    decoded_.append(current, escape);
+    if (escape == end)
+      break;
+    current = escape + 1;
+    if (current == end)
+      return addError("Empty escape sequence in string");
+    switch (*current++) {
+    case '"':
+      decoded_ += '"';
+      break;
+    case '/':
+      decoded_ += '/';
+      break;
+    case '\\':
+      decoded_ += '\\';
+      break;
+    case 'b':
+      decoded_ += '\b';
+      break;
+    case 'f':
+      decoded_ += '\f';
+      break;
+    case 'n':
+      decoded_ += '\n';
+      break;
+    case 'r':
+      decoded_ += '\r';
+      break;
+    case 't':
+      decoded_ += '\t';
+      break;
+    case 'u': {
+      unsigned int unicode;
+      if (!decodeHexQuad(current, end, unicode))
+        return addError(
+            "Bad unicode escape sequence in string: four digits expected.");
+      if (unicode >= 0xD800 && unicode <= 0xDBFF) {
+        unsigned int surrogatePair;
+        if (end - current < 6 || current[0] != '\\' || current[1] != 'u')
+          return addError("expecting another \\u token to begin the second "
+                          "half of a unicode surrogate pair");
+        current += 2;
+        if (!decodeHexQuad(current, end, surrogatePair))
+          return addError(
+              "Bad unicode escape sequence in string: four digits expected.");
+        unicode = 0x10000 + ((unicode & 0x3FF) << 10) + (surrogatePair & 0x3FF);
+      }
+      decoded_ += codePointToUTF8(unicode);
+    } break;
+    default:
+      return addError("Bad escape sequence in string");
+    }
+  }
+  return true;
+}
+
+bool EventReader::endValue() {
+  if (stack_.empty()) {
+    state_ = expectNothing;
+    status_ = complete;
+  } else {
+    state_ = stack_.back() == '{' ? expectCommaOrObjectEnd
+                                  : expectCommaOrArrayEnd;
+  }
+  return true;
+}
+
+bool EventReader::expectingValue() const {
+  return state_ == expectValue || state_ == expectValueOrArrayEnd;
+}
+
+bool EventReader::stop() {
+  status_ = stopped;
+  return false;
+}
+
+// Reports a token that the current state does not accept.
+bool EventReader::unexpectedToken() {
+  switch (state_) {
+  case expectColon:
+    return addError("Missing ':' after object member name");
+  case expectCommaOrObjectEnd:
+    return addError("Missing ',' or '}' in object declaration");
+  case expectCommaOrArrayEnd:
+    return addError("Missing ',' or ']' in array declaration");
+  case expectKeyOrObjectEnd:
+  case expectKey:
+    return addError("Missing '}' or object member name");
+  default:
+    return addError("Syntax error: value, object or array expected.");
+  }
+}
+
+bool EventReader::addError(const String& message) {
+  OStringStream oss;
+  oss << "* Offset " << tokenOffset_ << "\n  " << message << "\n";
+  error_ = oss.str();
+  status_ = failed;
+  return false;
+}
+
 //////////////////////////////////
 // global functions
 
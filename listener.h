@@ -0,0 +1,198 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+#include <websocketpp/common/connection_hdl.hpp>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "small_block.h"
+
+// TCP options of one listener and of the connections it accepts
+struct socket_options {
+  int backlog = boost::asio::socket_base::max_connections;
+  bool nodelay = true;    // TCP_NODELAY on accepted connections
+  int defer_accept = 0;   // s, accept only once the client has sent data
+  int fastopen = 0;       // TCP Fast Open queue, 0 off
+  int rcvbuf = 0;         // bytes, set on the listener so that accepted
+  int sndbuf = 0;         // connections inherit them, 0 keeps autotuning
+  int user_timeout = 0;   // ms sent data may stay unacknowledged, 0 off
+};
+
+// false with error set if options can not be applied on this system
+inline bool check_socket_options(const socket_options& options,
+                                 std::string& error) {
+  const int kMaxBuffer = 64 * 1024 * 1024;
+  if (options.backlog <= 0)
+    error = "backlog must be positive";
+  else if (options.defer_accept < 0 || options.fastopen < 0
+           || options.user_timeout < 0)
+    error = "defer_accept, fastopen and user_timeout can not be negative";
+  else if (options.rcvbuf < 0 || options.rcvbuf > kMaxBuffer
+           || options.sndbuf < 0 || options.sndbuf > kMaxBuffer)
+    error = "rcvbuf and sndbuf must be between 0 and 64MB";
+#ifndef TCP_DEFER_ACCEPT
+  else if (options.defer_accept != 0)
+    error = "defer_accept is not supported here";
+#endif
+#ifndef TCP_FASTOPEN
+  else if (options.fastopen != 0)
+    error = "fastopen is not supported here";
+#endif
+#ifndef TCP_USER_TIMEOUT
+  else if (options.user_timeout != 0)
+    error = "user_timeout is not supported here";
+#endif
+  else
+    return true;
+  return false;
+}
+
+// websocketpp's socket init handler, for plain and tls sockets alike
+struct socket_init {
+  explicit socket_init(const socket_options& options) : options_(options) {}
+
+  template <typename socket_type>
+  void operator()(websocketpp::connection_hdl, socket_type& socket) const {
+    int fd = socket.lowest_layer().native_handle();
+    if (options_.nodelay)
+      set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+#ifdef TCP_USER_TIMEOUT
+    if (options_.user_timeout != 0)
+      set(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, options_.user_timeout,
+          "TCP_USER_TIMEOUT");
+#endif
+  }
+
+  static bool set(int fd, int level, int name, int value, const char* what) {
+    if (::setsockopt(fd, level, name, &value, sizeof(value)) == 0)
+      return true;
+    BOOST_LOG_TRIVIAL(warning) << what << ": " << std::strerror(errno);
+    return false;
+  }
+
+  socket_options options_;
+};
+
+/* Accept loop of one websocketpp endpoint on a listening socket that the
+ * server owns instead of websocketpp. The socket can be bound here or be one
+ * inherited from another process (see handoff.h), accepted connections are
+ * started on the endpoint the same way its own accept loop would.
+ */
+template <typename server_type>
+class listener {
+public:
+  typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>
+    reuse_port;
+
+  listener(boost::asio::io_service& ios, server_type& server)
+    : acceptor_(ios), server_(server), reuse_port_(false), paused_(false) {}
+
+  // several processes bind the same port and the kernel spreads connections
+  void set_reuse_port(bool value) { reuse_port_ = value; }
+
+  // used by the next listen or assign
+  void set_options(const socket_options& options) { options_ = options; }
+
+  // bind to port on all interfaces, throws boost::system::system_error
+  void listen(uint16_t port) {
+    boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v6(), port);
+    acceptor_.open(ep.protocol());
+    if (reuse_port_)
+      acceptor_.set_option(reuse_port(true));
+    if (options_.rcvbuf != 0)
+      acceptor_.set_option(boost::asio::socket_base::receive_buffer_size(options_.rcvbuf));
+    if (options_.sndbuf != 0)
+      acceptor_.set_option(boost::asio::socket_base::send_buffer_size(options_.sndbuf));
+    acceptor_.bind(ep);
+    acceptor_.listen(options_.backlog);
+    apply_listen_options();
+  }
+
+  // take over fd, a socket that is already listening
+  void assign(int fd) {
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+      throw boost::system::system_error(errno, boost::system::system_category());
+    acceptor_.assign(addr.ss_family == AF_INET6 ? boost::asio::ip::tcp::v6()
+                                                : boost::asio::ip::tcp::v4(),
+                     fd);
+    // backlog and buffers stay as the previous owner set them
+    apply_listen_options();
+  }
+
+  void start_accept() {
+    typename server_type::connection_ptr con = server_.get_connection();
+    if (!con) {
+      BOOST_LOG_TRIVIAL(error) << "accept: no connection";
+      return;
+    }
+    acceptor_.async_accept(con->get_raw_socket(),
+      make_pooled_handler([this, con](const boost::system::error_code& ec) {
+        handle_accept(con, ec);
+      }));
+  }
+
+  // connections wait in the backlog until resume
+  void pause() {
+    paused_ = true;
+    boost::system::error_code ec;
+    acceptor_.cancel(ec);
+  }
+
+  void resume() {
+    if (!paused_ || !acceptor_.is_open())
+      return;
+    paused_ = false;
+    start_accept();
+  }
+
+  bool paused() const { return paused_; }
+
+  // closes the socket, connections already accepted stay open
+  void stop() {
+    boost::system::error_code ec;
+    acceptor_.close(ec);
+  }
+
+  bool is_open() const { return acceptor_.is_open(); }
+  int native_handle() { return acceptor_.is_open() ? acceptor_.native_handle() : -1; }
+
+private:
+  void apply_listen_options() {
+    int fd = acceptor_.native_handle();
+#ifdef TCP_DEFER_ACCEPT
+    if (options_.defer_accept != 0)
+      socket_init::set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options_.defer_accept,
+                       "TCP_DEFER_ACCEPT");
+#endif
+#ifdef TCP_FASTOPEN
+    if (options_.fastopen != 0)
+      socket_init::set(fd, IPPROTO_TCP, TCP_FASTOPEN, options_.fastopen,
+                       "TCP_FASTOPEN");
+#endif
+    (void)fd;
+  }
+
+  void handle_accept(typename server_type::connection_ptr con,
+                     const boost::system::error_code& ec) {
+    if (ec == boost::asio::error::operation_aborted || !acceptor_.is_open())
+      return;
+    if (ec)
+      BOOST_LOG_TRIVIAL(error) << "accept: " << ec.message();
+    else
+      con->start();
+    if (!paused_)
+      start_accept();
+  }
+
+  boost::asio::ip::tcp::acceptor acceptor_;
+  server_type& server_;
+  bool reuse_port_;
+  bool paused_;
+  socket_options options_;
+};
@@ -0,0 +1,78 @@
+#include "mailbox.h"
+#include <vector>
+
+mailbox_limits g_mailbox_limits;
+
+bool MailboxTable::Hold(Letter&& letter, const Visit& dropped)
+{
+  size_t size = letter.text.size();
+  if (m_bytes + size > g_mailbox_limits.budget
+      || size > g_mailbox_limits.bytes || g_mailbox_limits.frames == 0)
+    return false;
+  // the visits may hold letters of their own, they run once the table is
+  // consistent
+  std::vector<Letter> out;
+  Box& box = m_boxes[letter.to];
+  while (!box.letters.empty()
+         && (box.letters.size() + 1 > g_mailbox_limits.frames
+             || box.bytes + size > g_mailbox_limits.bytes))
+    out.push_back(Pop(box));
+  box.bytes += size;
+  box.letters.push_back(std::move(letter));
+  m_bytes += size;
+  ++m_letters;
+  for (const Letter& l : out)
+    dropped(l);
+  return true;
+}
+
+void MailboxTable::Deliver(int to, Clock::time_point now, const Visit& deliver,
+                           const Visit& expired)
+{
+  auto it = m_boxes.find(to);
+  if (it == m_boxes.end())
+    return;
+  Box box = std::move(it->second);
+  m_boxes.erase(it);
+  while (!box.letters.empty())
+  {
+    Letter letter = Pop(box);
+    if (letter.deadline < now)
+      expired(letter);
+    else
+      deliver(letter);
+  }
+}
+
+void MailboxTable::Expire(Clock::time_point now, const Visit& expired)
+{
+  std::vector<Letter> out;
+  for (auto it = m_boxes.begin(); it != m_boxes.end();)
+  {
+    Box& box = it->second;
+    // letters are held in deadline order
+    while (!box.letters.empty() && box.letters.front().deadline < now)
+      out.push_back(Pop(box));
+    if (box.letters.empty())
+      it = m_boxes.erase(it);
+    else
+      ++it;
+  }
+  for (const Letter& l : out)
+    expired(l);
+}
+
+void MailboxTable::Discard(int to, const Visit& dropped)
+{
+  Deliver(to, Clock::time_point::min(), dropped, dropped);
+}
+
+MailboxTable::Letter MailboxTable::Pop(Box& box)
+{
+  Letter letter = std::move(box.letters.front());
+  box.letters.pop_front();
+  box.bytes -= letter.text.size();
+  m_bytes -= letter.text.size();
+  --m_letters;
+  return letter;
+}
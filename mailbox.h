@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+/* Store-and-forward for frames to peers that are away for a moment.
+ *
+ * A frame routed to a detached peer (see session.h) waits in the peer's
+ * mailbox and is delivered in order when the peer resumes. A mailbox keeps
+ * at most frames / bytes, past them its oldest letter goes; a letter waits
+ * at most ttl ms; all mailboxes together hold at most budget bytes, a letter
+ * that does not fit is refused. Every letter that leaves a mailbox
+ * undelivered is handed back, so that its sender can be told.
+ */
+struct mailbox_limits {
+  size_t frames = 64;
+  size_t bytes = 256 * 1024;
+  int ttl = 30000;                   // ms
+  size_t budget = 64 * 1024 * 1024;  // bytes over all mailboxes
+};
+
+extern mailbox_limits g_mailbox_limits;
+
+class MailboxTable
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // a held frame
+  struct Letter
+  {
+    int to = -1;
+    int from = -1;
+    int receipt = -1;   // the sender's tag for delivery notices, -1 for none
+    Clock::time_point deadline;
+    std::string text;
+  };
+
+  typedef std::function<void(const Letter&)> Visit;
+
+  // false if the budget is spent and letter was not taken; letters pushed
+  // out of its mailbox go to dropped
+  bool Hold(Letter&& letter, const Visit& dropped);
+  // empties to's mailbox oldest first, letters past their deadline at now
+  // go to expired, the others to deliver
+  void Deliver(int to, Clock::time_point now, const Visit& deliver,
+               const Visit& expired);
+  // removes the letters past their deadline at now
+  void Expire(Clock::time_point now, const Visit& expired);
+  // to is gone for good, its letters go to dropped
+  void Discard(int to, const Visit& dropped);
+
+  size_t Letters() const { return m_letters; }
+  size_t Bytes() const { return m_bytes; }
+
+private:
+  struct Box
+  {
+    std::deque<Letter> letters;
+    size_t bytes = 0;
+  };
+
+  // the oldest letter of box, Box is erased by the callers once empty
+  Letter Pop(Box& box);
+
+  std::unordered_map<int, Box> m_boxes;
+  size_t m_letters = 0;
+  size_t m_bytes = 0;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <websocketpp/common/memory.hpp>
+#include <websocketpp/frame.hpp>
+#include <websocketpp/message_buffer/alloc.hpp>
+#include <websocketpp/message_buffer/message.hpp>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "small_block.h"
+
+/* websocketpp's default con_msg_manager makes a new message, and a new
+ * payload string, for every frame read and every frame sent.
+ *
+ * message_pool keeps released messages in classes by payload capacity,
+ * 128 bytes to 64KB in powers of two, about class_bytes of payload per
+ * class. A message is handed out again with its payload cleared but its
+ * capacity kept, so a steady stream of similar frames reuses the same few
+ * buffers. Larger messages are freed as before. The shared_ptr control
+ * blocks come from small_block_pool.
+ */
+template <typename message>
+class message_pool {
+public:
+  typedef typename message::ptr message_ptr;
+  typedef typename message::con_msg_man_ptr manager_ptr;
+
+  static const size_t min_shift = 7;
+  static const size_t classes = 10;
+  static const size_t class_bytes = 1024 * 1024;
+
+  // never destroyed, messages may outlive static destruction
+  static message_pool& instance() {
+    static message_pool* pool = new message_pool;
+    return *pool;
+  }
+
+  // a message whose payload holds size bytes without growing
+  message_ptr get(const manager_ptr& manager,
+                  websocketpp::frame::opcode::value op, size_t size) {
+    size_t c = class_above(size);
+    message* msg = c < classes ? take(c) : nullptr;
+    if (msg == nullptr)
+      msg = new message(manager, op, c < classes ? class_size(c) : size);
+    else
+      msg->set_opcode(op);
+    return wrap(msg);
+  }
+
+  // the size is not known yet (frames being prepared for sending), the
+  // largest spare message is the least likely to grow
+  message_ptr get(const manager_ptr& manager) {
+    for (size_t c = classes; c-- > 0;) {
+      if (message* msg = take(c))
+        return wrap(msg);
+    }
+    return wrap(new message(manager));
+  }
+
+  // spare messages held, for the stats
+  size_t spare() const {
+    size_t n = 0;
+    for (size_t c = 0; c < classes; ++c)
+      n += spare_[c].load(std::memory_order_relaxed);
+    return n;
+  }
+
+private:
+  struct recycler {
+    void operator()(message* msg) const { instance().put(msg); }
+  };
+
+  message_pool() {
+    for (size_t c = 0; c < classes; ++c) {
+      pool_[c].reserve(class_limit(c));
+      spare_[c] = 0;
+    }
+  }
+
+  static size_t class_size(size_t c) { return size_t(1) << (min_shift + c); }
+  static size_t class_limit(size_t c) { return class_bytes / class_size(c); }
+
+  // smallest class that holds size bytes, classes if none does
+  static size_t class_above(size_t size) {
+    size_t c = 0;
+    while (c < classes && class_size(c) < size)
+      ++c;
+    return c;
+  }
+
+  // largest class a capacity fills, classes if it fits none
+  static size_t class_below(size_t capacity) {
+    if (capacity < class_size(0))
+      return classes;
+    size_t c = 0;
+    while (c < classes && class_size(c + 1) <= capacity)
+      ++c;
+    return c;
+  }
+
+  static message_ptr wrap(message* msg) {
+    return message_ptr(msg, recycler(), small_block_allocator<message>());
+  }
+
+  message* take(size_t c) {
+    if (spare_[c].load(std::memory_order_relaxed) == 0)
+      return nullptr;
+    std::lock_guard<std::mutex> guard(lock_[c]);
+    if (pool_[c].empty())
+      return nullptr;
+    message* msg = pool_[c].back();
+    pool_[c].pop_back();
+    spare_[c].store(pool_[c].size(), std::memory_order_relaxed);
+    return msg;
+  }
+
+  // permessage-deflate is off, its extension data is never set
+  void put(message* msg) {
+    size_t c = class_below(msg->get_raw_payload().capacity());
+    if (c < classes) {
+      msg->get_raw_payload().clear();
+      msg->set_header(std::string());
+      msg->set_prepared(false);
+      msg->set_fin(true);
+      msg->set_terminal(false);
+      msg->set_compressed(false);
+      std::lock_guard<std::mutex> guard(lock_[c]);
+      if (pool_[c].size() < class_limit(c)) {
+        pool_[c].push_back(msg);
+        spare_[c].store(pool_[c].size(), std::memory_order_relaxed);
+        return;
+      }
+    }
+    delete msg;
+  }
+
+  std::mutex lock_[classes];
+  std::vector<message*> pool_[classes];
+  std::atomic<size_t> spare_[classes];
+};
+
+/* A con_msg_manager (see websocketpp/message_buffer/alloc.hpp) drawing on
+ * message_pool. Messages go back to the pool when their last reference is
+ * released, recycle() is not needed for that.
+ */
+template <typename message>
+class recycling_msg_manager
+  : public websocketpp::lib::enable_shared_from_this<
+      recycling_msg_manager<message> > {
+public:
+  typedef recycling_msg_manager<message> type;
+  typedef websocketpp::lib::shared_ptr<recycling_msg_manager> ptr;
+  typedef websocketpp::lib::weak_ptr<recycling_msg_manager> weak_ptr;
+  typedef typename message::ptr message_ptr;
+
+  message_ptr get_message() {
+    return message_pool<message>::instance().get(this->shared_from_this());
+  }
+
+  message_ptr get_message(websocketpp::frame::opcode::value op, size_t size) {
+    return message_pool<message>::instance().get(this->shared_from_this(),
+                                                 op, size);
+  }
+
+  bool recycle(message*) { return false; }
+};
@@ -4,11 +4,21 @@
 
 #include "message_queue.h"
 #include <boost/interprocess/ipc/message_queue.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <unistd.h>
 #include <boost/log/trivial.hpp>
 using namespace boost::interprocess;
 
 #define MS_NAME_TASK "message_queue_signal_server"
+#define MS_NAME_REPLY "message_queue_signal_server_reply_"
+
+// more replies may follow the last part of one, e.g. from other workers
+#define REPLY_GRACE_MS 200
+// for all parts of a reply, a client not reading it by then loses the rest
+#define REPLY_SEND_MS 1000
 
 struct message_queue_pack{
   message_queue *mq = nullptr;
@@ -22,16 +32,37 @@ struct message_queue_pack{
 struct task_msg
 {
   int exit = 0;
+  int command = 0;
+  int arg = 0;
+  int reply_to = 0;
+  char text[128] = {};
 };
 
+struct reply_msg
+{
+  int last = 0;
+  int size = 0;
+  char text[1024];
+};
+
+static std::string reply_name(int pid) {
+  return MS_NAME_REPLY + std::to_string(pid);
+}
+
+static boost::posix_time::ptime after_ms(int ms) {
+  return boost::posix_time::microsec_clock::universal_time()
+    + boost::posix_time::milliseconds(ms);
+}
+
 
-MessageQueue::MessageQueue(bool create): create_(create),pack_(new message_queue_pack){
+MessageQueue::MessageQueue(bool create, const char* name)
+  : create_(create),name_(name ? name : MS_NAME_TASK),pack_(new message_queue_pack){
   try {
     if (create_) {
-      message_queue::remove(MS_NAME_TASK);
-      mq_ = new message_queue(create_only,MS_NAME_TASK,10,sizeof(task_msg));;
+      message_queue::remove(name_.c_str());
+      mq_ = new message_queue(create_only,name_.c_str(),10,sizeof(task_msg));;
     } else {
-      mq_ = new message_queue(open_only,MS_NAME_TASK);
+      mq_ = new message_queue(open_only,name_.c_str());
     }
   } catch (interprocess_exception& ie) {
     mq_ = nullptr;
@@ -42,40 +73,115 @@ MessageQueue::MessageQueue(bool create): create_(create),pack_(new message_queue
 
 MessageQueue::~MessageQueue() {
   if (create_)
-    message_queue::remove(MS_NAME_TASK);
+    message_queue::remove(name_.c_str());
   delete pack_;
 }
 
-bool MessageQueue::WaitExitMessage() {
-  task_msg msg;
+bool MessageQueue::WaitMessage(control_message& msg) {
+  task_msg task;
   size_t size;
   unsigned int p;
 
-  while(mq_ != nullptr) {
-    try {
-      mq_->receive(&msg, sizeof(msg), size, p);
-      if (msg.exit){
-        return true;
-      }
-
-    }
-    catch (interprocess_exception&ie) {
-      return false;
-    }
+  if (mq_ == nullptr)
+    return false;
+  try {
+    mq_->receive(&task, sizeof(task), size, p);
   }
-  return  false;
+  catch (interprocess_exception&ie) {
+    return false;
+  }
+  task.text[sizeof(task.text) - 1] = '\0';
+  msg.command = task.exit ? MQ_EXIT : task.command;
+  msg.arg = task.arg;
+  msg.reply_to = task.reply_to;
+  msg.text = task.text;
+  return true;
 }
 
-bool MessageQueue::SendExitMessage() {
+bool MessageQueue::SendMessage(const control_message& msg) {
   if (mq_) {
     try {
-      task_msg msg;
-      msg.exit = 1;
-      return mq_->try_send(&msg,sizeof(msg),1);
+      task_msg task;
+      task.exit = msg.command == MQ_EXIT;
+      task.command = msg.command;
+      task.arg = msg.arg;
+      task.reply_to = msg.reply_to;
+      std::strncpy(task.text, msg.text.c_str(), sizeof(task.text) - 1);
+      return mq_->try_send(&task,sizeof(task),1);
     } catch (interprocess_exception&ie) {
-      BOOST_LOG_TRIVIAL(info) << "SendExitMessage()" << ie.what();
+      BOOST_LOG_TRIVIAL(info) << "SendMessage()" << ie.what();
       return false;
     }
   }
   return false;
 }
+
+bool MessageQueue::SendMessage(int command, int arg) {
+  control_message msg;
+  msg.command = command;
+  msg.arg = arg;
+  return SendMessage(msg);
+}
+
+bool MessageQueue::Request(control_message msg, std::string& reply, int timeout) {
+  msg.reply_to = getpid();
+  std::string name = reply_name(msg.reply_to);
+  message_queue::remove(name.c_str());
+  bool replied = false;
+  try {
+    message_queue replies(create_only, name.c_str(), 64, sizeof(reply_msg));
+    if (SendMessage(msg)) {
+      reply_msg part;
+      size_t size;
+      unsigned int p;
+      int wait = timeout;
+      while (replies.timed_receive(&part, sizeof(part), size, p, after_ms(wait))) {
+        reply.append(part.text, std::min<size_t>(part.size, sizeof(part.text)));
+        if (part.last) {
+          replied = true;
+          wait = REPLY_GRACE_MS;
+        }
+      }
+    }
+  } catch (interprocess_exception&ie) {
+    BOOST_LOG_TRIVIAL(info) << "Request()" << ie.what();
+  }
+  message_queue::remove(name.c_str());
+  return replied;
+}
+
+bool MessageQueue::Reply(const control_message& msg, const std::string& reply) {
+  if (msg.reply_to == 0)
+    return false;
+  try {
+    message_queue replies(open_only, reply_name(msg.reply_to).c_str());
+    reply_msg part;
+    size_t pos = 0;
+    boost::posix_time::ptime deadline = after_ms(REPLY_SEND_MS);
+    do {
+      part.size = static_cast<int>(std::min(reply.size() - pos, sizeof(part.text)));
+      std::memcpy(part.text, reply.data() + pos, part.size);
+      pos += part.size;
+      part.last = pos == reply.size();
+      if (!replies.timed_send(&part, sizeof(part), 1, deadline))
+        return false;
+    } while (!part.last);
+    return true;
+  } catch (interprocess_exception&ie) {
+    BOOST_LOG_TRIVIAL(info) << "Reply()" << ie.what();
+    return false;
+  }
+}
+
+bool MessageQueue::WaitExitMessage() {
+  control_message msg;
+  while (WaitMessage(msg)) {
+    if (msg.command == MQ_EXIT)
+      return true;
+  }
+  return  false;
+}
+
+bool MessageQueue::SendExitMessage() {
+  return SendMessage(MQ_EXIT);
+}
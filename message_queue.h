@@ -5,19 +5,57 @@
 #ifndef WSSIGNALSERVER_MESSAGE_QUEUE_H
 #define WSSIGNALSERVER_MESSAGE_QUEUE_H
 
+#include <string>
 
 struct message_queue_pack;
 
+enum message_command {
+  MQ_EXIT = 1,
+  MQ_DRAIN = 2,         // arg: deadline in ms
+  MQ_HANDOFF = 3,       // pass the listen sockets, see handoff.h
+  MQ_LOG_LEVEL = 4,     // text: debug, info, warning, error or fatal
+  MQ_STATS = 5,
+  MQ_PEERS = 6,
+  MQ_RELOAD_CONFIG = 7, // text: absolute path of the config file
+  MQ_RELOAD_CERTS = 8,
+  MQ_KICK = 9,          // arg: peer id
+  MQ_PAUSE_ACCEPT = 10  // arg: 1 pause, 0 resume
+};
+
+struct control_message {
+  int command = 0;
+  int arg = 0;
+  int reply_to = 0;     // process waiting for the reply, 0 for none
+  std::string text;     // at most 127 bytes
+};
+
 class MessageQueue {
 public:
-  explicit MessageQueue(bool create);
+  // name defaults to the queue of the one server process
+  explicit MessageQueue(bool create, const char* name = nullptr);
   ~MessageQueue();
 
+  // blocks until a command arrives, false if the queue is unusable
+  bool WaitMessage(control_message& msg);
+  bool SendMessage(const control_message& msg);
+  bool SendMessage(int command, int arg = 0);
+
+  // sends msg and collects the reply text, false if there was none within
+  // timeout ms. With several workers each one replies and all are collected.
+  bool Request(control_message msg, std::string& reply, int timeout);
+  // answers msg if a Request is waiting for it. Blocks for up to a second
+  // if the client does not read, call it off the dispatch thread.
+  static bool Reply(const control_message& msg, const std::string& reply);
+
   bool WaitExitMessage();
   bool SendExitMessage();
 
+  // the queue's name belongs to another process now, leave it on exit
+  void Disown() { create_ = false; }
+
 private:
   bool create_;
+  std::string name_;
   message_queue_pack *pack_;
 };
 
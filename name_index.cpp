@@ -0,0 +1,30 @@
+#include "name_index.h"
+#include <climits>
+
+lookup_limits g_lookup_limits;
+
+int NameIndex::Find(const std::string& name) const
+{
+  auto it = m_entries.lower_bound(std::make_pair(name, INT_MIN));
+  if (it == m_entries.end() || it->first != name)
+    return -1;
+  return it->second;
+}
+
+void NameIndex::Prefix(const std::string& prefix, size_t limit,
+                       const Visit& visit) const
+{
+  for (auto it = m_entries.lower_bound(std::make_pair(prefix, INT_MIN));
+       it != m_entries.end() && limit > 0; ++it, --limit)
+  {
+    if (it->first.compare(0, prefix.size(), prefix) != 0)
+      break;
+    visit(it->second, it->first);
+  }
+}
+
+void NameIndex::ForEach(const Visit& visit) const
+{
+  for (const auto& entry : m_entries)
+    visit(entry.second, entry.first);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <functional>
+#include <set>
+#include <string>
+#include <utility>
+
+/* Names of the present peers in order, for exact and prefix lookups.
+ *
+ * Several peers may share a name, entries are (name, id) pairs so that each
+ * of them is found and removed on its own. Adding or removing an entry
+ * twice is harmless.
+ */
+struct lookup_limits {
+  size_t batch = 512;     // names one exist request may ask for
+  size_t results = 100;   // entries one search reply holds at most
+};
+
+extern lookup_limits g_lookup_limits;
+
+class NameIndex
+{
+public:
+  typedef std::function<void(int id, const std::string& name)> Visit;
+
+  void Add(int id, const std::string& name) { m_entries.emplace(name, id); }
+  void Remove(int id, const std::string& name)
+  {
+    m_entries.erase(std::make_pair(name, id));
+  }
+
+  // the lowest id named name, -1 if there is none
+  int Find(const std::string& name) const;
+  // the first limit entries whose name starts with prefix, in name order
+  void Prefix(const std::string& prefix, size_t limit, const Visit& visit) const;
+  // every entry, in name order
+  void ForEach(const Visit& visit) const;
+
+  size_t Size() const { return m_entries.size(); }
+
+private:
+  std::set<std::pair<std::string, int>> m_entries;
+};
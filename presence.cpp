@@ -0,0 +1,138 @@
+#include "presence.h"
+#include <algorithm>
+
+presence_limits g_presence_limits;
+
+namespace {
+  template <typename T>
+  bool Insert(std::vector<T>& v, const T& value)
+  {
+    if (std::find(v.begin(), v.end(), value) != v.end())
+      return false;
+    v.push_back(value);
+    return true;
+  }
+
+  template <typename T>
+  void Erase(std::vector<T>& v, const T& value)
+  {
+    auto it = std::find(v.begin(), v.end(), value);
+    if (it == v.end())
+      return;
+    *it = std::move(v.back());
+    v.pop_back();
+  }
+
+  // removes subscriber from the watchers of key, and key once unwatched
+  template <typename Index, typename Key>
+  void Unindex(Index& index, const Key& key, int subscriber)
+  {
+    auto it = index.find(key);
+    if (it == index.end())
+      return;
+    Erase(it->second, subscriber);
+    if (it->second.empty())
+      index.erase(it);
+  }
+}
+
+bool PresenceTable::WatchId(int subscriber, int id)
+{
+  Subscriber& s = m_subscribers[subscriber];
+  if (s.ids.size() + s.names.size() >= g_presence_limits.watch)
+    return false;
+  if (Insert(s.ids, id))
+    m_by_id[id].push_back(subscriber);
+  return true;
+}
+
+bool PresenceTable::WatchName(int subscriber, const std::string& name)
+{
+  Subscriber& s = m_subscribers[subscriber];
+  if (s.ids.size() + s.names.size() >= g_presence_limits.watch)
+    return false;
+  if (Insert(s.names, name))
+    m_by_name[name].push_back(subscriber);
+  return true;
+}
+
+void PresenceTable::UnwatchId(int subscriber, int id)
+{
+  auto it = m_subscribers.find(subscriber);
+  if (it == m_subscribers.end())
+    return;
+  Erase(it->second.ids, id);
+  Unindex(m_by_id, id, subscriber);
+}
+
+void PresenceTable::UnwatchName(int subscriber, const std::string& name)
+{
+  auto it = m_subscribers.find(subscriber);
+  if (it == m_subscribers.end())
+    return;
+  Erase(it->second.names, name);
+  Unindex(m_by_name, name, subscriber);
+}
+
+void PresenceTable::Drop(int subscriber)
+{
+  m_pending.erase(subscriber);
+  auto it = m_subscribers.find(subscriber);
+  if (it == m_subscribers.end())
+    return;
+  for (int id : it->second.ids)
+    Unindex(m_by_id, id, subscriber);
+  for (const std::string& name : it->second.names)
+    Unindex(m_by_name, name, subscriber);
+  m_subscribers.erase(it);
+}
+
+void PresenceTable::Announce(int id, const std::string& name, bool online,
+                             Clock::time_point now)
+{
+  if (m_pending.empty())
+    m_window_end = now + std::chrono::milliseconds(g_presence_limits.window);
+  auto by_id = m_by_id.find(id);
+  if (by_id != m_by_id.end())
+  {
+    for (int subscriber : by_id->second)
+      Queue(subscriber, id, name, online);
+  }
+  auto by_name = m_by_name.find(name);
+  if (by_name != m_by_name.end())
+  {
+    for (int subscriber : by_name->second)
+      Queue(subscriber, id, name, online);
+  }
+}
+
+void PresenceTable::Queue(int subscriber, int id, const std::string& name,
+                          bool online)
+{
+  std::vector<Change>& changes = m_pending[subscriber];
+  for (Change& change : changes)
+  {
+    if (change.id == id)
+    {
+      change.name = name;
+      change.online = online;
+      return;
+    }
+  }
+  changes.push_back(Change{id, name, online});
+}
+
+PresenceTable::Clock::time_point PresenceTable::Flush(Clock::time_point now,
+                                                     const Visit& visit)
+{
+  if (m_pending.empty())
+    return Clock::time_point::max();
+  if (now < m_window_end)
+    return m_window_end;
+  // the visits may announce or drop, they see a table with nothing held
+  std::unordered_map<int, std::vector<Change>> pending;
+  pending.swap(m_pending);
+  for (const auto& batch : pending)
+    visit(batch.first, batch.second);
+  return m_pending.empty() ? Clock::time_point::max() : m_window_end;
+}
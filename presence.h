@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Presence subscriptions, so that a client learns about the peers it cares
+ * about instead of getting every peer in its sign_in reply.
+ *
+ * A subscriber (a peer id) watches ids and names. When a peer comes or
+ * goes, each of its watchers gets the change queued; changes are held for
+ * window ms after the first one and then handed out together, one batch per
+ * subscriber with at most one entry per peer, its latest state.
+ */
+struct presence_limits {
+  int window = 100;       // ms
+  size_t watch = 256;     // ids and names one subscriber may watch
+};
+
+extern presence_limits g_presence_limits;
+
+class PresenceTable
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Change
+  {
+    int id;
+    std::string name;
+    bool online;
+  };
+
+  typedef std::function<void(int subscriber, const std::vector<Change>&)> Visit;
+
+  // false once subscriber watches g_presence_limits.watch ids and names
+  bool WatchId(int subscriber, int id);
+  bool WatchName(int subscriber, const std::string& name);
+  void UnwatchId(int subscriber, int id);
+  void UnwatchName(int subscriber, const std::string& name);
+  // subscriber is gone, so are its subscriptions and pending changes
+  void Drop(int subscriber);
+
+  // peer id, named name, came or went at now
+  void Announce(int id, const std::string& name, bool online,
+                Clock::time_point now);
+  // hands out the batches once the window is over at now; when the changes
+  // still held are due, Clock::time_point::max() if none are
+  Clock::time_point Flush(Clock::time_point now, const Visit& visit);
+
+  size_t Subscribers() const { return m_subscribers.size(); }
+
+private:
+  struct Subscriber
+  {
+    std::vector<int> ids;
+    std::vector<std::string> names;
+  };
+
+  void Queue(int subscriber, int id, const std::string& name, bool online);
+
+  std::unordered_map<int, Subscriber> m_subscribers;
+  // watched id or name to its subscribers
+  std::unordered_map<int, std::vector<int>> m_by_id;
+  std::unordered_map<std::string, std::vector<int>> m_by_name;
+  // changes held for each subscriber
+  std::unordered_map<int, std::vector<Change>> m_pending;
+  Clock::time_point m_window_end;
+};
@@ -0,0 +1,133 @@
+#include "rate_limit.h"
+#include <algorithm>
+#include <boost/log/trivial.hpp>
+
+RateLimits::RateLimits()
+  : connection(100, 200)
+{
+  signals.emplace_back("sign_in", RateLimit(1, 5));
+  signals.emplace_back("exist", RateLimit(10, 20));
+}
+
+void RateLimits::Set(const std::string& name, const RateLimit& limit)
+{
+  if (name == "connection")
+  {
+    connection = limit;
+    return;
+  }
+  for (auto& signal : signals)
+  {
+    if (signal.first == name)
+    {
+      signal.second = limit;
+      return;
+    }
+  }
+  signals.emplace_back(name, limit);
+}
+
+RateLimits g_rate_limits;
+
+bool TokenBucket::Take(const RateLimit& limit, Clock::time_point now)
+{
+  if (limit.rate <= 0)
+    return true;
+
+  double burst = std::max(limit.burst, 1.0);
+  if (!m_started)
+  {
+    m_tokens = burst;
+    m_started = true;
+  }
+  else
+  {
+    std::chrono::duration<double> elapsed = now - m_last;
+    m_tokens = std::min(burst, m_tokens + elapsed.count() * limit.rate);
+  }
+  m_last = now;
+
+  if (m_tokens < 1)
+    return false;
+  m_tokens -= 1;
+  return true;
+}
+
+RateLimiter::RateLimiter(const RateLimits& limits)
+  : m_limits(limits),
+    m_rejected(new std::atomic<uint64_t>[limits.signals.size() + 1])
+{
+  for (size_t i = 0; i <= m_limits.signals.size(); ++i)
+    m_rejected[i] = 0;
+}
+
+RateLimiter::Verdict RateLimiter::AllowFrame(connection_id id,
+                                             Clock::time_point now)
+{
+  if (m_limits.connection.rate <= 0)
+    return PASS;
+  return Check(BucketsOf(id)[0], m_limits.connection, 0, now);
+}
+
+RateLimiter::Verdict RateLimiter::AllowSignal(connection_id id,
+                                              const char* begin,
+                                              const char* end,
+                                              Clock::time_point now)
+{
+  size_t n = static_cast<size_t>(end - begin);
+  for (size_t i = 0; i < m_limits.signals.size(); ++i)
+  {
+    const std::string& signal = m_limits.signals[i].first;
+    if (signal.size() == n && std::equal(begin, end, signal.begin()))
+      return Check(BucketsOf(id)[i + 1], m_limits.signals[i].second, i + 1, now);
+  }
+  return PASS;
+}
+
+void RateLimiter::Remove(connection_id id)
+{
+  uint32_t slot = connection_slot(id);
+  if (slot < m_buckets.size())
+    Buckets().swap(m_buckets[slot]);
+}
+
+uint64_t RateLimiter::Rejected(const std::string& limit) const
+{
+  if (limit == "connection")
+    return m_rejected[0].load(std::memory_order_relaxed);
+  for (size_t i = 0; i < m_limits.signals.size(); ++i)
+  {
+    if (m_limits.signals[i].first == limit)
+      return m_rejected[i + 1].load(std::memory_order_relaxed);
+  }
+  return 0;
+}
+
+RateLimiter::Verdict RateLimiter::Check(Bucket& bucket, const RateLimit& limit,
+                                        size_t index, Clock::time_point now)
+{
+  if (bucket.tokens.Take(limit, now))
+  {
+    bucket.limited = false;
+    return PASS;
+  }
+  m_rejected[index].fetch_add(1, std::memory_order_relaxed);
+  if (bucket.limited)
+    return REJECT;
+  bucket.limited = true;
+  BOOST_LOG_TRIVIAL(warning) << "rate limited: "
+                             << (index == 0 ? "connection"
+                                            : m_limits.signals[index - 1].first);
+  return REJECT_FIRST;
+}
+
+RateLimiter::Buckets& RateLimiter::BucketsOf(connection_id id)
+{
+  uint32_t slot = connection_slot(id);
+  if (slot >= m_buckets.size())
+    m_buckets.resize(slot + 1);
+  Buckets& buckets = m_buckets[slot];
+  if (buckets.empty())
+    buckets.resize(m_limits.signals.size() + 1);
+  return buckets;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "websocket_server.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Token buckets on inbound frames, one per connection for all of its frames
+ * and one per connection and limited signal. They are checked on the raw
+ * frame and on the scanned "signal" name, before anything is parsed into a
+ * Json::Value.
+ */
+
+struct RateLimit
+{
+  RateLimit(double r = 0, double b = 0) : rate(r), burst(b) {}
+
+  double rate;  // tokens per second, 0 disables the limit
+  double burst; // bucket size
+};
+
+struct RateLimits
+{
+  RateLimits();
+
+  // "connection" sets the per connection limit, any other name a signal's
+  void Set(const std::string& name, const RateLimit& limit);
+
+  RateLimit connection;
+  std::vector<std::pair<std::string, RateLimit> > signals;
+};
+
+extern RateLimits g_rate_limits;
+
+class TokenBucket
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // true if a token was left at now, the token is taken
+  bool Take(const RateLimit& limit, Clock::time_point now);
+
+private:
+  bool m_started = false;
+  double m_tokens = 0;
+  Clock::time_point m_last;
+};
+
+class RateLimiter
+{
+public:
+  typedef TokenBucket::Clock Clock;
+
+  enum Verdict
+  {
+    PASS,
+    REJECT,
+    REJECT_FIRST  // rejected, and the last frame on this limit passed
+  };
+
+  explicit RateLimiter(const RateLimits& limits);
+
+  Verdict AllowFrame(connection_id id, Clock::time_point now);
+  // [begin, end) is the frame's "signal", signals without a limit pass
+  Verdict AllowSignal(connection_id id, const char* begin,
+                      const char* end, Clock::time_point now);
+  void Remove(connection_id id);
+
+  // frames rejected by the "connection" limit or a signal's, 0 for others
+  uint64_t Rejected(const std::string& limit) const;
+
+private:
+  struct Bucket
+  {
+    TokenBucket tokens;
+    bool limited = false;
+  };
+
+  // [0] is the connection bucket, [i + 1] the one of m_limits.signals[i]
+  typedef std::vector<Bucket> Buckets;
+
+  Verdict Check(Bucket& bucket, const RateLimit& limit, size_t index,
+                Clock::time_point now);
+  Buckets& BucketsOf(connection_id id);
+
+  RateLimits m_limits;
+  // indexed by connection slot, empty until the connection's first frame
+  std::vector<Buckets> m_buckets;
+  std::unique_ptr<std::atomic<uint64_t>[]> m_rejected;
+};
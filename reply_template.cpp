@@ -0,0 +1,54 @@
+#include "reply_template.h"
+
+void IdSlot::Put(std::string& out, int value)
+{
+  char digits[12];
+  char* end = digits + sizeof(digits);
+  char* p = end;
+  unsigned int u = value < 0 ? 0u - static_cast<unsigned int>(value)
+                             : static_cast<unsigned int>(value);
+  do
+  {
+    *--p = static_cast<char>('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  if (value < 0)
+    *--p = '-';
+  out.append(p, end);
+}
+
+void FlagSlot::Put(std::string& out, bool value)
+{
+  if (value)
+    out.append("true", 4);
+  else
+    out.append("false", 5);
+}
+
+void NameSlot::Put(std::string& out, const std::string& value)
+{
+  static const char kHex[] = "0123456789abcdef";
+  out += '"';
+  const char* run = value.data();
+  const char* end = run + value.size();
+  for (const char* p = run; p != end; ++p)
+  {
+    unsigned char c = static_cast<unsigned char>(*p);
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    out.append(run, p);
+    run = p + 1;
+    if (c == '"' || c == '\\')
+    {
+      out += '\\';
+      out += static_cast<char>(c);
+    }
+    else
+    {
+      char escape[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+      out.append(escape, sizeof(escape));
+    }
+  }
+  out.append(run, end);
+  out += '"';
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/* A reply made of constant JSON text with typed slots in between, e.g.
+ *
+ *   constexpr ReplyTemplate<IdSlot> kNotice("{\"signal\":\"sign_out\",\"id\":", "}");
+ *   static_assert(kNotice.Valid(), "bad reply template");
+ *   kNotice.Write(buffer, id);
+ *
+ * The constant fragments are checked at compile time, writing a reply only
+ * appends them and the slot values to a reused buffer.
+ */
+
+// nesting depth after the constant text s, or -1 when s closes more than it
+// opens, ends inside a string or holds a raw control character
+constexpr int FragmentDepth(const char* s, int depth, bool quoted = false)
+{
+  return depth < 0 ? -1
+    : *s == '\0' ? (quoted ? -1 : depth)
+    : static_cast<unsigned char>(*s) < 0x20 ? -1
+    : quoted ? (*s == '\\' ? (s[1] == '\0' ? -1 : FragmentDepth(s + 2, depth, true))
+                           : FragmentDepth(s + 1, depth, *s != '"'))
+    : FragmentDepth(s + 1,
+                    depth + ((*s == '{' || *s == '[') ? 1
+                             : (*s == '}' || *s == ']') ? -1 : 0),
+                    *s == '"');
+}
+
+constexpr size_t FragmentLength(const char* s)
+{
+  return *s == '\0' ? 0 : 1 + FragmentLength(s + 1);
+}
+
+struct IdSlot
+{
+  typedef int type;
+  static void Put(std::string& out, int value);
+};
+
+struct FlagSlot
+{
+  typedef bool type;
+  static void Put(std::string& out, bool value);
+};
+
+// a JSON string, quoted and escaped
+struct NameSlot
+{
+  typedef const std::string& type;
+  static void Put(std::string& out, const std::string& value);
+};
+
+template <typename... Slots>
+class ReplyTemplate
+{
+public:
+  static constexpr size_t kFragments = sizeof...(Slots) + 1;
+
+  template <typename... Fragments>
+  constexpr ReplyTemplate(Fragments... fragments)
+    : m_fragments{fragments...}, m_lengths{FragmentLength(fragments)...}
+  {
+    static_assert(sizeof...(Fragments) == kFragments,
+                  "a reply template needs one more fragment than slots");
+  }
+
+  // whole reply is one balanced object or array and every slot sits inside it
+  constexpr bool Valid() const { return ValidFrom(0, 0); }
+
+  // appends the reply to out
+  void Write(std::string& out, typename Slots::type... values) const
+  {
+    size_t i = 0;
+    out.append(m_fragments[0], m_lengths[0]);
+    int expand[] = {0, (Slots::Put(out, values), Append(out, ++i), 0)...};
+    (void)expand;
+  }
+
+private:
+  constexpr bool ValidFrom(size_t i, int depth) const
+  {
+    return depth < 0 ? false
+      : i == kFragments ? depth == 0
+      : (i > 0 && depth == 0) ? false
+      : ValidFrom(i + 1, FragmentDepth(m_fragments[i], depth));
+  }
+
+  void Append(std::string& out, size_t i) const
+  {
+    out.append(m_fragments[i], m_lengths[i]);
+  }
+
+  const char* m_fragments[kFragments];
+  size_t m_lengths[kFragments];
+};
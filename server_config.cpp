@@ -0,0 +1,299 @@
+#include "server_config.h"
+#include "signal_server.h"
+#include <json/reader.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <fstream>
+#include <limits>
+
+#define POLICY_DROP_OLDEST "drop_oldest"
+#define POLICY_COALESCE "coalesce"
+#define POLICY_CLOSE "close"
+
+namespace {
+  // key of value into out if present, false with error set if it is not an
+  // unsigned integer that fits T
+  template <typename T>
+  bool ReadUnsigned(const Json::Value& value, const char* key, T& out,
+                    std::string& error)
+  {
+    if (!value.isMember(key))
+      return true;
+    const Json::Value& v = value[key];
+    if (!v.isUInt64())
+      error = std::string(key) + " is not an unsigned integer";
+    else if (v.asUInt64() > std::numeric_limits<T>::max())
+      error = std::string(key) + " is larger than "
+        + std::to_string(std::numeric_limits<T>::max());
+    else
+    {
+      out = static_cast<T>(v.asUInt64());
+      return true;
+    }
+    return false;
+  }
+
+  // key of value into out if present, false with error set if it is not a
+  // number of milliseconds
+  bool ReadMilliseconds(const Json::Value& value, const char* key, int& out,
+                        std::string& error)
+  {
+    if (!value.isMember(key))
+      return true;
+    const Json::Value& v = value[key];
+    if (!v.isInt() || v.asInt() < 0)
+    {
+      error = std::string(key) + " is not a number of milliseconds";
+      return false;
+    }
+    out = v.asInt();
+    return true;
+  }
+
+  bool ReadString(const Json::Value& value, const char* key, std::string& out,
+                  std::string& error)
+  {
+    if (!value.isMember(key))
+      return true;
+    if (!value[key].isString())
+    {
+      error = std::string(key) + " is not a string";
+      return false;
+    }
+    out = value[key].asString();
+    return true;
+  }
+
+  bool ReadRateLimits(const Json::Value& value, RateLimits& limits,
+                      std::string& error)
+  {
+    if (!value.isObject())
+    {
+      error = "rate_limits is not an object";
+      return false;
+    }
+    for (const auto& name : value.getMemberNames())
+    {
+      const Json::Value& limit = value[name];
+      if (name != "connection" && !IsBuiltinSignal(name))
+        error = "rate_limits: " + name + " is not a signal";
+      else if (!limit.isObject())
+        error = "rate_limits: " + name + " is not an object";
+      else if (!(limit.get("rate", 0).isNumeric()
+                 && limit.get("rate", 0).asDouble() >= 0
+                 && limit.get("burst", 0).isNumeric()
+                 && limit.get("burst", 0).asDouble() >= 0))
+        error = "rate_limits: " + name
+          + " needs a rate and burst that are not negative numbers";
+      else
+      {
+        limits.Set(name, RateLimit(limit.get("rate", 0).asDouble(),
+                                   limit.get("burst", 0).asDouble()));
+        continue;
+      }
+      return false;
+    }
+    return true;
+  }
+}
+
+bool ApplyRuntimeConfig(const Json::Value& value, std::string& error)
+{
+  if (!value.isObject())
+  {
+    error = "the config is not an object";
+    return false;
+  }
+
+  // staged, applied only once every key has been read
+  std::string log_filter;
+  boost::log::trivial::severity_level level = boost::log::trivial::info;
+  std::string ice_server;
+  std::string policy;
+  outbound_limits outbound = g_outbound_limits;
+  dispatch_limits dispatch = g_dispatch_limits;
+  session_limits session = g_session_limits;
+  mailbox_limits mailbox = g_mailbox_limits;
+  presence_limits presence = g_presence_limits;
+  lookup_limits lookup = g_lookup_limits;
+  batch_limits batch = g_batch_limits;
+  size_t recipients =
+    g_group_limits.recipients.load(std::memory_order_relaxed);
+  RateLimits rates = g_rate_limits;
+  ICE ice = g_ice_server;
+
+  bool ok = ReadString(value, "log_filter", log_filter, error)
+    && ReadString(value, "ice_server", ice_server, error)
+    && ReadUnsigned(value, "send_buffer_bytes", outbound.buffer_bytes, error)
+    && ReadUnsigned(value, "send_queue_frames", outbound.queue_frames, error)
+    && ReadUnsigned(value, "send_queue_bytes", outbound.queue_bytes, error)
+    && ReadUnsigned(value, "send_global_bytes", outbound.global_bytes, error)
+    && ReadString(value, "slow_consumer_policy", policy, error)
+    && ReadUnsigned(value, "slow_consumer_close_code", outbound.close_code,
+                    error)
+    && ReadUnsigned(value, "dispatch_queue_frames", dispatch.queue_frames,
+                    error)
+    && ReadUnsigned(value, "dispatch_quantum", dispatch.quantum, error)
+    && ReadUnsigned(value, "dispatch_control_frames", dispatch.control_frames,
+                    error)
+    && ReadMilliseconds(value, "session_grace", session.grace, error)
+    && ReadUnsigned(value, "mailbox_frames", mailbox.frames, error)
+    && ReadUnsigned(value, "mailbox_bytes", mailbox.bytes, error)
+    && ReadMilliseconds(value, "mailbox_ttl", mailbox.ttl, error)
+    && ReadUnsigned(value, "mailbox_budget", mailbox.budget, error)
+    && ReadMilliseconds(value, "presence_window", presence.window, error)
+    && ReadUnsigned(value, "presence_watch", presence.watch, error)
+    && ReadUnsigned(value, "exist_batch", lookup.batch, error)
+    && ReadUnsigned(value, "search_results", lookup.results, error)
+    && ReadMilliseconds(value, "candidate_window", batch.window, error)
+    && ReadUnsigned(value, "candidate_batch_frames", batch.frames, error)
+    && ReadUnsigned(value, "candidate_batch_bytes", batch.bytes, error)
+    && ReadUnsigned(value, "group_recipients", recipients, error)
+    && (!value.isMember("rate_limits")
+        || ReadRateLimits(value["rate_limits"], rates, error));
+  if (!ok)
+    return false;
+
+  if (!log_filter.empty() && !ParseSeverity(log_filter, level))
+  {
+    error = "log_filter is not debug, info, warning, error or fatal";
+    return false;
+  }
+  if (policy == POLICY_DROP_OLDEST)
+    outbound.policy = DROP_OLDEST;
+  else if (policy == POLICY_COALESCE)
+    outbound.policy = COALESCE;
+  else if (policy == POLICY_CLOSE)
+    outbound.policy = CLOSE_CONNECTION;
+  else if (!policy.empty())
+  {
+    error = "slow_consumer_policy is not " POLICY_DROP_OLDEST ", "
+            POLICY_COALESCE " or " POLICY_CLOSE;
+    return false;
+  }
+  if (!ice_server.empty())
+    ParseIceServer(ice_server, ice);
+
+  if (!log_filter.empty())
+    SetLogFilter(level);
+  g_outbound_limits = outbound;
+  g_dispatch_limits = dispatch;
+  g_session_limits = session;
+  g_mailbox_limits = mailbox;
+  g_presence_limits = presence;
+  g_lookup_limits = lookup;
+  g_batch_limits = batch;
+  g_group_limits.recipients.store(recipients, std::memory_order_relaxed);
+  g_rate_limits = rates;
+  g_ice_server = ice;
+  return true;
+}
+
+static bool ParseSocketOptions(const Json::Value& value, socket_options& options,
+                               std::string& error)
+{
+  for (const auto& key : value.getMemberNames())
+  {
+    const Json::Value& v = value[key];
+    if (key == "tcp_nodelay" && v.isBool())
+      options.nodelay = v.asBool();
+    else if (!v.isIntegral())
+      error = key + " is not a known option";
+    else if (key == "backlog")
+      options.backlog = v.asInt();
+    else if (key == "defer_accept")
+      options.defer_accept = v.asInt();
+    else if (key == "fastopen")
+      options.fastopen = v.asInt();
+    else if (key == "rcvbuf")
+      options.rcvbuf = v.asInt();
+    else if (key == "sndbuf")
+      options.sndbuf = v.asInt();
+    else if (key == "user_timeout")
+      options.user_timeout = v.asInt();
+    else
+      error = key + " is not a known option";
+    if (!error.empty())
+      return false;
+  }
+  return check_socket_options(options, error);
+}
+
+bool ApplyListenConfig(const Json::Value& listeners, std::string& error)
+{
+  if (!listeners.isObject())
+  {
+    error = "listeners is not an object";
+    return false;
+  }
+  for (const auto& name : listeners.getMemberNames())
+  {
+    socket_options* options = name == "plain" ? &g_listen_options.plain
+      : name == "tls" ? &g_listen_options.tls : nullptr;
+    if (!options)
+      error = "unknown listener " + name;
+    else if (!listeners[name].isObject())
+      error = "listener " + name + " is not an object";
+    else if (ParseSocketOptions(listeners[name], *options, error))
+      continue;
+    error = "listeners: " + error;
+    return false;
+  }
+  return true;
+}
+
+bool ReloadRuntimeConfig(const std::string& file, std::string& error)
+{
+  std::ifstream ifs(file);
+  if (!ifs.good())
+  {
+    error = "cannot open " + file;
+    return false;
+  }
+  Json::Value value;
+  Json::Reader reader;
+  if (!reader.parse(ifs, value))
+  {
+    error = reader.getFormattedErrorMessages();
+    return false;
+  }
+  if (!ApplyRuntimeConfig(value, error))
+    return false;
+  BOOST_LOG_TRIVIAL(info) << "config reloaded from " << file;
+  return true;
+}
+
+void ParseIceServer(std::string ice_server, ICE& ice)
+{
+  // "turn:115.231.220.242:8101?transport=tcp [ts1:12345678]"
+  size_t ef = ice_server.find(' ');
+  const auto NP = std::string::npos;
+  if (ef != NP)
+  {
+    ice.uri = ice_server.substr(0, ef);
+    ice_server = ice_server.substr(ef);
+    auto i1 = ice_server.find('[');
+    auto i2 = ice_server.find(']');
+    auto i3 = ice_server.find(':');
+
+    if (i1 != NP && i2 != NP && i3 != NP)
+    {
+      ice.username = ice_server.substr(i1 + 1, i3 - i1 - 1);
+      ice.password = ice_server.substr(i3 + 1, i2 - i3 - 1);
+    }
+  }
+}
+
+bool ParseSeverity(const std::string& name,
+                   boost::log::trivial::severity_level& level)
+{
+  // trace is not one of ours
+  if (name == "trace")
+    return false;
+  return boost::log::trivial::from_string(name.data(), name.size(), level);
+}
+
+void SetLogFilter(boost::log::trivial::severity_level level)
+{
+  boost::log::core::get()->set_filter(boost::log::trivial::severity >= level);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <json/value.h>
+#include <boost/log/trivial.hpp>
+#include <string>
+
+struct ICE;
+
+/* The settings of config.json that a running server can change, applied at
+ * start and again by the reload_config command. Port, workers and command
+ * only take effect at start.
+ */
+
+// applies the runtime keys present in value, the others keep their value.
+// Nothing is applied if a key has a value of the wrong type or range, or
+// rate_limits names an unknown limit, false with error naming the key.
+bool ApplyRuntimeConfig(const Json::Value& value, std::string& error);
+
+// reads and applies file, false with error set if it could not be parsed
+// or applied
+bool ReloadRuntimeConfig(const std::string& file, std::string& error);
+
+// "listeners" into g_listen_options, at start only. False with error set
+// for an unknown key or a value the system can not apply.
+bool ApplyListenConfig(const Json::Value& listeners, std::string& error);
+
+// "turn:host:port?transport=tcp [user:password]" into ice
+void ParseIceServer(std::string ice_server, ICE& ice);
+
+// debug, info, warning, error or fatal
+bool ParseSeverity(const std::string& name,
+                   boost::log::trivial::severity_level& level);
+void SetLogFilter(boost::log::trivial::severity_level level);
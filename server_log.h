@@ -0,0 +1,25 @@
+#pragma once
+
+#include <boost/log/trivial.hpp>
+
+/* SERVER_LOG(level) is BOOST_LOG_TRIVIAL(level) for records at or above
+ * LOG_MIN_SEVERITY. Those below are compiled out, so payload dumps cost
+ * nothing in release builds, not even the runtime filter check.
+ *
+ * LOG_MIN_SEVERITY is a boost::log::trivial level name, info when NDEBUG is
+ * defined and trace otherwise.
+ */
+
+#ifndef LOG_MIN_SEVERITY
+#ifdef NDEBUG
+#define LOG_MIN_SEVERITY info
+#else
+#define LOG_MIN_SEVERITY trace
+#endif
+#endif
+
+// a loop rather than an if, so that it nests in if/else like a statement
+#define SERVER_LOG(level) \
+  for (bool log_on_ = boost::log::trivial::level >= boost::log::trivial::LOG_MIN_SEVERITY; \
+       log_on_; log_on_ = false) \
+    BOOST_LOG_TRIVIAL(level)
@@ -0,0 +1,228 @@
+#include "server_stats.h"
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/log/trivial.hpp>
+#include <iomanip>
+#include <new>
+#include <unistd.h>
+
+using namespace boost::interprocess;
+
+namespace {
+  const uint32_t kStatsMagic = 0x77737374; // "wsst"
+  const uint32_t kStatsVersion = 6;
+
+  struct StatsHeader
+  {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    uint32_t slots;
+  };
+
+  struct CounterInfo
+  {
+    const char* name;
+    bool gauge;
+  };
+
+  const CounterInfo kCounterInfo[] = {
+    {"connections", true},
+    {"accepted", false},
+    {"tls handshakes", false},
+    {"tls failures", false},
+    {"frames in", false},
+    {"dispatch queue", true},
+    {"dispatch shed", false},
+    {"outbound bytes", true},
+    {"outbound dropped", false},
+    {"slow consumers closed", false},
+    {"sign_in", false},
+    {"sign_out", false},
+    {"message", false},
+    {"group messages", false},
+    {"exist", false},
+    {"search", false},
+    {"unknown signals", false},
+    {"rate limited", false},
+    {"offers", false},
+    {"answers", false},
+    {"candidates", false},
+    {"candidate batches", false},
+    {"peers", true},
+    {"pairs", true},
+    {"pending offers", true},
+    {"detached sessions", true},
+    {"resumed", false},
+    {"sessions expired", false},
+    {"mailbox bytes", true},
+    {"mailbox held", false},
+    {"mailbox delivered", false},
+    {"undelivered", false},
+    {"relay < 100us", false},
+    {"relay < 1ms", false},
+    {"relay < 10ms", false},
+    {"relay < 100ms", false},
+    {"relay < 1s", false},
+    {"relay >= 1s", false},
+  };
+  static_assert(sizeof(kCounterInfo) / sizeof(kCounterInfo[0])
+                  == ServerStats::kCounters,
+                "a counter has no name");
+
+  ServerStats g_private_stats;
+
+  ServerStats* SlotAt(void* base, int slot)
+  {
+    return reinterpret_cast<ServerStats*>(
+      static_cast<char*>(base) + sizeof(StatsHeader)) + slot;
+  }
+
+  void Zero(ServerStats& stats)
+  {
+    for (auto& counter : stats.counters)
+      counter.store(0, std::memory_order_relaxed);
+  }
+}
+
+ServerStats* g_stats = &g_private_stats;
+
+void ServerStats::AddRelay(std::chrono::steady_clock::duration latency)
+{
+  int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+  Counter c = us < 100 ? RELAY_100US
+    : us < 1000 ? RELAY_1MS
+    : us < 10000 ? RELAY_10MS
+    : us < 100000 ? RELAY_100MS
+    : us < 1000000 ? RELAY_1S
+    : RELAY_SLOWER;
+  Add(c);
+}
+
+const char* ServerStats::Name(Counter c)
+{
+  return kCounterInfo[c].name;
+}
+
+bool ServerStats::IsGauge(Counter c)
+{
+  return kCounterInfo[c].gauge;
+}
+
+struct StatsSegment::Shared
+{
+  mapped_region region;
+  int slots = 0;
+};
+
+StatsSegment::StatsSegment(int slots)
+{
+  try {
+    shared_memory_object::remove(STATS_NAME);
+    shared_memory_object shm(create_only, STATS_NAME, read_write);
+    shm.truncate(sizeof(StatsHeader) + sizeof(ServerStats) * slots);
+    m_shared.reset(new Shared);
+    m_shared->region = mapped_region(shm, read_write);
+    m_shared->slots = slots;
+    void* base = m_shared->region.get_address();
+    for (int i = 0; i < slots; ++i)
+      Zero(*new (SlotAt(base, i)) ServerStats);
+    StatsHeader* header = static_cast<StatsHeader*>(base);
+    header->version = kStatsVersion;
+    header->pid = getpid();
+    header->slots = slots;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = kStatsMagic;
+    g_stats = SlotAt(base, 0);
+  } catch (interprocess_exception& ie) {
+    m_shared.reset();
+    BOOST_LOG_TRIVIAL(warning) << "stats segment: " << ie.what();
+  }
+}
+
+StatsSegment::~StatsSegment()
+{
+  if (!m_shared)
+    return;
+  g_stats = &g_private_stats;
+  // after a takeover the name belongs to the new process
+  std::vector<StatsSnapshot> slots;
+  int pid = 0;
+  if (Read(slots, pid) && pid == getpid())
+    shared_memory_object::remove(STATS_NAME);
+}
+
+void StatsSegment::Attach(int slot)
+{
+  if (!m_shared || slot < 0 || slot >= m_shared->slots)
+    return;
+  g_stats = SlotAt(m_shared->region.get_address(), slot);
+  Zero(*g_stats);
+}
+
+bool StatsSegment::Read(std::vector<StatsSnapshot>& slots, int& pid)
+{
+  try {
+    shared_memory_object shm(open_only, STATS_NAME, read_only);
+    mapped_region region(shm, read_only);
+    if (region.get_size() < sizeof(StatsHeader))
+      return false;
+    void* base = region.get_address();
+    const StatsHeader* header = static_cast<const StatsHeader*>(base);
+    if (header->magic != kStatsMagic || header->version != kStatsVersion
+        || region.get_size() < sizeof(StatsHeader) + sizeof(ServerStats) * header->slots)
+      return false;
+    pid = header->pid;
+    slots.resize(header->slots);
+    for (uint32_t i = 0; i < header->slots; ++i)
+    {
+      const ServerStats* stats = SlotAt(base, i);
+      for (int c = 0; c < ServerStats::kCounters; ++c)
+        slots[i][c] = stats->counters[c].load(std::memory_order_relaxed);
+    }
+    return true;
+  } catch (interprocess_exception&) {
+    return false;
+  }
+}
+
+void StatsSegment::Write(std::ostream& out, const std::vector<StatsSnapshot>& slots,
+                         const std::vector<StatsSnapshot>* before, double seconds)
+{
+  bool rates = before && before->size() == slots.size() && seconds > 0;
+  out << std::left << std::setw(24) << "" << std::right << std::setw(14) << "total";
+  if (rates)
+    out << std::setw(12) << "/s";
+  if (slots.size() > 1)
+    for (size_t i = 0; i < slots.size(); ++i)
+      out << std::setw(11) << "worker " << std::setw(3) << i;
+  out << "\n";
+
+  for (int c = 0; c < ServerStats::kCounters; ++c)
+  {
+    ServerStats::Counter counter = static_cast<ServerStats::Counter>(c);
+    uint64_t total = 0;
+    uint64_t total_before = 0;
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+      total += slots[i][c];
+      if (rates)
+        total_before += (*before)[i][c];
+    }
+    out << std::left << std::setw(24) << ServerStats::Name(counter)
+        << std::right << std::setw(14) << total;
+    if (rates)
+    {
+      // a restarted worker starts again from 0
+      if (ServerStats::IsGauge(counter) || total < total_before)
+        out << std::setw(12) << "";
+      else
+        out << std::setw(12) << std::fixed << std::setprecision(1)
+            << (total - total_before) / seconds;
+    }
+    if (slots.size() > 1)
+      for (size_t i = 0; i < slots.size(); ++i)
+        out << std::setw(14) << slots[i][c];
+    out << "\n";
+  }
+}
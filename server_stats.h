@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+/* Live counters of a running server, published in the shared memory segment
+ * STATS_NAME with one slot per worker. The server only adds to its slot with
+ * relaxed atomics, "-c stats" and "-c top" map the segment read only, so
+ * reading them costs the server nothing.
+ */
+
+#define STATS_NAME "wsSignalServer_stats"
+
+struct ServerStats
+{
+  enum Counter
+  {
+    CONNECTIONS,        // open now
+    ACCEPTED,
+    TLS_HANDSHAKES,
+    TLS_FAILURES,
+    FRAMES_IN,
+    DISPATCH_QUEUE,     // frames waiting for the dispatch thread
+    DISPATCH_SHED,
+    OUTBOUND_BYTES,     // queued and buffered for sending
+    OUTBOUND_DROPPED,
+    SLOW_CLOSED,
+    SIGN_IN,
+    SIGN_OUT,
+    MESSAGE,
+    GROUP_MESSAGES,     // messages to several peers, counted once in MESSAGE
+    EXIST,
+    SEARCH,
+    UNKNOWN_SIGNAL,
+    RATE_LIMITED,
+    OFFERS,
+    ANSWERS,
+    CANDIDATES,
+    CANDIDATE_BATCHES,  // frames carrying more than one candidate
+    PEERS,
+    PAIRS,
+    PENDING_OFFERS,
+    DETACHED,           // sessions waiting for their client to resume
+    RESUMED,
+    SESSIONS_EXPIRED,
+    MAILBOX_BYTES,      // held for detached peers
+    MAILBOX_HELD,
+    MAILBOX_DELIVERED,
+    UNDELIVERED,        // frames to peers that are gone, held ones included
+    // time from a frame's arrival to its relay
+    RELAY_100US,
+    RELAY_1MS,
+    RELAY_10MS,
+    RELAY_100MS,
+    RELAY_1S,
+    RELAY_SLOWER,
+    kCounters
+  };
+
+  void Add(Counter c, uint64_t n = 1)
+  {
+    counters[c].fetch_add(n, std::memory_order_relaxed);
+  }
+  void Sub(Counter c, uint64_t n = 1)
+  {
+    counters[c].fetch_sub(n, std::memory_order_relaxed);
+  }
+  void Set(Counter c, uint64_t value)
+  {
+    counters[c].store(value, std::memory_order_relaxed);
+  }
+  void AddRelay(std::chrono::steady_clock::duration latency);
+
+  // name shown by -c stats, gauges are shown as is and counters with a rate
+  static const char* Name(Counter c);
+  static bool IsGauge(Counter c);
+
+  std::atomic<uint64_t> counters[kCounters];
+};
+
+// the slot of this process, a private one when no segment is published
+extern ServerStats* g_stats;
+
+typedef std::array<uint64_t, ServerStats::kCounters> StatsSnapshot;
+
+class StatsSegment
+{
+public:
+  // server: publishes slots zeroed slots, g_stats points to slot 0
+  explicit StatsSegment(int slots);
+  ~StatsSegment();
+
+  // a worker writes to its own slot, zeroed when a worker is restarted
+  void Attach(int slot);
+
+  // reader: one snapshot per slot, false if no server publishes
+  static bool Read(std::vector<StatsSnapshot>& slots, int& pid);
+
+  // the counters summed over the slots, with the rate since before if given
+  static void Write(std::ostream& out, const std::vector<StatsSnapshot>& slots,
+                    const std::vector<StatsSnapshot>* before = nullptr,
+                    double seconds = 0);
+
+private:
+  struct Shared;
+  std::unique_ptr<Shared> m_shared;
+};
@@ -0,0 +1,75 @@
+#include "session.h"
+#include <cstdint>
+#include <random>
+
+session_limits g_session_limits;
+
+std::string SessionTable::NewToken()
+{
+  static const char kHex[] = "0123456789abcdef";
+  static std::random_device random;
+  std::string token;
+  token.reserve(32);
+  for (int i = 0; i < 4; ++i)
+  {
+    uint32_t bits = random();
+    for (int j = 0; j < 8; ++j, bits >>= 4)
+      token += kHex[bits & 0xf];
+  }
+  return token;
+}
+
+void SessionTable::Detach(const std::string& token, int id,
+                          const std::string& name, Clock::time_point now)
+{
+  Detached& session = m_sessions[token];
+  session.id = id;
+  session.name = name;
+  session.deadline = now + std::chrono::milliseconds(g_session_limits.grace);
+  m_tokens[id] = token;
+}
+
+bool SessionTable::Resume(const std::string& token, Detached& session)
+{
+  auto it = m_sessions.find(token);
+  if (it == m_sessions.end() || it->second.deadline < Clock::now())
+    return false;
+  session = std::move(it->second);
+  m_tokens.erase(session.id);
+  m_sessions.erase(it);
+  return true;
+}
+
+void SessionTable::Expire(Clock::time_point now, const Visit& expired)
+{
+  for (auto it = m_sessions.begin(); it != m_sessions.end();)
+  {
+    if (it->second.deadline > now)
+    {
+      ++it;
+      continue;
+    }
+    Detached session = std::move(it->second);
+    m_tokens.erase(session.id);
+    it = m_sessions.erase(it);
+    expired(session);
+  }
+}
+
+bool SessionTable::Drop(int id, Detached& session)
+{
+  auto token = m_tokens.find(id);
+  if (token == m_tokens.end())
+    return false;
+  auto it = m_sessions.find(token->second);
+  session = std::move(it->second);
+  m_sessions.erase(it);
+  m_tokens.erase(token);
+  return true;
+}
+
+void SessionTable::ForEach(const Visit& visit) const
+{
+  for (const auto& entry : m_sessions)
+    visit(entry.second);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+/* Resumable sessions, so that a client whose socket dropped comes back as
+ * the same peer instead of signing in again.
+ *
+ * sign_in hands out a session token. When the peer's connection closes, its
+ * id and name are kept under the token for grace ms and its pairs stay as
+ * they are; frames sent to it meanwhile wait in its mailbox (mailbox.h). A
+ * "resume" with the token on a new connection takes the peer over and gets
+ * the mailbox delivered. Once the window is over the peer is gone as if its
+ * connection had just closed.
+ */
+struct session_limits {
+  int grace = 30000;                 // ms, 0 disables resumption
+};
+
+extern session_limits g_session_limits;
+
+class SessionTable
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // a peer whose connection closed
+  struct Detached
+  {
+    int id = -1;
+    std::string name;
+    Clock::time_point deadline;
+  };
+
+  typedef std::function<void(const Detached&)> Visit;
+
+  // 128 random bits, hex
+  static std::string NewToken();
+
+  // keeps peer id under token until grace ms after now
+  void Detach(const std::string& token, int id, const std::string& name,
+              Clock::time_point now);
+  // moves the session of token into session, false if it is unknown or over
+  bool Resume(const std::string& token, Detached& session);
+  // removes the sessions whose window is over at now, expired sees each
+  void Expire(Clock::time_point now, const Visit& expired);
+  // ends the session of id early and moves it into session, false if id is
+  // not detached
+  bool Drop(int id, Detached& session);
+
+  bool Has(int id) const { return m_tokens.count(id) != 0; }
+  void ForEach(const Visit& visit) const;
+  size_t Size() const { return m_sessions.size(); }
+
+private:
+  std::unordered_map<std::string, Detached> m_sessions;
+  // peer id to its token
+  std::unordered_map<int, std::string> m_tokens;
+};
@@ -0,0 +1,44 @@
+#include "signal_dispatch.h"
+#include <cstring>
+#include "server_log.h"
+
+namespace {
+  // same as SignalHash, without recursing on untrusted input
+  size_t RuntimeSlot(const char* s, size_t n)
+  {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+      h = (h ^ static_cast<unsigned char>(s[i])) * 16777619u;
+    return h & (SignalDispatcher::kSlots - 1);
+  }
+}
+
+bool SignalDispatcher::Register(const std::string& signal, Handler handler)
+{
+  Entry& entry = m_table[RuntimeSlot(signal.data(), signal.size())];
+  if (!entry.signal.empty() && entry.signal != signal)
+  {
+    BOOST_LOG_TRIVIAL(error) << "signal " << signal << " collides with "
+                             << entry.signal;
+    return false;
+  }
+  entry.signal = signal;
+  entry.handler = std::move(handler);
+  return true;
+}
+
+bool SignalDispatcher::Dispatch(const char* begin, const char* end,
+                                connection_id id, Json::Value& value)
+{
+  size_t n = static_cast<size_t>(end - begin);
+  const Entry& entry = m_table[RuntimeSlot(begin, n)];
+  if (!entry.handler || entry.signal.size() != n
+      || std::memcmp(entry.signal.data(), begin, n) != 0)
+  {
+    m_unknown.fetch_add(1, std::memory_order_relaxed);
+    SERVER_LOG(debug) << "unknown signal:" << std::string(begin, end);
+    return false;
+  }
+  entry.handler(id, value);
+  return true;
+}
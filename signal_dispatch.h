@@ -0,0 +1,79 @@
+#pragma once
+
+#include "websocket_server.h"
+#include <json/value.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/* Maps a "signal" name to its handler with one hash and one compare.
+ *
+ * The hash is usable at compile time, so a server can static_assert that its
+ * built in signal names land in distinct slots. Signals registered later
+ * (rooms, presence, ...) are checked the same way by Register().
+ */
+
+// FNV-1a
+constexpr uint32_t SignalHash(const char* s, size_t n, uint32_t h = 2166136261u)
+{
+  return n == 0 ? h
+    : SignalHash(s + 1, n - 1,
+                 (h ^ static_cast<unsigned char>(*s)) * 16777619u);
+}
+
+constexpr size_t SignalLength(const char* s)
+{
+  return *s == '\0' ? 0 : 1 + SignalLength(s + 1);
+}
+
+class SignalDispatcher
+{
+public:
+  typedef std::function<void(connection_id, Json::Value&)> Handler;
+
+  static constexpr size_t kSlots = 64;
+
+  static constexpr size_t Slot(const char* signal)
+  {
+    return SignalHash(signal, SignalLength(signal)) & (kSlots - 1);
+  }
+
+  // true when no two of names[0, n) share a slot
+  static constexpr bool IsPerfect(const char* const* names, size_t n)
+  {
+    return n == 0
+      || (SlotFree(names[0], names + 1, n - 1) && IsPerfect(names + 1, n - 1));
+  }
+
+  // false if signal would share a slot with another registered signal
+  bool Register(const std::string& signal, Handler handler);
+
+  // false if no handler is registered for [begin, end)
+  bool Dispatch(const char* begin, const char* end, connection_id id,
+                Json::Value& value);
+
+  // signals that matched no handler
+  uint64_t UnknownCount() const
+  {
+    return m_unknown.load(std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr bool SlotFree(const char* name, const char* const* names,
+                                 size_t n)
+  {
+    return n == 0
+      || (Slot(name) != Slot(names[0]) && SlotFree(name, names + 1, n - 1));
+  }
+
+  struct Entry
+  {
+    std::string signal;
+    Handler handler;
+  };
+
+  std::array<Entry, kSlots> m_table;
+  std::atomic<uint64_t> m_unknown{0};
+};
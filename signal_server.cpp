@@ -1,85 +1,647 @@
 ﻿#include "signal_server.h"
+#include "json_context.h"
+#include "server_config.h"
+#include "server_log.h"
+#include "journal.h"
 #include <map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstring>
 #include <boost/log/trivial.hpp>
-#include <json/reader.h>
 
 namespace {
-  const char kSignal[] = "signal";
-  const char kName[] = "name";
-  const char kMessage[] = "message";
-  const char kSignIn[] = "sign_in";
-  const char kSignOut[] = "sign_out";
-  const char kID[] = "id";
+  constexpr char kSignal[] = "signal";
+  constexpr char kName[] = "name";
+  constexpr char kMessage[] = "message";
+  constexpr char kSignIn[] = "sign_in";
+  constexpr char kSignOut[] = "sign_out";
+  constexpr char kID[] = "id";
+  constexpr char kExist[] = "exist";
+  constexpr char kTo[] = "to";
+  constexpr char kFrom[] = "from";
+  constexpr char kType[] = "type";
+  constexpr char kOffer[] = "offer";
+  constexpr char kAnswer[] = "answer";
+  constexpr char kCandidate[] = "candidate";
+  constexpr char kResume[] = "resume";
+  constexpr char kSession[] = "session";
+  constexpr char kReceipt[] = "receipt";
+  constexpr char kSubscribe[] = "subscribe";
+  constexpr char kUnsubscribe[] = "unsubscribe";
+  constexpr char kIds[] = "ids";
+  constexpr char kNames[] = "names";
+  constexpr char kOnline[] = "online";
+  constexpr char kSearch[] = "search";
+  constexpr char kPrefix[] = "prefix";
+  constexpr char kLimit[] = "limit";
+  constexpr char kBatch[] = "batch";
+
+  constexpr const char* kBuiltinSignals[] = {kSignIn, kSignOut, kMessage, kExist,
+                                             kResume, kSubscribe, kUnsubscribe,
+                                             kSearch};
+  static_assert(SignalDispatcher::IsPerfect(kBuiltinSignals, 8),
+                "built in signals collide, grow SignalDispatcher::kSlots");
+
+  // the worker peer directory has no free id
+  constexpr ReplyTemplate<> kSignInFullReply(
+    "{\"signal\":\"return\",\"request\":\"sign_in\",\"status\":\"full\"}");
+  constexpr ReplyTemplate<> kSignOutReply(
+    "{\"signal\":\"return\",\"request\":\"sign_out\",\"status\":\"ok\"}");
+  constexpr ReplyTemplate<IdSlot> kSignOutNotice(
+    "{\"signal\":\"sign_out\",\"id\":", "}");
+  constexpr ReplyTemplate<IdSlot> kExistReply(
+    "{\"signal\":\"return\",\"request\":\"exist\",\"exist\":true,\"id\":", "}");
+  constexpr ReplyTemplate<> kNotExistReply(
+    "{\"signal\":\"return\",\"request\":\"exist\",\"exist\":false}");
+  constexpr ReplyTemplate<> kRateLimitedNotice("{\"signal\":\"rate_limited\"}");
+  constexpr ReplyTemplate<IdSlot> kReconnectNotice(
+    "{\"signal\":\"reconnect\",\"deadline\":", "}");
+  constexpr ReplyTemplate<IdSlot, NameSlot, NameSlot> kResumeReply(
+    "{\"signal\":\"return\",\"request\":\"resume\",\"status\":\"ok\",\"id\":",
+    ",\"name\":", ",\"session\":", "}");
+  constexpr ReplyTemplate<> kResumeExpiredReply(
+    "{\"signal\":\"return\",\"request\":\"resume\",\"status\":\"expired\"}");
+  // "id" is the "receipt" of the message, "to" its recipient
+  constexpr ReplyTemplate<IdSlot, IdSlot> kDeliveredNotice(
+    "{\"signal\":\"delivery\",\"status\":\"delivered\",\"id\":", ",\"to\":", "}");
+  constexpr ReplyTemplate<IdSlot, IdSlot> kUndeliveredNotice(
+    "{\"signal\":\"delivery\",\"status\":\"failed\",\"id\":", ",\"to\":", "}");
+  constexpr ReplyTemplate<> kUnsubscribeReply(
+    "{\"signal\":\"return\",\"request\":\"unsubscribe\",\"status\":\"ok\"}");
+  // a "presence" notice is kPresenceHead, entries separated by commas and
+  // kPresenceTail
+  constexpr ReplyTemplate<IdSlot, NameSlot, FlagSlot> kPresenceEntry(
+    "{\"id\":", ",\"name\":", ",\"online\":", "}");
+  constexpr char kPresenceHead[] = "{\"signal\":\"presence\",\"peers\":[";
+  constexpr char kPresenceTail[] = "]}";
+  // a batched exist reply is kExistBatchHead, an id or -1 per name asked
+  // for and kListTail, or kTruncatedTail when there were more names than
+  // exist_batch and only the first ones are answered; a search reply
+  // kSearchHead, kSearchEntry per peer and kListTail
+  constexpr char kExistBatchHead[] =
+    "{\"signal\":\"return\",\"request\":\"exist\",\"ids\":[";
+  constexpr char kSearchHead[] =
+    "{\"signal\":\"return\",\"request\":\"search\",\"peers\":[";
+  constexpr ReplyTemplate<IdSlot, NameSlot> kSearchEntry("[", ",", "]");
+  constexpr char kListTail[] = "]}";
+  constexpr char kTruncatedTail[] = "],\"truncated\":true}";
+  // the reply to a group message, the ids as sent and their deliveries in
+  // the same order
+  constexpr char kGroupReplyHead[] =
+    "{\"signal\":\"return\",\"request\":\"message\",\"to\":[";
+  constexpr char kGroupReplyStatus[] = "],\"status\":[";
+  // by SignalServer::Delivery
+  constexpr const char* kDeliveryNames[] = {"\"sent\"", "\"held\"",
+                                            "\"relayed\"", "\"failed\""};
+  static_assert(kSignInFullReply.Valid()
+                && kSignOutReply.Valid() && kSignOutNotice.Valid()
+                && kExistReply.Valid() && kNotExistReply.Valid()
+                && kRateLimitedNotice.Valid() && kReconnectNotice.Valid()
+                && kResumeReply.Valid() && kResumeExpiredReply.Valid()
+                && kDeliveredNotice.Valid() && kUndeliveredNotice.Valid()
+                && kUnsubscribeReply.Valid() && kPresenceEntry.Valid()
+                && kSearchEntry.Valid(),
+                "malformed reply template");
+
+  SignalServer::MessageType TypeOf(const char* begin, const char* end)
+  {
+    size_t n = static_cast<size_t>(end - begin);
+    if (n == sizeof(kOffer) - 1 && std::equal(begin, end, kOffer))
+      return SignalServer::OFFER;
+    if (n == sizeof(kAnswer) - 1 && std::equal(begin, end, kAnswer))
+      return SignalServer::ANSWER;
+    if (n == sizeof(kCandidate) - 1 && std::equal(begin, end, kCandidate))
+      return SignalServer::CANDIDATE;
+    return SignalServer::OTHER;
+  }
+
+  // under backpressure a queued candidate may be dropped and a newer offer
+  // from the same peer replaces a queued one
+  send_options RelayOptions(const SignalServer::MessageRoute& route)
+  {
+    if (route.type == SignalServer::CANDIDATE)
+      return send_options(true);
+    if (route.type == SignalServer::OFFER)
+      return send_options(false, static_cast<uint32_t>(route.from) * 2 + 1);
+    return send_options();
+  }
+
+  // Collects the top level "signal", "to", "from" and "type" members of a
+  // frame and stops the parse once a message can be routed with them.
+  class SignalScanner : public Json::EventHandler
+  {
+  public:
+    bool null() override { return Next(); }
+    bool boolean(bool) override { return Next(); }
+    bool number(const Json::Value& value) override
+    {
+      if (m_depth == 1 && (m_field == kTo || m_field == kFrom))
+      {
+        if (!value.isConvertibleTo(Json::intValue))
+          m_valid = false;
+        else if (m_field == kTo)
+        {
+          m_route.to = value.asInt();
+          m_has_to = true;
+        }
+        else
+        {
+          m_route.from = value.asInt();
+          m_has_from = true;
+        }
+      }
+      else if (m_in_group && m_depth == 2)
+      {
+        // collection stops at the cap, a longer list is refused
+        if (!value.isConvertibleTo(Json::intValue)
+            || m_group.size()
+               >= g_group_limits.recipients.load(std::memory_order_relaxed))
+          m_refused = true;
+        else
+          m_group.push_back(value.asInt());
+      }
+      return Next();
+    }
+    bool string(const char* begin, const char* end) override
+    {
+      if (m_depth == 1 && m_field == kSignal)
+        m_signal.assign(begin, end);
+      else if (m_depth == 1 && m_field == kType)
+      {
+        m_route.type = TypeOf(begin, end);
+        m_has_type = true;
+      }
+      else if (m_depth == 1 && (m_field == kTo || m_field == kFrom))
+        m_valid = false;
+      else if (m_in_group)
+        m_refused = true;
+      return Next();
+    }
+    bool startObject() override
+    {
+      if (m_in_group)
+        m_refused = true;
+      return Open();
+    }
+    bool startArray() override
+    {
+      // "to" may list several ids
+      if (m_in_group)
+        m_refused = true;
+      else if (m_depth == 1 && m_field == kTo)
+      {
+        m_in_group = true;
+        m_refused = false;
+        m_group.clear();
+      }
+      return Open();
+    }
+    bool endObject() override { return Close(); }
+    bool endArray() override
+    {
+      if (m_in_group && m_depth == 2)
+      {
+        m_in_group = false;
+        m_is_group = true;
+        m_has_to = true;
+      }
+      return Close();
+    }
+    bool key(const char* begin, const char* end) override
+    {
+      m_field = nullptr;
+      if (m_depth == 1)
+      {
+        for (const char* field : {kSignal, kTo, kFrom, kType})
+        {
+          if (std::strlen(field) == size_t(end - begin)
+              && std::equal(begin, end, field))
+            m_field = field;
+        }
+      }
+      return true;
+    }
+
+    // a "message" whose target is known, the rest of it is not needed
+    bool IsRelay() const
+    {
+      return m_valid && m_signal == kMessage && m_has_to;
+    }
+    const SignalServer::MessageRoute& Route() const { return m_route; }
+    const std::string& Signal() const { return m_signal; }
+    // "to" was a list, Group() holds it and Route().to means nothing
+    bool IsGroup() const { return m_is_group; }
+    const std::vector<int>& Group() const { return m_group; }
+    // the list held something other than ids or more than the cap of them,
+    // Group() has the ids read before that
+    bool IsRefused() const { return m_refused; }
+
+  private:
+    bool Open()
+    {
+      ++m_depth;
+      return Next();
+    }
+    bool Close()
+    {
+      --m_depth;
+      return Next();
+    }
+    // called after every value, false once nothing else can change routing
+    bool Next()
+    {
+      if (m_depth != 1 || !m_valid || m_signal.empty())
+        return m_valid;
+      if (m_signal != kMessage)
+        return false;
+      return !(m_has_to && m_has_type
+               && (m_route.type != SignalServer::OFFER || m_has_from));
+    }
+
+    int m_depth = 0;
+    const char* m_field = nullptr;
+    bool m_valid = true;
+    bool m_has_to = false;
+    bool m_has_from = false;
+    bool m_has_type = false;
+    bool m_in_group = false;
+    bool m_is_group = false;
+    bool m_refused = false;
+    std::string m_signal;
+    SignalServer::MessageRoute m_route = {0, 0, SignalServer::OTHER};
+    std::vector<int> m_group;
+  };
+
+  // Finds the top level "receipt" of a frame, only read for the frames that
+  // could not be relayed at once.
+  class ReceiptScanner : public Json::EventHandler
+  {
+  public:
+    bool null() override { return Next(); }
+    bool boolean(bool) override { return Next(); }
+    bool number(const Json::Value& value) override
+    {
+      if (m_field && value.isConvertibleTo(Json::intValue))
+        m_receipt = value.asInt();
+      return Next();
+    }
+    bool string(const char*, const char*) override { return Next(); }
+    bool startObject() override { ++m_depth; return Next(); }
+    bool startArray() override { ++m_depth; return Next(); }
+    bool endObject() override { --m_depth; return Next(); }
+    bool endArray() override { --m_depth; return Next(); }
+    bool key(const char* begin, const char* end) override
+    {
+      m_field = m_depth == 1 && size_t(end - begin) == sizeof(kReceipt) - 1
+                && std::equal(begin, end, kReceipt);
+      return true;
+    }
+
+    // -1 if the frame has none
+    int Receipt() const { return m_receipt; }
+
+  private:
+    bool Next()
+    {
+      m_field = false;
+      return m_receipt < 0;
+    }
+
+    int m_depth = 0;
+    bool m_field = false;
+    int m_receipt = -1;
+  };
+
+  int ReceiptOf(const std::string& text)
+  {
+    ReceiptScanner scanner;
+    JsonContext::Local().Scan(text.data(), text.data() + text.size(), scanner);
+    return scanner.Receipt();
+  }
 }
 
-SignalServer::SignalServer()
-  :m_last_id(-1)
+SignalServer::SignalServer(const char* queue_name)
+  :WebsocketServer(queue_name), m_last_id(-1), m_workers(nullptr),
+   m_limiter(g_rate_limits)
 {
+  RegisterSignal(kSignIn, bind(&SignalServer::ProcessSignIn, this, ::_1, ::_2));
+  RegisterSignal(kSignOut, bind(&SignalServer::ProcessSignOut, this, ::_1, ::_2));
+  RegisterSignal(kMessage, [this](connection_id conn, Json::Value& value) {
+    ProcessMessage(conn, value);
+  });
+  RegisterSignal(kExist, bind(&SignalServer::ProcessExist, this, ::_1, ::_2));
+  RegisterSignal(kResume, bind(&SignalServer::ProcessResume, this, ::_1, ::_2));
+  RegisterSignal(kSearch, bind(&SignalServer::ProcessSearch, this, ::_1, ::_2));
+  RegisterSignal(kSubscribe,
+                 bind(&SignalServer::ProcessSubscribe, this, ::_1, ::_2));
+  RegisterSignal(kUnsubscribe,
+                 bind(&SignalServer::ProcessUnsubscribe, this, ::_1, ::_2));
+}
 
+void SignalServer::JoinWorkers(WorkerGroup* workers)
+{
+  m_workers = workers;
+  SetReusePort(true);
+  SetMaxMessageSize(WorkerGroup::kMaxFrame);
+  WatchWakeup(workers->WakeupFd());
+  // a worker forked in place of a dead one starts with the peers of the
+  // others, joins and leaves come as relays from now on
+  workers->ForEach([this](int id, const char* name) { m_names.Add(id, name); });
+}
+
+bool SignalServer::RegisterSignal(const std::string& signal,
+                                  SignalDispatcher::Handler handler)
+{
+  return m_signals.Register(signal, std::move(handler));
 }
 
-void SignalServer::OnReceive(connection_hdl hdl, const std::string& message)
+void SignalServer::OnReceive(connection_id conn, message_ptr msg)
 {
 //  BOOST_LOG_TRIVIAL(info) << "RECV:" << message;
-  Json::Reader reader;
+  std::string& payload = msg->get_raw_payload();
+  char* begin = &payload[0];
+  char* end = begin + payload.size();
+
+  // limits are checked before anything is parsed
+  RateLimiter::Clock::time_point now = RateLimiter::Clock::now();
+  if (Limited(conn, m_limiter.AllowFrame(conn, now)))
+    return;
+
+  // a relayed message is routed by its top level fields and forwarded as
+  // received, so the bulk of it (sdp, candidate) is never parsed
+  JsonContext& json = JsonContext::Local();
+  SignalScanner scanner;
+  if (json.Scan(begin, end, scanner) == Json::EventReader::failed)
+    return;
+  const std::string& signal_name = scanner.Signal();
+  if (Limited(conn, m_limiter.AllowSignal(conn, signal_name.data(),
+                                         signal_name.data() + signal_name.size(),
+                                         now)))
+    return;
+  if (scanner.IsRelay())
+  {
+    if (scanner.IsGroup())
+      ProcessGroupMessage(conn, scanner.Route(), scanner.Group(),
+                          scanner.IsRefused(), payload);
+    else
+      ProcessMessage(conn, scanner.Route(), payload);
+    return;
+  }
+
+  // parse in place, the strings of jinput point into the payload of msg
   Json::Value jinput;
-  if (reader.parse(message, jinput) && jinput.isMember(kSignal))
+  if (json.Parse(begin, end, &jinput) && jinput.isMember(kSignal))
   {
-    std::string type = jinput[kSignal].asString();
+    const char* signal = nullptr;
+    const char* signal_end = nullptr;
+    jinput[kSignal].getString(&signal, &signal_end);
+    if (!m_signals.Dispatch(signal, signal_end, conn, jinput))
+      g_stats->Add(ServerStats::UNKNOWN_SIGNAL);
+  }
+
+
+
+}
 
-    if (type == kSignIn)
+bool SignalServer::IsControl(const message_ptr& msg)
+{
+  const std::string& payload = msg->get_payload();
+  SignalScanner scanner;
+  JsonContext::Local().Scan(payload.data(), payload.data() + payload.size(),
+                            scanner);
+  return scanner.Signal() == kSignIn || scanner.Signal() == kSignOut
+    || scanner.Signal() == kResume;
+}
+
+void SignalServer::OnDrain(int deadline)
+{
+  m_reply.clear();
+  kReconnectNotice.Write(m_reply, deadline);
+  WebsocketServer::Broadcast(m_reply);
+}
+
+bool SignalServer::Drained()
+{
+  if (!m_pending_offers.empty())
+    SERVER_LOG(debug) << "drain waits for " << m_pending_offers.size()
+                             << " offers";
+  return m_pending_offers.empty();
+}
+
+void SignalServer::OnWakeup()
+{
+  m_workers->Drain([this](const WorkerGroup::Relay& relay, const char* text) {
+    MessageRoute route;
+    route.from = relay.from;
+    route.to = relay.to;
+    route.type = static_cast<MessageType>(relay.type);
+    std::string frame(text, relay.size);
+    if (route.type == JOIN || route.type == LEAVE)
     {
-      ProcessSignIn(hdl, jinput);
+      Present(route.from, frame, route.type == JOIN);
+      return;
     }
-    else if(type == kSignOut)
+    connection_id conn_to = GetConnectionFromID(route.to);
+    if (conn_to != 0)
+      Relay(conn_to, route, frame);
+    else if (!Hold(route, frame))
+      Undeliverable(route, frame);
+    TrackRoute(route);
+  });
+}
+
+void SignalServer::OnTick()
+{
+  if (m_sessions.Size() == 0 && m_mailboxes.Letters() == 0)
+    return;
+  SessionTable::Clock::time_point now = SessionTable::Clock::now();
+  m_sessions.Expire(now,
+                    [this](const SessionTable::Detached& session) {
+    g_stats->Add(ServerStats::SESSIONS_EXPIRED);
+    Journal(JOURNAL_EXPIRE, 0, session.id);
+    SERVER_LOG(debug) << "--session expired:" << session.id << " "
+                      << session.name;
+    if (m_workers)
+      m_workers->Release(session.id);
+    PeerGone(session.id, session.name);
+  });
+  m_mailboxes.Expire(now, [this](const MailboxTable::Letter& letter) {
+    Receipt(letter, false);
+  });
+  g_stats->Set(ServerStats::DETACHED, m_sessions.Size());
+  g_stats->Set(ServerStats::MAILBOX_BYTES, m_mailboxes.Bytes());
+}
+
+std::chrono::steady_clock::time_point SignalServer::OnFlush()
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point next = m_candidates.Expire(now,
+    [this](int from, int to, const std::string& frame, size_t count) {
+      SendBatch(from, to, frame, count);
+    });
+  return std::min(next, m_presence.Flush(now,
+                          [this](int subscriber,
+                                 const std::vector<PresenceTable::Change>& changes) {
+    std::string notice(kPresenceHead);
+    for (size_t i = 0; i < changes.size(); ++i)
     {
-      ProcessSignOut(hdl, jinput);
+      if (i != 0)
+        notice += ',';
+      kPresenceEntry.Write(notice, changes[i].id, changes[i].name,
+                           changes[i].online);
     }
-    else if (type == kMessage)
+    notice += kPresenceTail;
+    SendToPeer(MessageRoute{-1, subscriber, OTHER}, notice);
+  }));
+}
+
+void SignalServer::OnControl(const control_message& msg, std::ostream& reply)
+{
+  if (m_workers)
+    reply << "worker " << m_workers->Self() << "\n";
+
+  if (msg.command == MQ_PEERS)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex_peers);
+    WritePeers(reply);
+  }
+  else if (msg.command == MQ_KICK)
+  {
+    SessionTable::Detached session;
+    connection_id conn = GetConnectionFromID(msg.arg);
+    if (conn != 0)
     {
-      ProcessMessage(hdl, jinput);
+      BOOST_LOG_TRIVIAL(info) << "kick peer " << msg.arg;
+      Journal(JOURNAL_KICK, conn, msg.arg);
+      {
+        // a kicked peer does not come back with its session
+        std::lock_guard<std::mutex> lock(m_mutex_peers);
+        PeerOf(conn)->session.clear();
+      }
+      Close(conn, websocketpp::close::status::policy_violation, "kicked");
+      reply << "peer " << msg.arg << " kicked\n";
     }
-    else if (type == "exist")
+    else if (m_sessions.Drop(msg.arg, session))
     {
-      ProcessExist(hdl, jinput);
+      BOOST_LOG_TRIVIAL(info) << "kick detached peer " << msg.arg;
+      Journal(JOURNAL_KICK, 0, msg.arg);
+      if (m_workers)
+        m_workers->Release(msg.arg);
+      PeerGone(msg.arg, session.name);
+      g_stats->Set(ServerStats::DETACHED, m_sessions.Size());
+      reply << "detached peer " << msg.arg << " kicked\n";
     }
+    else if (!m_workers || m_workers->Owner(msg.arg) < 0)
+      reply << "peer " << msg.arg << " not found\n";
   }
+  else if (msg.command == MQ_RELOAD_CONFIG)
+  {
+    std::string error;
+    if (ReloadRuntimeConfig(msg.text, error))
+    {
+      // buckets start full again under the new limits
+      m_limiter = RateLimiter(g_rate_limits);
+      ApplyDispatchLimits();
+      reply << "config reloaded from " << msg.text << "\n";
+    }
+    else
+      reply << "config not reloaded: " << error << "\n";
+  }
+  else
+  {
+    WebsocketServer::OnControl(msg, reply);
+    if (msg.command == MQ_STATS)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex_peers);
+      reply << "peers: " << m_peer_connections.size() << "\n"
+            << "pairs: " << m_vPairID.size() << "\n"
+            << "pending offers: " << m_pending_offers.size() << "\n"
+            << "detached sessions: " << m_sessions.Size() << "\n"
+            << "mailbox: " << m_mailboxes.Letters() << " frames, "
+            << m_mailboxes.Bytes() << " bytes\n"
+            << "unknown signals: " << UnknownSignals() << "\n"
+            << "rate limited connection: " << RateLimited("connection") << "\n";
+      for (const auto& limit : g_rate_limits.signals)
+        reply << "rate limited " << limit.first << ": "
+              << RateLimited(limit.first) << "\n";
+    }
+  }
+}
 
-
-
+bool SignalServer::Limited(connection_id conn, RateLimiter::Verdict verdict)
+{
+  if (verdict == RateLimiter::PASS)
+    return false;
+  g_stats->Add(ServerStats::RATE_LIMITED);
+  if (verdict == RateLimiter::REJECT_FIRST)
+  {
+    m_reply.clear();
+    kRateLimitedNotice.Write(m_reply);
+    this->Send(m_reply, conn);
+  }
+  return true;
 }
 
-void SignalServer::OnClose(connection_hdl hdl)
+void SignalServer::OnClose(connection_id conn)
 {
+  m_limiter.Remove(conn);
   int pid = -1;
-  std::string text;
+  std::string name;
+  bool detached = false;
   {
     std::lock_guard<std::mutex> lock(m_mutex_peers);
-    if (m_map_peers.count(hdl))
+    Peer* peer = PeerOf(conn);
+    if (peer)
     {
-      Peer p = m_map_peers[hdl];
-      Json::Value jreturn;
-      jreturn[kSignal] = kSignOut;
-      jreturn[kID] = p.id;
-      BOOST_LOG_TRIVIAL(info) <<"--disconnect:"<<p.id<<" "<< p.name;
-      m_map_peers.erase(hdl);
-      pid = p.id;
-      text = jreturn.toStyledString();
+      pid = peer->id;
+      name = peer->name;
+      SERVER_LOG(debug) <<"--disconnect:"<<pid<<" "<< peer->name;
+      // the client may come back with its session, until then the peer
+      // keeps its id and pairs
+      detached = !peer->session.empty() && g_session_limits.grace > 0;
+      if (detached)
+        m_sessions.Detach(peer->session, pid, peer->name,
+                          SessionTable::Clock::now());
+      RemovePeer(*peer, !detached);
       PrintPeers();
     }
   }
+  Journal(JOURNAL_CLOSE, conn, pid);
 
-  if (pid != -1)
+  if (detached)
   {
-    int id = RemovePairID(pid);
-    if (id != -1)
-    {
-      connection_hdl hdl_p = GetConnectionFromID(id);
-      if (!hdl_p.expired())
-        this->Send(text, hdl_p);
-    }
+    Journal(JOURNAL_DETACH, conn, pid);
+    g_stats->Set(ServerStats::DETACHED, m_sessions.Size());
   }
+  else if (pid != -1)
+    PeerGone(pid, name);
+}
 
+void SignalServer::PeerGone(int pid, const std::string& name)
+{
+  m_presence.Drop(pid);
+  Announce(pid, name, false);
+  m_mailboxes.Discard(pid, [this](const MailboxTable::Letter& letter) {
+    Receipt(letter, false);
+  });
+  g_stats->Set(ServerStats::MAILBOX_BYTES, m_mailboxes.Bytes());
+
+  for (auto it = m_pending_offers.begin(); it != m_pending_offers.end();)
+  {
+    if (it->first == pid || it->second == pid)
+      it = m_pending_offers.erase(it);
+    else
+      ++it;
+  }
+
+  int id = RemovePairID(pid);
+  if (id != -1)
+  {
+    m_reply.clear();
+    kSignOutNotice.Write(m_reply, pid);
+    SendToPeer(MessageRoute{pid, id, OTHER}, m_reply);
+  }
+  CountRoutes();
 }
 
 #ifdef WIN32
@@ -87,8 +649,11 @@ void SignalServer::OnClose(connection_hdl hdl)
 #endif // WIN32
 
 
-int SignalServer::NextID()
+int SignalServer::NextID(const std::string& name)
 {
+  if (m_workers)
+    return m_workers->Claim(name);
+
   int id = m_last_id + 1;
   if (id >= INT_MAX)
     id = 0;
@@ -105,6 +670,20 @@ int SignalServer::NextID()
 }
 
 void SignalServer::PrintPeers()
+{
+  g_stats->Set(ServerStats::PEERS, m_peer_connections.size());
+  // the table is only built when debug records are written
+  SERVER_LOG(debug) <<"peer list\n"<< PeerTable() <<"  \n";
+}
+
+std::string SignalServer::PeerTable()
+{
+  std::stringstream ss_out;
+  WritePeers(ss_out);
+  return ss_out.str();
+}
+
+void SignalServer::WritePeers(std::ostream& ss_out)
 {
 
   bool bShortSegment = true;
@@ -115,7 +694,6 @@ void SignalServer::PrintPeers()
 #endif
  
 
-  std::stringstream ss_out;
   if (bShortSegment)
   {
     ss_out << "┌──────┬──────────────────────────────────────────────┐\n";
@@ -131,17 +709,17 @@ void SignalServer::PrintPeers()
     sz1 = 5;
   }
 
-  std::map<int, Peer> map_sort_peers;
+  std::map<int, const Peer*> map_sort_peers;
 
-  for (auto p : m_map_peers)
+  for (const auto& p : m_peer_connections)
   {
-    map_sort_peers[p.second.id] = p.second;
+    map_sort_peers[p.first] = &m_peers[connection_slot(p.second)];
   }
 
-  for (auto p: map_sort_peers)
+  for (const auto& p : map_sort_peers)
   {
-    ss_out << std::left << "│ " << std::setw(sz1) << p.second.id << "│ "
-      << std::setw(sz2) << p.second.name << "  "<< "│\n";
+    ss_out << std::left << "│ " << std::setw(sz1) << p.first << "│ "
+      << std::setw(sz2) << p.second->name << "  "<< "│\n";
   }
 
   if (bShortSegment)
@@ -150,37 +728,47 @@ void SignalServer::PrintPeers()
   }
   else
     ss_out <<"└───┴────────────────────────┘\n";
-
-  BOOST_LOG_TRIVIAL(info) <<"peer list\n"<< ss_out.str() <<"  \n";
-  boost::log::core::get()->flush();
 }
 
 void SignalServer::Broadcast(const std::string& text)
 {
-  for (auto& p : m_map_peers)
+  for (const auto& p : m_peer_connections)
   {
-    this->Send(text, p.first);
+    this->Send(text, p.second);
   }
 }
 
-void SignalServer::ProcessSignIn(connection_hdl hdl, Json::Value& value)
+void SignalServer::ProcessSignIn(connection_id conn, Json::Value& value)
 {
+    g_stats->Add(ServerStats::SIGN_IN);
     Peer p;
      p.name = value[kName].asString();
-     p.hdl = hdl;
-     p.id = NextID();
+     p.batch = value[kBatch].isBool() && value[kBatch].asBool();
+     int same_id = IsExist(p.name);
+     p.id = NextID(p.name);
+     if (p.id < 0)
+     {
+       BOOST_LOG_TRIVIAL(error) << "--sign in:" << p.name << " no free id";
+       m_reply.clear();
+       kSignInFullReply.Write(m_reply);
+       this->Send(m_reply, conn);
+       return;
+     }
     
      Json::Value jreturn;
      jreturn[kID] = p.id;
      jreturn[kName] = p.name;
  //    this->Broadcast(jreturn.toStyledString());
 
-     int same_id = IsExist(p.name);
-
      jreturn[kSignal] = "return";
      jreturn["request"] = "sign_in";
      jreturn["status"] = "ok";
      jreturn["repeat"] = (same_id != -1);
+     if (g_session_limits.grace > 0)
+     {
+       p.session = SessionTable::NewToken();
+       jreturn[kSession] = p.session;
+     }
      if (!g_ice_server.uri.empty())
      {
        Json::Value ice;
@@ -190,130 +778,555 @@ void SignalServer::ProcessSignIn(connection_hdl hdl, Json::Value& value)
        jreturn["ice"] = ice;
      }
      
+     Peer replaced;
      if (value.isMember("nolist"))
      {
        std::lock_guard<std::mutex> lock(m_mutex_peers);
-       m_map_peers[hdl] = p;
+       replaced = AddPeer(conn, p);
      }
      else
      {
        std::lock_guard<std::mutex> lock(m_mutex_peers);
        Json::Value peers;
-       for (auto &pa : m_map_peers)
+       if (m_workers)
        {
+         // the peers of all workers as the join and leave relays left them,
+         // not a scan of the whole directory; a leave relay that did not fit
+         // its ring leaves a stale entry, the directory tells
+         m_names.ForEach([&](int id, const std::string& name) {
+           if (id == p.id || m_workers->Owner(id) < 0)
+             return;
            Json::Value pv;
-           pv["name"] = pa.second.name;
-           pv["id"] = pa.second.id;
+           pv["name"] = name;
+           pv["id"] = id;
            peers.append(pv);
+         });
        }
-       m_map_peers[hdl] = p;
+       else
+       {
+         for (const auto& pa : m_peer_connections)
+         {
+           Json::Value pv;
+           pv["name"] = m_peers[connection_slot(pa.second)].name;
+           pv["id"] = pa.first;
+           peers.append(pv);
+         }
+         m_sessions.ForEach([&](const SessionTable::Detached& session) {
+           Json::Value pv;
+           pv["name"] = session.name;
+           pv["id"] = session.id;
+           peers.append(pv);
+         });
+       }
+       replaced = AddPeer(conn, p);
        jreturn["peers"] = peers;
      }
+     if (replaced.id != -1)
+       PeerGone(replaced.id, replaced.name);
 
-     this->Send(jreturn.toStyledString(), hdl);
+     this->Send(JsonContext::Local().Write(jreturn), conn);
+     Announce(p.id, p.name, true);
 
      //printf("--sign in:%d %s\n", p.id,p.name.data());
-     BOOST_LOG_TRIVIAL(info) << "--sign in:" << p.id<<" "<<p.name;
+     Journal(JOURNAL_SIGN_IN, conn, p.id, -1, p.name);
+     SERVER_LOG(debug) << "--sign in:" << p.id<<" "<<p.name;
      PrintPeers();
 }
 
-void SignalServer::ProcessSignOut(connection_hdl hdl, Json::Value& value)
+void SignalServer::ProcessSignOut(connection_id conn, Json::Value& value)
 {
-  int id = value[kID].asInt();
-
+  g_stats->Add(ServerStats::SIGN_OUT);
+  Peer gone;
   {
       std::lock_guard<std::mutex> lock(m_mutex_peers);
-      m_map_peers.erase(hdl);
+      Peer* peer = PeerOf(conn);
+      if (peer)
+      {
+        gone = *peer;
+        RemovePeer(*peer);
+      }
   }
+  // the peer signed in on conn, whatever id the frame names
+  int id = gone.id;
+  Journal(JOURNAL_SIGN_OUT, conn, id);
 
-  Json::Value jreturn;
-  jreturn[kSignal] = "return";
-  jreturn["request"] = "sign_out";
-  jreturn["status"] = "ok";
+  m_reply.clear();
+  kSignOutReply.Write(m_reply);
+  this->Send(m_reply,conn);
+
+  // as on close: its pair, watchers, pending offers and held letters
+  if (gone.id != -1)
+    PeerGone(gone.id, gone.name);
+//  this->Broadcast(jreturn.toStyledString());
+//  printf("--sign out:%d\n", id);
+  SERVER_LOG(debug) << "--sign out:"<<id;
+  PrintPeers();
+}
+
+void SignalServer::ProcessMessage(connection_id conn, Json::Value& value)
+{
+  // the frames the scanner could not route, a "to" or "from" that is no id
+  // is dropped here rather than thrown on
+  if (!value[kTo].isConvertibleTo(Json::intValue)
+      || !value[kFrom].isConvertibleTo(Json::intValue))
+  {
+    SERVER_LOG(debug) << "message without a valid to/from dropped";
+    return;
+  }
+  MessageRoute route;
+  route.to = value[kTo].asInt();
+  route.type = OTHER;
+  if (value.isMember(kType) && value[kType].isString())
+  {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    value[kType].getString(&begin, &end);
+    route.type = TypeOf(begin, end);
+  }
+  route.from = route.type == OFFER ? value[kFrom].asInt() : 0;
+  ProcessMessage(conn, route, JsonContext::Local().Write(value));
+}
 
-  this->Send(jreturn.toStyledString(),hdl);
+void SignalServer::ProcessMessage(connection_id conn, const MessageRoute& route,
+                                  const std::string& text)
+{
+  g_stats->Add(ServerStats::MESSAGE);
+  if (route.type == OFFER)
+    g_stats->Add(ServerStats::OFFERS);
+  else if (route.type == ANSWER)
+    g_stats->Add(ServerStats::ANSWERS);
+  else if (route.type == CANDIDATE)
+    g_stats->Add(ServerStats::CANDIDATES);
 
-  jreturn.clear();
-  jreturn[kSignal] = kSignOut;
-  jreturn[kID] = id;
+  // the sender of anything but an offer is its connection's peer, for the
+  // answer's bookkeeping and for delivery notices
+  MessageRoute sent = route;
+  if (sent.type != OFFER)
+    sent.from = PeerID(conn);
+  SendToPeer(sent, text);
+  g_stats->AddRelay(std::chrono::steady_clock::now() - ReceivedAt());
+  TrackRoute(sent);
+}
 
-  int pid = RemovePairID(id);
-  if (pid != -1)
+void SignalServer::ProcessGroupMessage(connection_id conn,
+                                       const MessageRoute& route,
+                                       const std::vector<int>& group,
+                                       bool refused, const std::string& text)
+{
+  g_stats->Add(ServerStats::MESSAGE);
+  g_stats->Add(ServerStats::GROUP_MESSAGES);
+
+  MessageRoute sent = route;
+  if (sent.type != OFFER)
+    sent.from = PeerID(conn);
+  // framed once for every recipient connected here
+  message_ptr frame;
+  std::string ids;
+  std::string deliveries;
+  std::unordered_set<int> seen(group.size());
+  size_t recipients = 0;
+  for (int to : group)
   {
-    connection_hdl hdl = GetConnectionFromID(pid);
-    if (!hdl.expired())
-      this->Send(jreturn.toStyledString(), hdl);
+    if (!seen.insert(to).second)
+      continue;
+    Delivery delivery = FAILED;
+    if (!refused)
+    {
+      sent.to = to;
+      connection_id conn_to = GetConnectionFromID(sent.to);
+      if (conn_to != 0)
+      {
+        FlushCandidates(sent.from, sent.to);
+        if (!frame)
+          frame = MakeFrame(text);
+        this->Send(frame, conn_to, RelayOptions(sent));
+        delivery = SENT;
+      }
+      else
+        delivery = SendToPeer(sent, text);
+      TrackRoute(sent);
+    }
+    if (recipients++ != 0)
+    {
+      ids += ',';
+      deliveries += ',';
+    }
+    IdSlot::Put(ids, to);
+    deliveries += kDeliveryNames[delivery];
   }
-//  this->Broadcast(jreturn.toStyledString());
-//  printf("--sign out:%d\n", id);
-  BOOST_LOG_TRIVIAL(info) << "--sign out:"<<id;
-  PrintPeers();
+  g_stats->AddRelay(std::chrono::steady_clock::now() - ReceivedAt());
+
+  m_reply.assign(kGroupReplyHead);
+  m_reply += ids;
+  m_reply += kGroupReplyStatus;
+  m_reply += deliveries;
+  m_reply += kListTail;
+  this->Send(m_reply, conn);
+}
+
+SignalServer::Delivery SignalServer::SendToPeer(const MessageRoute& route,
+                                                const std::string& text)
+{
+  connection_id conn_to = GetConnectionFromID(route.to);
+  if (conn_to != 0)
+  {
+    Relay(conn_to, route, text);
+    return SENT;
+  }
+  if (Hold(route, text))
+    return HELD;
+
+  int owner = m_workers ? m_workers->Owner(route.to) : -1;
+  if (owner < 0 || owner == m_workers->Self())
+  {
+    Undeliverable(route, text);
+    return FAILED;
+  }
+  WorkerGroup::Relay relay;
+  relay.to = route.to;
+  relay.from = route.from;
+  relay.type = route.type;
+  relay.size = static_cast<uint32_t>(text.size());
+  if (!m_workers->Post(owner, relay, text.data()))
+  {
+    BOOST_LOG_TRIVIAL(warning) << "relay to worker " << owner << " dropped";
+    Undeliverable(route, text);
+    return FAILED;
+  }
+  return RELAYED;
+}
+
+void SignalServer::Relay(connection_id conn, const MessageRoute& route,
+                         const std::string& text)
+{
+  auto send = [this](int from, int to, const std::string& frame,
+                     size_t count) {
+    SendBatch(from, to, frame, count);
+  };
+  if (route.type == CANDIDATE && g_batch_limits.window > 0)
+  {
+    bool batch;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex_peers);
+      Peer* peer = PeerOf(conn);
+      batch = peer && peer->batch;
+    }
+    if (batch)
+    {
+      m_candidates.Add(route.from, route.to, text,
+                       CandidateBatcher::Clock::now(), send);
+      return;
+    }
+  }
+  // nothing overtakes the candidates held between the same peers
+  m_candidates.Flush(route.from, route.to, send);
+  this->Send(text, conn, RelayOptions(route));
+}
+
+void SignalServer::FlushCandidates(int from, int to)
+{
+  m_candidates.Flush(from, to, [this](int from, int to,
+                                      const std::string& frame, size_t count) {
+    SendBatch(from, to, frame, count);
+  });
+}
+
+void SignalServer::SendBatch(int from, int to, const std::string& frame,
+                             size_t count)
+{
+  MessageRoute route{from, to, CANDIDATE};
+  connection_id conn = GetConnectionFromID(to);
+  if (conn == 0)
+  {
+    SendToPeer(route, frame);
+    return;
+  }
+  if (count > 1)
+    g_stats->Add(ServerStats::CANDIDATE_BATCHES);
+  this->Send(frame, conn, RelayOptions(route));
+}
+
+bool SignalServer::Hold(const MessageRoute& route, const std::string& text)
+{
+  if (!m_sessions.Has(route.to))
+    return false;
+  MailboxTable::Letter letter;
+  letter.to = route.to;
+  letter.from = route.from;
+  letter.receipt = ReceiptOf(text);
+  letter.deadline = MailboxTable::Clock::now()
+    + std::chrono::milliseconds(g_mailbox_limits.ttl);
+  letter.text = text;
+  auto lost = [this](const MailboxTable::Letter& l) { Receipt(l, false); };
+  // a refused letter is left as it was
+  if (m_mailboxes.Hold(std::move(letter), lost))
+    g_stats->Add(ServerStats::MAILBOX_HELD);
+  else
+    lost(letter);
+  g_stats->Set(ServerStats::MAILBOX_BYTES, m_mailboxes.Bytes());
+  return true;
+}
+
+void SignalServer::Undeliverable(const MessageRoute& route,
+                                 const std::string& text)
+{
+  MailboxTable::Letter letter;
+  letter.to = route.to;
+  letter.from = route.from;
+  letter.receipt = ReceiptOf(text);
+  Receipt(letter, false);
 }
 
-void SignalServer::ProcessMessage(connection_hdl hdl, Json::Value& value)
+void SignalServer::Receipt(const MailboxTable::Letter& letter, bool delivered)
 {
-  int id = value["to"].asInt();
-  connection_hdl hdl_to = GetConnectionFromID(id);
-  if (!hdl_to.expired())
-  this->Send(value.toStyledString(), hdl_to);
-  
-  if (value.isMember("type") && value["type"].asString() == "offer")
+  g_stats->Add(delivered ? ServerStats::MAILBOX_DELIVERED
+                         : ServerStats::UNDELIVERED);
+  if (letter.receipt < 0 || letter.from < 0)
+    return;
+  // not m_reply, the frame being relayed may be written there
+  std::string notice;
+  if (delivered)
+    kDeliveredNotice.Write(notice, letter.receipt, letter.to);
+  else
+    kUndeliveredNotice.Write(notice, letter.receipt, letter.to);
+  SendToPeer(MessageRoute{letter.to, letter.from, OTHER}, notice);
+}
+
+void SignalServer::TrackRoute(const MessageRoute& route)
+{
+  if (route.type == ANSWER)
+    m_pending_offers.erase(std::make_pair(route.to, route.from));
+
+  if (route.type == OFFER)
   {
+    m_pending_offers.insert(std::make_pair(route.from, route.to));
+    Journal(JOURNAL_PAIR, 0, route.from, route.to);
     Pair p;
-    p.from = value["from"].asInt();
-    p.to = id;
+    p.from = route.from;
+    p.to = route.to;
     m_vPairID.push_back(p);
   }
+  if (route.type == OFFER || route.type == ANSWER)
+    CountRoutes();
+}
+
+void SignalServer::CountRoutes()
+{
+  g_stats->Set(ServerStats::PAIRS, m_vPairID.size());
+  g_stats->Set(ServerStats::PENDING_OFFERS, m_pending_offers.size());
 }
 
-void SignalServer::ProcessExist(connection_hdl hdl, Json::Value& value)
+void SignalServer::ProcessExist(connection_id conn, Json::Value& value)
 {
+  g_stats->Add(ServerStats::EXIST);
+  // a batch answers with the ids in the order of the names
+  const Json::Value& names = value[kNames];
+  if (names.isArray())
+  {
+    m_reply.assign(kExistBatchHead);
+    Json::ArrayIndex n = std::min<Json::ArrayIndex>(
+      names.size(), static_cast<Json::ArrayIndex>(g_lookup_limits.batch));
+    for (Json::ArrayIndex i = 0; i < n; ++i)
+    {
+      if (i != 0)
+        m_reply += ',';
+      IdSlot::Put(m_reply, names[i].isString() ? IsExist(names[i].asString())
+                                               : -1);
+    }
+    m_reply += n < names.size() ? kTruncatedTail : kListTail;
+    this->Send(m_reply, conn);
+    return;
+  }
+
   std::string name = value["name"].asString();
   int id = IsExist(name);
 
-  Json::Value jreturn;
-  jreturn[kSignal] = "return";
-  jreturn["request"] = "exist";
-
+  m_reply.clear();
   if (id >= 0)
+    kExistReply.Write(m_reply, id);
+  else
+    kNotExistReply.Write(m_reply);
+
+  this->Send(m_reply, conn);
+}
+
+void SignalServer::ProcessSearch(connection_id conn, Json::Value& value)
+{
+  g_stats->Add(ServerStats::SEARCH);
+  std::string prefix = value[kPrefix].asString();
+  size_t limit = g_lookup_limits.results;
+  if (value[kLimit].isUInt())
+    limit = std::min<size_t>(limit, value[kLimit].asUInt());
+
+  m_reply.assign(kSearchHead);
+  bool first = true;
+  m_names.Prefix(prefix, limit, [&](int id, const std::string& name) {
+    if (!first)
+      m_reply += ',';
+    first = false;
+    kSearchEntry.Write(m_reply, id, name);
+  });
+  m_reply += kListTail;
+  this->Send(m_reply, conn);
+}
+
+void SignalServer::ProcessResume(connection_id conn, Json::Value& value)
+{
+  SessionTable::Detached session;
+  m_reply.clear();
+  if (!value[kSession].isString()
+      || !m_sessions.Resume(value[kSession].asString(), session))
   {
-    jreturn["id"] = id;
-    jreturn["exist"] = true;
+    kResumeExpiredReply.Write(m_reply);
+    this->Send(m_reply, conn);
+    return;
   }
-  else
+  g_stats->Add(ServerStats::RESUMED);
+  g_stats->Set(ServerStats::DETACHED, m_sessions.Size());
+
+  Peer p;
+  p.id = session.id;
+  p.name = session.name;
+  p.session = SessionTable::NewToken();
+  p.batch = value[kBatch].isBool() && value[kBatch].asBool();
+  Peer replaced;
   {
-    jreturn["exist"] = false;
+    std::lock_guard<std::mutex> lock(m_mutex_peers);
+    replaced = AddPeer(conn, p);
   }
+  if (replaced.id != -1)
+    PeerGone(replaced.id, replaced.name);
+  kResumeReply.Write(m_reply, p.id, p.name, p.session);
+  this->Send(m_reply, conn);
+  // what was sent to the peer while it was away, in order
+  size_t delivered = 0;
+  m_mailboxes.Deliver(p.id, MailboxTable::Clock::now(),
+                      [&](const MailboxTable::Letter& letter) {
+    this->Send(letter.text, conn);
+    Receipt(letter, true);
+    ++delivered;
+  }, [this](const MailboxTable::Letter& letter) { Receipt(letter, false); });
+  g_stats->Set(ServerStats::MAILBOX_BYTES, m_mailboxes.Bytes());
 
-  this->Send(jreturn.toStyledString(), hdl);
+  Journal(JOURNAL_RESUME, conn, p.id);
+  SERVER_LOG(debug) << "--resume:" << p.id << " " << p.name << " delivered "
+                    << delivered;
+  PrintPeers();
 }
 
-bool SignalServer::IsExist(int id)
+void SignalServer::ProcessSubscribe(connection_id conn, Json::Value& value)
 {
-  std::lock_guard<std::mutex> lock(m_mutex_peers);
-  for (auto& p : m_map_peers)
+  int subscriber = PeerID(conn);
+  if (subscriber < 0)
+    return;
+
+  // the current state of everything watched, changes follow as "presence"
+  Json::Value peers(Json::arrayValue);
+  bool full = false;
+  for (const Json::Value& id : value[kIds])
   {
-    if (p.second.id == id)
+    if (!id.isConvertibleTo(Json::intValue))
+      continue;
+    if (!m_presence.WatchId(subscriber, id.asInt()))
     {
-      return true;
+      full = true;
+      break;
     }
+    Json::Value pv;
+    pv[kID] = id.asInt();
+    pv[kOnline] = IsExist(id.asInt())
+      || (m_workers && m_workers->Owner(id.asInt()) >= 0);
+    peers.append(pv);
   }
-  return false;
+  for (const Json::Value& name : value[kNames])
+  {
+    if (full || !name.isString())
+      continue;
+    if (!m_presence.WatchName(subscriber, name.asString()))
+    {
+      full = true;
+      break;
+    }
+    Json::Value pv;
+    int id = IsExist(name.asString());
+    if (id >= 0)
+      pv[kID] = id;
+    pv[kName] = name;
+    pv[kOnline] = id >= 0;
+    peers.append(pv);
+  }
+
+  Json::Value jreturn;
+  jreturn[kSignal] = "return";
+  jreturn["request"] = kSubscribe;
+  jreturn["status"] = full ? "full" : "ok";
+  jreturn["peers"] = peers;
+  this->Send(JsonContext::Local().Write(jreturn), conn);
 }
 
+void SignalServer::ProcessUnsubscribe(connection_id conn, Json::Value& value)
+{
+  int subscriber = PeerID(conn);
+  if (subscriber < 0)
+    return;
+  for (const Json::Value& id : value[kIds])
+  {
+    if (id.isConvertibleTo(Json::intValue))
+      m_presence.UnwatchId(subscriber, id.asInt());
+  }
+  for (const Json::Value& name : value[kNames])
+  {
+    if (name.isString())
+      m_presence.UnwatchName(subscriber, name.asString());
+  }
+  m_reply.clear();
+  kUnsubscribeReply.Write(m_reply);
+  this->Send(m_reply, conn);
+}
 
+void SignalServer::Present(int id, const std::string& name, bool online)
+{
+  if (online)
+    m_names.Add(id, name);
+  else
+    m_names.Remove(id, name);
+  m_presence.Announce(id, name, online, PresenceTable::Clock::now());
+}
 
-int SignalServer::IsExist(const std::string& name)
+void SignalServer::Announce(int id, const std::string& name, bool online)
 {
-  std::lock_guard<std::mutex> lock(m_mutex_peers);
-  for (auto& p : m_map_peers)
+  Present(id, name, online);
+  if (!m_workers)
+    return;
+  WorkerGroup::Relay relay;
+  relay.to = -1;
+  relay.from = id;
+  relay.type = online ? JOIN : LEAVE;
+  relay.size = static_cast<uint32_t>(name.size());
+  for (int worker = 0; worker < m_workers->Workers(); ++worker)
   {
-    if (p.second.name == name)
-    {
-      return p.second.id;
-    }
+    if (worker != m_workers->Self()
+        && !m_workers->Post(worker, relay, name.data()))
+      BOOST_LOG_TRIVIAL(warning) << "presence to worker " << worker
+                                 << " dropped";
   }
-  return -1;
+}
+
+bool SignalServer::IsExist(int id)
+{
+  std::lock_guard<std::mutex> lock(m_mutex_peers);
+  return m_peer_connections.count(id) != 0 || m_sessions.Has(id);
+}
+
+
+
+int SignalServer::IsExist(const std::string& name)
+{
+  int id = m_names.Find(name);
+  // a leave relay that did not fit its ring leaves a stale entry behind
+  if (m_workers && id >= 0 && m_workers->Owner(id) < 0)
+    return -1;
+  return id;
 }
 
 int SignalServer::RemovePairID(int id)
@@ -325,7 +1338,8 @@ int SignalServer::RemovePairID(int id)
     if (itb->from == id || itb->to == id)
     {
       int pid = itb->from == id ? itb->to : itb->from;
-      BOOST_LOG_TRIVIAL(info) << "remove pair:" << itb->from << ":" << itb->to;
+      Journal(JOURNAL_UNPAIR, 0, id, pid);
+      SERVER_LOG(debug) << "remove pair:" << itb->from << ":" << itb->to;
       m_vPairID.erase(itb);
       return pid;
     }
@@ -334,18 +1348,65 @@ int SignalServer::RemovePairID(int id)
   return -1;
 }
 
-connection_hdl SignalServer::GetConnectionFromID(int id)
+int SignalServer::PeerID(connection_id conn)
 {
   std::lock_guard<std::mutex> lock(m_mutex_peers);
-  for (auto& p : m_map_peers)
+  Peer* peer = PeerOf(conn);
+  return peer ? peer->id : -1;
+}
+
+SignalServer::Peer* SignalServer::PeerOf(connection_id conn)
+{
+  uint32_t slot = connection_slot(conn);
+  if (slot >= m_peers.size() || m_peers[slot].connection != conn)
+    return nullptr;
+  return &m_peers[slot];
+}
+
+SignalServer::Peer SignalServer::AddPeer(connection_id conn, const Peer& peer)
+{
+  uint32_t slot = connection_slot(conn);
+  if (slot >= m_peers.size())
+    m_peers.resize(slot + 1);
+  // signed in again on the same connection, the old id goes
+  Peer replaced;
+  if (m_peers[slot].connection == conn)
   {
-    if (p.second.id == id)
-    {
-      return p.first;
-    }
+    replaced = m_peers[slot];
+    RemovePeer(m_peers[slot]);
   }
+  m_peers[slot] = peer;
+  m_peers[slot].connection = conn;
+  m_peer_connections[peer.id] = conn;
+  return replaced;
+}
 
-  return connection_hdl();
+void SignalServer::RemovePeer(Peer& peer, bool release)
+{
+  auto it = m_peer_connections.find(peer.id);
+  if (it != m_peer_connections.end() && it->second == peer.connection)
+    m_peer_connections.erase(it);
+  if (release && m_workers)
+    m_workers->Release(peer.id);
+  peer = Peer();
 }
 
-ICE g_ice_server;
\ No newline at end of file
+connection_id SignalServer::GetConnectionFromID(int id)
+{
+  std::lock_guard<std::mutex> lock(m_mutex_peers);
+  auto it = m_peer_connections.find(id);
+  return it == m_peer_connections.end() ? 0 : it->second;
+}
+
+ICE g_ice_server;
+group_limits g_group_limits;
+
+bool IsBuiltinSignal(const std::string& name)
+{
+  for (const char* signal : kBuiltinSignals)
+  {
+    if (name == signal)
+      return true;
+  }
+  return false;
+}
\ No newline at end of file
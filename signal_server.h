@@ -1,6 +1,19 @@
 #pragma once
 #include "websocket_server.h"
+#include "candidate_batch.h"
+#include "reply_template.h"
+#include "signal_dispatch.h"
+#include "mailbox.h"
+#include "name_index.h"
+#include "presence.h"
+#include "rate_limit.h"
+#include "session.h"
+#include "worker_group.h"
+#include <atomic>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include <json/value.h>
 #include <mutex>
 struct ICE {
@@ -16,15 +29,31 @@ struct ICE {
 
 extern ICE g_ice_server;
 
+// true for the signals SignalServer handles, the names rate_limits may use
+// besides "connection"
+bool IsBuiltinSignal(const std::string& name);
+
+// a "message" whose "to" lists several peers
+// recipients is read by the scanner on the asio thread as well, so it is
+// atomic: a reload on the dispatch thread may change it at any time
+struct group_limits {
+  std::atomic<size_t> recipients{32};   // a longer list is refused as a whole
+};
+
+extern group_limits g_group_limits;
+
 class SignalServer : public WebsocketServer
 {
 public:
 
+  // a signed in peer, at its connection's slot in m_peers
   struct Peer
   {
-    int id;
-    connection_hdl hdl;
+    connection_id connection = 0; // 0 if no peer signed in on the slot
+    int id = -1;
     std::string name;
+    std::string session;          // token to resume with, empty for none
+    bool batch = false;           // takes candidates in batches
   };
 
   struct Pair
@@ -32,34 +61,164 @@ public:
     int from;
     int to;
   };
-  SignalServer();
 
-  void OnReceive(connection_hdl hdl, const std::string& message) override;
-  void OnClose(connection_hdl hdl) override;
+  enum MessageType
+  {
+    OTHER,
+    OFFER,
+    ANSWER,
+    CANDIDATE,
+    // presence of peer "from", relayed to every worker with its name
+    JOIN,
+    LEAVE
+  };
+
+  // what became of a frame sent to a peer
+  enum Delivery
+  {
+    SENT,       // to the peer's connection
+    HELD,       // in its mailbox, the peer is detached
+    RELAYED,    // to the worker holding the peer
+    FAILED
+  };
+
+  // routing fields of a "message" signal
+  struct MessageRoute
+  {
+    int from;
+    int to;
+    MessageType type;
+  };
+  explicit SignalServer(const char* queue_name = nullptr);
+
+  // run as worker workers->Self() of a group sharing the port
+  void JoinWorkers(WorkerGroup* workers);
+
+  void OnReceive(connection_id conn, message_ptr msg) override;
+  void OnClose(connection_id conn) override;
+  // sign_in and sign_out
+  bool IsControl(const message_ptr& msg) override;
+  // asks every client to reconnect elsewhere, drained once no offer waits
+  // for its answer
+  void OnDrain(int deadline) override;
+  bool Drained() override;
+  // relays from the other workers
+  void OnWakeup() override;
+  // ends the sessions not resumed in time
+  void OnTick() override;
+  // hands out the presence changes and candidate batches that are due
+  std::chrono::steady_clock::time_point OnFlush() override;
+  // peers, kick and reload_config on top of the server's commands
+  void OnControl(const control_message& msg, std::ostream& reply) override;
+
+  // adds a handler for frames whose "signal" is signal, false if its slot is
+  // already taken by another signal
+  bool RegisterSignal(const std::string& signal,
+                      SignalDispatcher::Handler handler);
+  // frames whose signal has no handler
+  uint64_t UnknownSignals() const { return m_signals.UnknownCount(); }
+  // frames rejected by the named limit of g_rate_limits
+  uint64_t RateLimited(const std::string& limit) const
+  {
+    return m_limiter.Rejected(limit);
+  }
 
 
 private:
 
-  int NextID();
+  int NextID(const std::string& name);
   void PrintPeers();
+  // the table of this process's peers, m_mutex_peers held
+  void WritePeers(std::ostream& out);
+  std::string PeerTable();
 
   void Broadcast(const std::string& text);
 
-  void ProcessSignIn(connection_hdl hdl, Json::Value& value);
-  void ProcessSignOut(connection_hdl hdl, Json::Value& value);
-  void ProcessMessage(connection_hdl hdl, Json::Value& value);
-  void ProcessExist(connection_hdl hdl, Json::Value& value);
+  // true if the frame is to be dropped, tells the client the first time
+  bool Limited(connection_id conn, RateLimiter::Verdict verdict);
+
+  void ProcessSignIn(connection_id conn, Json::Value& value);
+  void ProcessSignOut(connection_id conn, Json::Value& value);
+  void ProcessMessage(connection_id conn, Json::Value& value);
+  void ProcessMessage(connection_id conn, const MessageRoute& route,
+                      const std::string& text);
+  // one text to every peer of group, the sender gets their deliveries; a
+  // refused group goes to nobody and every id of it is reported failed
+  void ProcessGroupMessage(connection_id conn, const MessageRoute& route,
+                           const std::vector<int>& group, bool refused,
+                           const std::string& text);
+  void ProcessExist(connection_id conn, Json::Value& value);
+  void ProcessResume(connection_id conn, Json::Value& value);
+  void ProcessSearch(connection_id conn, Json::Value& value);
+  void ProcessSubscribe(connection_id conn, Json::Value& value);
+  void ProcessUnsubscribe(connection_id conn, Json::Value& value);
+  // a peer left for good: its pair and pending offers go, its pair and
+  // watchers are told
+  void PeerGone(int id, const std::string& name);
+  // tells the watchers of peer id, here and on the other workers
+  void Announce(int id, const std::string& name, bool online);
+  // a peer of any worker came or went: m_names and the watchers here
+  void Present(int id, const std::string& name, bool online);
+  // to a peer of this worker or, through the group, of another one
+  Delivery SendToPeer(const MessageRoute& route, const std::string& text);
+  // to a peer connected here, a candidate may wait for the rest of its burst
+  void Relay(connection_id conn, const MessageRoute& route,
+             const std::string& text);
+  // a batch of m_candidates is due
+  void SendBatch(int from, int to, const std::string& frame, size_t count);
+  // the candidates held from from to to go ahead of another frame
+  void FlushCandidates(int from, int to);
+  // keeps text for a detached route.to, false if route.to is not detached
+  bool Hold(const MessageRoute& route, const std::string& text);
+  // text cannot reach route.to, its sender is told if it asked for receipts
+  void Undeliverable(const MessageRoute& route, const std::string& text);
+  // the delivery notice of a letter to its sender, if it asked for one
+  void Receipt(const MailboxTable::Letter& letter, bool delivered);
+  // offer / answer bookkeeping of a relayed message
+  void TrackRoute(const MessageRoute& route);
+  // pairs and pending offers into g_stats
+  void CountRoutes();
   bool IsExist(int id);
   int IsExist(const std::string& name);
 
   int RemovePairID(int id);
+  int PeerID(connection_id conn);
 
-  std::map<connection_hdl, Peer, std::owner_less<connection_hdl>> m_map_peers;
-  connection_hdl GetConnectionFromID(int id);
+  // the peer signed in on conn, null if none; m_mutex_peers held for these
+  Peer* PeerOf(connection_id conn);
+  // the peer it replaced, its id -1 if there was none
+  Peer AddPeer(connection_id conn, const Peer& peer);
+  // release: give the id up, false while a detached session keeps it
+  void RemovePeer(Peer& peer, bool release = true);
+
+  // indexed by connection slot
+  std::vector<Peer> m_peers;
+  // peer id to the connection it signed in on
+  std::unordered_map<int, connection_id> m_peer_connections;
+  // 0 if no peer of this process has id
+  connection_id GetConnectionFromID(int id);
+  // peers whose connection closed, kept for resumption
+  SessionTable m_sessions;
+  // frames to the detached peers
+  MailboxTable m_mailboxes;
+  // who watches whom, by peer id
+  PresenceTable m_presence;
+  // the peers of every worker, detached ones included, by name
+  NameIndex m_names;
+  // candidates held for the peers that take them in batches
+  CandidateBatcher m_candidates;
 
   int m_last_id;
+  WorkerGroup* m_workers;
+
+  SignalDispatcher m_signals;
+  RateLimiter m_limiter;
+  // reused for the replies written from a ReplyTemplate
+  std::string m_reply;
 
   std::vector<Pair> m_vPairID;
+  // (from, to) of relayed offers not answered yet
+  std::set<std::pair<int, int>> m_pending_offers;
   std::mutex m_mutex_peers;
 };
 
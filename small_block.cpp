@@ -0,0 +1,144 @@
+#include "small_block.h"
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace {
+  const size_t kGranule = 64;
+  const size_t kClasses = small_block_pool::max_size / kGranule;
+  // blocks a thread keeps per class, half of them move once it holds more
+  const size_t kCacheBlocks = 64;
+  // lists of kCacheBlocks / 2 the depot keeps per class
+  const size_t kDepotLists = 64;
+
+  struct block {
+    block* next;
+  };
+
+  struct free_list {
+    block* head = nullptr;
+    size_t count = 0;
+
+    void push(void* p) {
+      block* b = static_cast<block*>(p);
+      b->next = head;
+      head = b;
+      ++count;
+    }
+
+    void* pop() {
+      block* b = head;
+      head = b->next;
+      --count;
+      return b;
+    }
+
+    // moves the first n blocks to a new list
+    free_list split(size_t n) {
+      free_list front;
+      front.head = head;
+      front.count = n;
+      block* last = head;
+      for (size_t i = 1; i < n; ++i)
+        last = last->next;
+      head = last->next;
+      last->next = nullptr;
+      count -= n;
+      return front;
+    }
+
+    void release() {
+      while (head != nullptr)
+        ::operator delete(pop());
+    }
+  };
+
+  struct depot {
+    depot() {
+      for (auto& lists : classes)
+        lists.reserve(kDepotLists);
+    }
+
+    std::mutex lock;
+    std::vector<free_list> classes[kClasses];
+  };
+
+  // never destroyed, threads may still return blocks at exit
+  depot& Depot()
+  {
+    static depot* shared = new depot;
+    return *shared;
+  }
+
+  // a full list goes to the depot, or back to operator new if that is full
+  void Deposit(size_t c, free_list list)
+  {
+    depot& d = Depot();
+    {
+      std::lock_guard<std::mutex> guard(d.lock);
+      if (d.classes[c].size() < kDepotLists)
+      {
+        d.classes[c].push_back(list);
+        return;
+      }
+    }
+    list.release();
+  }
+
+  bool Withdraw(size_t c, free_list& list)
+  {
+    depot& d = Depot();
+    std::lock_guard<std::mutex> guard(d.lock);
+    if (d.classes[c].empty())
+      return false;
+    list = d.classes[c].back();
+    d.classes[c].pop_back();
+    return true;
+  }
+
+  struct thread_cache {
+    ~thread_cache() {
+      for (size_t c = 0; c < kClasses; ++c) {
+        if (lists[c].count != 0)
+          Deposit(c, lists[c]);
+        lists[c] = free_list();
+      }
+    }
+
+    free_list lists[kClasses];
+  };
+
+  thread_local thread_cache t_cache;
+
+  size_t SizeClass(size_t size)
+  {
+    return size == 0 ? 0 : (size - 1) / kGranule;
+  }
+}
+
+void* small_block_pool::allocate(size_t size)
+{
+  size_t c = SizeClass(size);
+  if (c >= kClasses)
+    return ::operator new(size);
+  free_list& list = t_cache.lists[c];
+  if (list.count == 0 && !Withdraw(c, list))
+    return ::operator new((c + 1) * kGranule);
+  return list.pop();
+}
+
+void small_block_pool::deallocate(void* p, size_t size) noexcept
+{
+  if (p == nullptr)
+    return;
+  size_t c = SizeClass(size);
+  if (c >= kClasses)
+  {
+    ::operator delete(p);
+    return;
+  }
+  free_list& list = t_cache.lists[c];
+  list.push(p);
+  if (list.count > kCacheBlocks)
+    Deposit(c, list.split(kCacheBlocks / 2));
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio/handler_alloc_hook.hpp>
+
+/* Memory for the small objects that come and go with every frame: asio
+ * handlers, container nodes, shared_ptr control blocks.
+ *
+ * Blocks up to small_block_pool::max_size bytes are kept in per thread free
+ * lists, one per 64 byte size class. A thread that frees more than it
+ * allocates (the dispatch thread popping what the asio thread pushed) hands
+ * half of a full list to a shared depot, a thread that runs dry takes a
+ * list from there. Only that exchange takes a lock. Larger blocks go to
+ * operator new.
+ */
+class small_block_pool {
+public:
+  static const size_t max_size = 1024;
+
+  static void* allocate(size_t size);
+  static void deallocate(void* p, size_t size) noexcept;
+};
+
+// std allocator on small_block_pool
+template <typename T>
+class small_block_allocator {
+public:
+  typedef T value_type;
+
+  small_block_allocator() noexcept {}
+  template <typename U>
+  small_block_allocator(const small_block_allocator<U>&) noexcept {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(small_block_pool::allocate(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) noexcept {
+    small_block_pool::deallocate(p, n * sizeof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const small_block_allocator<T>&,
+                const small_block_allocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const small_block_allocator<T>&,
+                const small_block_allocator<U>&) { return false; }
+
+/* An asio completion handler whose operation state lives in
+ * small_block_pool, through the allocation hooks and, for asio versions
+ * that dropped those, the associated allocator.
+ *
+ *   socket.async_read_some(buffer, make_pooled_handler([](...) { ... }));
+ */
+template <typename Handler>
+class pooled_handler {
+public:
+  typedef small_block_allocator<void> allocator_type;
+
+  explicit pooled_handler(Handler handler) : handler_(std::move(handler)) {}
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+  allocator_type get_allocator() const noexcept { return allocator_type(); }
+
+#if !defined(BOOST_ASIO_NO_DEPRECATED)
+  friend void* asio_handler_allocate(size_t size, pooled_handler*) {
+    return small_block_pool::allocate(size);
+  }
+  friend void asio_handler_deallocate(void* p, size_t size, pooled_handler*) {
+    small_block_pool::deallocate(p, size);
+  }
+#endif
+
+private:
+  Handler handler_;
+};
+
+template <typename Handler>
+pooled_handler<typename std::decay<Handler>::type>
+make_pooled_handler(Handler&& handler) {
+  return pooled_handler<typename std::decay<Handler>::type>(
+    std::forward<Handler>(handler));
+}
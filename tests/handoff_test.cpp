@@ -0,0 +1,196 @@
+// handoff_test: hands a loopback listen socket from one process to another
+// while a client keeps connecting, and fails if any connect is refused.
+//
+// The old server is this process, the new one a forked child. The old one
+// closes its socket once the new one sends MQ_DRAIN, and the client goes on
+// for a while after that, so every connect of the second half can only
+// have been accepted by the new process.
+
+#include "../handoff.h"
+#include "../message_queue.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+  const int kAfterClose = 300;  // ms the client goes on with the new process
+
+  // a listen socket on 127.0.0.1 and an ephemeral port
+  int Listen(uint16_t& port)
+  {
+    int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(addr);
+    if (sock < 0
+        || ::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || ::listen(sock, 1024) != 0
+        || ::getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &size) != 0)
+      return -1;
+    port = ntohs(addr.sin_port);
+    return sock;
+  }
+
+  // accepts and closes connections on sock until stop is readable or set,
+  // returns how many
+  int Accept(int sock, int stop, const std::atomic<bool>* stopped)
+  {
+    int accepted = 0;
+    while (!(stopped && *stopped))
+    {
+      pollfd p[2] = {{sock, POLLIN, 0}, {stop, POLLIN, 0}};
+      if (::poll(p, stop < 0 ? 1 : 2, 10) < 0 || (p[1].revents & POLLIN)
+          || (p[1].revents & POLLHUP))
+        break;
+      if (!(p[0].revents & POLLIN))
+        continue;
+      int conn = ::accept(sock, nullptr, nullptr);
+      if (conn >= 0)
+      {
+        ::close(conn);
+        ++accepted;
+      }
+    }
+    return accepted;
+  }
+
+  // the new server: takes the socket over once go is readable and accepts
+  // on it until go is closed
+  int NewServer(int go, const char* queue, const char* path)
+  {
+    char c;
+    if (::read(go, &c, 1) != 1)
+      return 2;
+    listen_fds fds;
+    if (!TakeOverListenSockets(fds, 1000, queue, path))
+    {
+      std::cerr << "new server: takeover failed\n";
+      return 1;
+    }
+    int accepted = Accept(fds.plain, go, nullptr);
+    // _exit does not flush
+    std::cout << "new server accepted " << accepted << std::endl;
+    return accepted > 0 ? 0 : 1;
+  }
+
+  struct client_counts
+  {
+    std::atomic<int> connected{0};
+    std::atomic<int> refused{0};
+    std::atomic<int> failed{0};
+  };
+
+  void Connect(uint16_t port, client_counts& counts)
+  {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    // a reset on close, no TIME_WAIT piling up on the loopback ports
+    linger l = {1, 0};
+    ::setsockopt(sock, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+      ++counts.connected;
+    else if (errno == ECONNREFUSED)
+      ++counts.refused;
+    else
+      ++counts.failed;
+    ::close(sock);
+  }
+}
+
+int main()
+{
+  std::string queue_name = "handoff_test_" + std::to_string(::getpid());
+  std::string path = "/tmp/handoff_test." + std::to_string(::getpid());
+
+  uint16_t port = 0;
+  int sock = Listen(port);
+  if (sock < 0)
+  {
+    std::cerr << "listen: " << std::strerror(errno) << "\n";
+    return 1;
+  }
+  MessageQueue queue(true, queue_name.c_str());
+
+  // forked before any thread is started
+  int go[2];
+  if (::pipe(go) != 0)
+    return 1;
+  pid_t child = ::fork();
+  if (child == 0)
+  {
+    ::close(go[1]);
+    ::close(sock);
+    queue.Disown();
+    ::_exit(NewServer(go[0], queue_name.c_str(), path.c_str()));
+  }
+  ::close(go[0]);
+
+  std::atomic<bool> stop_old(false);
+  std::atomic<bool> stop_client(false);
+  client_counts before;
+  client_counts after;
+  std::atomic<client_counts*> counts(&before);
+  int old_accepted = 0;
+  std::thread old_server([&] { old_accepted = Accept(sock, -1, &stop_old); });
+  std::thread client([&] {
+    while (!stop_client)
+    {
+      Connect(port, *counts.load());
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // the old server answers MQ_HANDOFF and closes its socket on MQ_DRAIN
+  bool ok = ::write(go[1], "g", 1) == 1;
+  control_message msg;
+  while (ok && queue.WaitMessage(msg) && msg.command != MQ_DRAIN)
+  {
+    if (msg.command == MQ_HANDOFF)
+    {
+      listen_fds fds;
+      fds.plain = sock;
+      ok = SendListenSockets(fds, path.c_str());
+    }
+  }
+  stop_old = true;
+  old_server.join();
+  ::close(sock);
+
+  // from here on only the new process holds the socket
+  counts = &after;
+  std::this_thread::sleep_for(std::chrono::milliseconds(kAfterClose));
+  stop_client = true;
+  client.join();
+  ::close(go[1]);
+  int status = 0;
+  ::waitpid(child, &status, 0);
+
+  std::cout << "old server accepted " << old_accepted << "\n"
+            << "before close: " << before.connected << " connected, "
+            << before.refused << " refused, " << before.failed << " failed\n"
+            << "after close: " << after.connected << " connected, "
+            << after.refused << " refused, " << after.failed << " failed\n";
+  bool passed = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0
+    && before.refused == 0 && after.refused == 0
+    && before.failed == 0 && after.failed == 0
+    && before.connected > 0 && after.connected > 0;
+  std::cout << (passed ? "PASS" : "FAIL") << "\n";
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+// wsJournal: prints the event journal of wsSignalServer, oldest record first
+//
+//   wsJournal <journal file> [-n <last records>]
+
+#include "../journal.h"
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+  void PrintRecord(const JournalRecord& r)
+  {
+    std::time_t seconds = static_cast<std::time_t>(r.time / 1000000000);
+    char when[32];
+    std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&seconds));
+    std::cout << when << "." << std::setfill('0') << std::setw(9)
+              << r.time % 1000000000 << std::setfill(' ')
+              << " [" << r.pid << "] " << std::left << std::setw(9)
+              << EventJournal::Name(r.event) << std::right;
+    if (r.connection != 0)
+      std::cout << " connection " << r.connection;
+    if (r.id >= 0)
+      std::cout << " id " << r.id;
+    if (r.other >= 0)
+      std::cout << " other " << r.other;
+    if (r.name_size != 0)
+      std::cout << " name " << std::string(r.name, std::min<size_t>(r.name_size, sizeof(r.name)));
+    std::cout << "\n";
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "usage: " << argv[0] << " <journal file> [-n <last records>]\n";
+    return 2;
+  }
+  uint64_t last = 0;
+  for (int i = 2; i + 1 < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "-n") == 0)
+      last = std::strtoull(argv[i + 1], nullptr, 10);
+  }
+
+  size_t size = 0;
+  const JournalHeader* header = EventJournal::Map(argv[1], size);
+  if (!header)
+  {
+    std::cerr << argv[1] << " is not a journal\n";
+    return 1;
+  }
+  const JournalRecord* records = EventJournal::Records(header);
+  uint64_t end = header->next.load(std::memory_order_acquire);
+  uint64_t begin = end > header->capacity ? end - header->capacity : 0;
+  if (last != 0 && end - begin > last)
+    begin = end - last;
+
+  uint64_t skipped = 0;
+  for (uint64_t position = begin; position < end; ++position)
+  {
+    const JournalRecord& shared = records[position % header->capacity];
+    uint64_t seq = shared.seq.load(std::memory_order_acquire);
+    JournalRecord r;
+    std::memcpy(static_cast<void*>(&r), &shared, sizeof(r));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // being written, or already overwritten by a live server
+    if (seq != position + 1 || shared.seq.load(std::memory_order_relaxed) != seq)
+    {
+      ++skipped;
+      continue;
+    }
+    PrintRecord(r);
+  }
+  if (skipped != 0)
+    std::cerr << skipped << " records skipped\n";
+  EventJournal::Unmap(header, size);
+  return 0;
+}
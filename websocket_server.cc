@@ -1,9 +1,22 @@
 #include "websocket_server.h"
-#include <boost/log/trivial.hpp>
+#include "server_config.h"
+#include "server_log.h"
+#include "journal.h"
+#include <algorithm>
 #include <utility>
+#include <unistd.h>
 
 typedef websocketpp::lib::shared_ptr<boost::asio::ssl::context> context_ptr;
 
+outbound_limits g_outbound_limits;
+dispatch_limits g_dispatch_limits;
+listen_options g_listen_options;
+
+// how often queued frames are retried while nothing else wakes the loop
+const int kFlushInterval = 20; // ms
+// how long the control thread waits for the dispatch thread's reply
+const int kControlReplyWait = 3000; // ms
+
 
 void on_http(server_tls* s, websocketpp::connection_hdl hdl) {
     server_tls::connection_ptr con = s->get_con_from_hdl(hdl);
@@ -68,53 +81,116 @@ context_ptr on_tls_init(tls_mode mode, websocketpp::connection_hdl hdl) {
             std::cout << "Error setting cipher list" << std::endl;
         }
     } catch (std::exception& e) {
-        std::cout << "Exception: " << e.what() << std::endl;
+        BOOST_LOG_TRIVIAL(error) << "tls init: " << e.what();
+        return context_ptr();
     }
     return ctx;
 }
 
 
-WebsocketServer::WebsocketServer():m_exit_signal(false),m_message_queue(true)
+WebsocketServer::WebsocketServer(const char* queue_name):
+  m_listener_plain(m_ios, m_server_plain),
+  m_listener_tls(m_ios, m_server_tls),
+  m_wakeup_count(0),
+  m_exit_signal(false),
+  m_draining(false),m_drain_done(false),
+  m_connection_count(0),
+  m_actions(g_dispatch_limits.queue_frames, g_dispatch_limits.quantum,
+            g_dispatch_limits.control_frames),
+  m_outbound_bytes(0),
+  m_outbound_dropped(0),m_outbound_closed(0),
+  m_flush_at(std::chrono::steady_clock::time_point::max()),
+  m_message_queue(true, queue_name)
 {
   // Initialize Asio Transport
   m_server_plain.clear_access_channels(websocketpp::log::alevel::all);
   m_server_plain.set_access_channels(websocketpp::log::alevel::none);
   
   m_server_plain.init_asio(&m_ios);
-  // Register handler callbacks
+  // Register handler callbacks, the close, message and pong timeout ones
+  // are bound to the connection's id in attach
   m_server_plain.set_open_handler(bind(&WebsocketServer::on_open, this, ::_1));
-  m_server_plain.set_close_handler(bind(&WebsocketServer::on_close, this, ::_1));
-  m_server_plain.set_message_handler(bind(&WebsocketServer::on_message, this, ::_1, ::_2));
+  m_server_plain.set_socket_init_handler(socket_init(g_listen_options.plain));
+  m_listener_plain.set_options(g_listen_options.plain);
   m_server_plain.set_pong_timeout(15000);
-  m_server_plain.set_pong_timeout_handler(bind(&WebsocketServer::on_pong_timeout, this,::_1,::_2));
 
   m_server_tls.clear_access_channels(websocketpp::log::alevel::all);
   m_server_tls.set_access_channels(websocketpp::log::alevel::none);
   
   m_server_tls.init_asio(&m_ios);
   m_server_tls.set_open_handler(bind(&WebsocketServer::on_open_tls, this, ::_1));
-  m_server_tls.set_close_handler(bind(&WebsocketServer::on_close, this, ::_1));
-  m_server_tls.set_message_handler(bind(&WebsocketServer::on_message,this, ::_1, ::_2));
+  m_server_tls.set_fail_handler(bind(&WebsocketServer::on_fail_tls, this, ::_1));
+  m_server_tls.set_socket_init_handler(socket_init(g_listen_options.tls));
+  m_listener_tls.set_options(g_listen_options.tls);
   m_server_tls.set_http_handler(bind(&on_http, &m_server_tls, ::_1));
-  m_server_tls.set_tls_init_handler(bind(&on_tls_init, MOZILLA_INTERMEDIATE, ::_1));
+  m_server_tls.set_tls_init_handler(bind(&WebsocketServer::tls_context, this, ::_1));
   m_server_tls.set_pong_timeout(15000);
-  m_server_tls.set_pong_timeout_handler(bind(&WebsocketServer::on_pong_timeout, this,::_1,::_2));
 
 }
 
+void WebsocketServer::Inherit(const listen_fds& fds)
+{
+  m_inherited = fds;
+}
+
+void WebsocketServer::SetReusePort(bool value)
+{
+  m_listener_plain.set_reuse_port(value);
+  m_listener_tls.set_reuse_port(value);
+}
+
+void WebsocketServer::SetMaxMessageSize(size_t bytes)
+{
+  m_server_plain.set_max_message_size(bytes);
+  m_server_tls.set_max_message_size(bytes);
+}
+
+void WebsocketServer::WatchWakeup(int fd)
+{
+  m_wakeup.reset(new boost::asio::posix::stream_descriptor(m_ios, ::dup(fd)));
+  wait_wakeup();
+}
+
+void WebsocketServer::wait_wakeup()
+{
+  // reading resets the eventfd, whatever is signaled later wakes us again
+  m_wakeup->async_read_some(
+    boost::asio::buffer(&m_wakeup_count, sizeof(m_wakeup_count)),
+    make_pooled_handler([this](const boost::system::error_code& ec, size_t) {
+      if (ec)
+      {
+        if (ec != boost::asio::error::operation_aborted)
+          BOOST_LOG_TRIVIAL(error) << "wakeup: " << ec.message();
+        return;
+      }
+      {
+        lock_guard<mutex> guard(m_action_lock);
+        m_actions.push_control(action(WAKEUP, 0));
+      }
+      m_action_cond.notify_one();
+      wait_wakeup();
+    }));
+}
+
 void WebsocketServer::run(uint16_t port,uint16_t port_tls)
 {
   // listen on specified port
-  m_server_plain.listen(port);
+  if (m_inherited.plain >= 0)
+    m_listener_plain.assign(m_inherited.plain);
+  else
+    m_listener_plain.listen(port);
 
   // Start the server accept loop
-  m_server_plain.start_accept();
+  m_listener_plain.start_accept();
   // Start the ASIO io_service run loop
   BOOST_LOG_TRIVIAL(info) << "server run at:" << port;
   
-  if (port_tls > 0){
-    m_server_tls.listen(port_tls);
-    m_server_tls.start_accept();   
+  if (m_inherited.tls >= 0 || port_tls > 0){
+    if (m_inherited.tls >= 0)
+      m_listener_tls.assign(m_inherited.tls);
+    else
+      m_listener_tls.listen(port_tls);
+    m_listener_tls.start_accept();   
     BOOST_LOG_TRIVIAL(info) << "stl server run at:" << port;
   }
 
@@ -128,39 +204,77 @@ void WebsocketServer::run(uint16_t port,uint16_t port_tls)
   }
 }
 
+template <typename connection_ptr>
+connection_id WebsocketServer::attach(const connection_ptr& con)
+{
+  connection_id id = m_slots.claim();
+  con->set_message_handler(bind(&WebsocketServer::on_message, this, id, ::_2));
+  con->set_close_handler(bind(&WebsocketServer::on_close, this, id));
+  con->set_pong_timeout_handler(
+    bind(&WebsocketServer::on_pong_timeout, this, id, ::_2));
+  return id;
+}
+
 void WebsocketServer::on_open(connection_hdl hdl)
 {
+  g_stats->Add(ServerStats::CONNECTIONS);
+  g_stats->Add(ServerStats::ACCEPTED);
+  connection_id id = attach(m_server_plain.get_con_from_hdl(hdl));
   {
     lock_guard<mutex> guard(m_action_lock);
-    m_actions.push(action(SUBSCRIBE, std::move(hdl)));
+    m_actions.push_control(action(SUBSCRIBE, id, std::move(hdl)));
   }
   m_action_cond.notify_one();
 }
 
 void WebsocketServer::on_open_tls(connection_hdl hdl)
 {
+  g_stats->Add(ServerStats::CONNECTIONS);
+  g_stats->Add(ServerStats::ACCEPTED);
+  g_stats->Add(ServerStats::TLS_HANDSHAKES);
+  connection_id id = attach(m_server_tls.get_con_from_hdl(hdl));
   {
     lock_guard<mutex> guard(m_action_lock);
-    m_actions.push(action(TLS_SUBSCRIBE, std::move(hdl)));
+    m_actions.push_control(action(TLS_SUBSCRIBE, id, std::move(hdl)));
   }
   m_action_cond.notify_one();
 }
 
-void WebsocketServer::on_close(connection_hdl hdl)
+void WebsocketServer::on_fail_tls(connection_hdl hdl)
 {
+  g_stats->Add(ServerStats::TLS_FAILURES);
+}
+
+void WebsocketServer::on_close(connection_id id)
+{
+  g_stats->Sub(ServerStats::CONNECTIONS);
   {
     lock_guard<mutex> guard(m_action_lock);
-    m_actions.push(action(UNSUBSCRIBE, std::move(hdl)));
+    // after the frames it sent before closing
+    m_actions.push_last(id, action(UNSUBSCRIBE, id));
   }
   m_action_cond.notify_one();
 }
 
-void WebsocketServer::on_message(connection_hdl hdl, server_plain::message_ptr msg)
+void WebsocketServer::on_message(connection_id id, message_ptr msg)
 {
   // queue message up for sending by processing thread
+  g_stats->Add(ServerStats::FRAMES_IN);
+  bool control = IsControl(msg);
+  size_t cost = msg->get_payload().size();
+  action a(MESSAGE, id, std::move(msg));
+  a.received = std::chrono::steady_clock::now();
   {
     lock_guard<mutex> guard(m_action_lock);
-    m_actions.push(action(MESSAGE, std::move(hdl), std::move(msg)));
+    bool queued = control ? m_actions.push_control(id, std::move(a))
+                          : m_actions.push(id, std::move(a), cost);
+    if (!queued)
+    {
+      g_stats->Add(ServerStats::DISPATCH_SHED);
+      SERVER_LOG(debug) << "dispatch queue full, frame shed";
+      return;
+    }
+    g_stats->Set(ServerStats::DISPATCH_QUEUE, m_actions.size());
   }
   m_action_cond.notify_one();
 }
@@ -170,44 +284,97 @@ void WebsocketServer::process_messages()
 {
   while (true)
   {
+    flush_outbound();
+    flush_deferred();
+    check_drain();
     unique_lock<mutex> lock(m_action_lock);
 
-    while (m_actions.empty()) 
+    if (m_actions.empty())
     {
-      m_action_cond.wait(lock);
+      auto until = m_flush_at;
+      if (outbound_pending() || m_draining)
+        until = std::min(until, std::chrono::steady_clock::now()
+                                + std::chrono::milliseconds(kFlushInterval));
+      if (until == std::chrono::steady_clock::time_point::max())
+        m_action_cond.wait(lock);
+      else
+        m_action_cond.wait_until(lock, until);
+      if (m_actions.empty())
+        continue;
     }
 
-    action a = m_actions.front();
-    m_actions.pop();
+    action a = m_actions.pop();
+    g_stats->Set(ServerStats::DISPATCH_QUEUE, m_actions.size());
     lock.unlock();
 
-    if (a.type == SUBSCRIBE) 
-    {
-      lock_guard<mutex> guard(m_connection_lock);
-      m_con_list_plain.insert(a.hdl);
-    }
-    else if (a.type == TLS_SUBSCRIBE) 
+    if (a.type == SUBSCRIBE || a.type == TLS_SUBSCRIBE)
     {
       lock_guard<mutex> guard(m_connection_lock);
-      m_con_list_tls.insert(a.hdl);
+      uint32_t slot = connection_slot(a.id);
+      if (slot >= m_connections.size())
+        m_connections.resize(slot + 1);
+      connection_record& record = m_connections[slot];
+      record.id = a.id;
+      record.tls = a.type == TLS_SUBSCRIBE;
+      std::error_code ec;
+      if (record.tls)
+        record.secure = m_server_tls.get_con_from_hdl(a.hdl, ec);
+      else
+        record.plain = m_server_plain.get_con_from_hdl(a.hdl, ec);
+      ++m_connection_count;
+      Journal(JOURNAL_OPEN, record.id, -1);
     }
     else if (a.type == UNSUBSCRIBE)
     {
       lock_guard<mutex> guard(m_connection_lock);
-      m_con_list_plain.erase(a.hdl);
-      m_con_list_tls.erase(a.hdl);
-      OnClose(a.hdl);
+      connection_record* record = find_connection(a.id);
+      if (record)
+      {
+        erase_outbound(*record);
+        OnClose(a.id);
+        *record = connection_record();
+        --m_connection_count;
+      }
+      m_slots.release(a.id);
     }
     else if (a.type == MESSAGE) 
     {
       lock_guard<mutex> guard(m_connection_lock);
-      if (a.msg->get_opcode() == websocketpp::frame::opcode::text)
+      // a connection's frames all come before its UNSUBSCRIBE
+      if (a.msg->get_opcode() == websocketpp::frame::opcode::text
+          && find_connection(a.id))
       {
-        BOOST_LOG_TRIVIAL(debug) << "-->RECV:\n" << a.msg->get_payload();
-        OnReceive(a.hdl, a.msg->get_payload());
+        SERVER_LOG(debug) << "-->RECV:\n" << a.msg->get_payload();
+        m_received = a.received;
+        OnReceive(a.id, a.msg);
       }
 
     }
+    else if (a.type == WAKEUP)
+    {
+      lock_guard<mutex> guard(m_connection_lock);
+      OnWakeup();
+    }
+    else if (a.type == TICK)
+    {
+      lock_guard<mutex> guard(m_connection_lock);
+      OnTick();
+    }
+    else if (a.type == CONTROL)
+    {
+      std::ostringstream reply;
+      {
+        lock_guard<mutex> guard(m_connection_lock);
+        OnControl(a.control->msg, reply);
+      }
+      // sent by the control thread, a client that does not read its reply
+      // holds up that thread and not this one
+      a.control->reply.set_value(reply.str());
+    }
+    else if (a.type == DRAIN)
+    {
+      start_drain(a.arg);
+    }
     else if(a.type == EXIT)
     {
       BOOST_LOG_TRIVIAL(info) << "message_process loop return";
@@ -239,65 +406,353 @@ void WebsocketServer::Listen(int port,int port_tls)
   {
 	  BOOST_LOG_TRIVIAL(error) << "---main loop exit---" << e.what();
   }
+  catch (boost::system::system_error const & e)
+  {
+	  BOOST_LOG_TRIVIAL(error) << "---main loop exit---" << e.what();
+  }
+}
+
+bool WebsocketServer::Send(void * data, int len, connection_id id)
+{
+  return send_frame(std::string(static_cast<char*>(data), len),
+                    websocketpp::frame::opcode::BINARY, id, send_options());
 }
 
-bool WebsocketServer::Send(void * data, int len, connection_hdl hdl)
+bool WebsocketServer::Send(const std::string& text, connection_id id,
+                           const send_options& options)
 {
-	try {
-    if (m_con_list_plain.count(hdl))
-	    m_server_plain.send(std::move(hdl), data, len, websocketpp::frame::opcode::BINARY);
+  SERVER_LOG(debug) << "<--SEND:\n" << text << "\n";
+  return send_frame(text, websocketpp::frame::opcode::TEXT, id, options);
+}
+
+size_t WebsocketServer::BufferedAmount(connection_id id)
+{
+  lock_guard<mutex> guard(m_outbound_lock);
+  connection_record* record = find_connection(id);
+  if (!record || !record->out)
+    return 0;
+  outbound& out = *record->out;
+  return read_buffered(*record, out) + out.bytes;
+}
+
+WebsocketServer::connection_record*
+WebsocketServer::find_connection(connection_id id)
+{
+  uint32_t slot = connection_slot(id);
+  if (slot >= m_connections.size() || m_connections[slot].id != id)
+    return nullptr;
+  return &m_connections[slot];
+}
+
+size_t WebsocketServer::OutboundBytes()
+{
+  lock_guard<mutex> guard(m_outbound_lock);
+  return m_outbound_bytes;
+}
+
+void WebsocketServer::ApplyDispatchLimits()
+{
+  lock_guard<mutex> guard(m_action_lock);
+  m_actions.limit(g_dispatch_limits.queue_frames, g_dispatch_limits.quantum,
+                  g_dispatch_limits.control_frames);
+}
+
+uint64_t WebsocketServer::OutboundDropped()
+{
+  lock_guard<mutex> guard(m_outbound_lock);
+  return m_outbound_dropped;
+}
+
+uint64_t WebsocketServer::OutboundClosed()
+{
+  lock_guard<mutex> guard(m_outbound_lock);
+  return m_outbound_closed;
+}
+
+bool WebsocketServer::Send(const message_ptr& frame, connection_id id,
+                           const send_options& options)
+{
+  SERVER_LOG(debug) << "<--SEND:\n" << frame->get_payload() << "\n";
+  return send_frame(frame, frame->get_opcode(), id, options);
+}
+
+WebsocketServer::message_ptr WebsocketServer::MakeFrame(const std::string& text)
+{
+  // prepared here, websocketpp then queues the message itself on every
+  // connection instead of copying it into one of its own
+  typedef lean_asio_config::con_msg_manager_type frame_manager;
+  static const std::shared_ptr<frame_manager> manager =
+    std::make_shared<frame_manager>();
+  message_ptr msg = manager->get_message(websocketpp::frame::opcode::text,
+                                         text.size());
+  msg->set_payload(text);
+  websocketpp::frame::basic_header header(websocketpp::frame::opcode::text,
+                                          text.size(), true, false);
+  websocketpp::frame::extended_header extended(text.size());
+  msg->set_header(websocketpp::frame::prepare_header(header, extended));
+  msg->set_prepared(true);
+  return msg;
+}
+
+namespace {
+  size_t payload_size(const std::string& data) { return data.size(); }
+  size_t payload_size(const WebsocketServer::message_ptr& msg)
+  {
+    return msg->get_payload().size();
+  }
+}
+
+template <typename payload>
+bool WebsocketServer::send_frame(const payload& data,
+                                 websocketpp::frame::opcode::value opcode,
+                                 connection_id id,
+                                 const send_options& options)
+{
+  size_t size = payload_size(data);
+  const outbound_limits& limits = g_outbound_limits;
+  lock_guard<mutex> guard(m_outbound_lock);
+  connection_record* found = find_connection(id);
+  if (!found)
+  {
+    BOOST_LOG_TRIVIAL(error) << "send error: connection closed";
+    return false;
+  }
+  connection_record& record = *found;
+  outbound& out = make_outbound(record);
+  if (out.closing)
+    return false;
+
+  flush(record, out);
+  if (out.frames.empty()
+      && (out.buffered == 0 || out.buffered + size <= limits.buffer_bytes))
+  {
+    out.buffered += size;
+    m_outbound_bytes += size;
+    send_now(data, opcode, record);
+    return true;
+  }
+
+  // the client is not reading fast enough, hold the frame back
+  outbound_frame frame(data, opcode, options);
+  if (limits.policy == COALESCE && options.coalesce_key != 0)
+  {
+    for (auto& queued : out.frames)
+    {
+      if (queued.options.coalesce_key != options.coalesce_key)
+        continue;
+      out.bytes += size - queued.size();
+      m_outbound_bytes += size - queued.size();
+      ++m_outbound_dropped;
+      queued = std::move(frame);
+      return make_room(record, out);
+    }
+  }
+  out.bytes += size;
+  m_outbound_bytes += size;
+  out.frames.push_back(std::move(frame));
+  return make_room(record, out);
+}
+
+bool WebsocketServer::send_now(const std::string& data,
+                               websocketpp::frame::opcode::value opcode,
+                               connection_record& record)
+{
+  std::error_code ec;
+  if (record.plain)
+    ec = record.plain->send(data, opcode);
+  else if (record.secure)
+    ec = record.secure->send(data, opcode);
+  if (ec)
+  {
+    BOOST_LOG_TRIVIAL(error) << "send error:" << ec.message();
+    return false;
+  }
+  return true;
+}
+
+bool WebsocketServer::send_now(const message_ptr& msg,
+                               websocketpp::frame::opcode::value,
+                               connection_record& record)
+{
+  std::error_code ec;
+  if (record.plain)
+    ec = record.plain->send(msg);
+  else if (record.secure)
+    ec = record.secure->send(msg);
+  if (ec)
+  {
+    BOOST_LOG_TRIVIAL(error) << "send error:" << ec.message();
+    return false;
+  }
+  return true;
+}
+
+size_t WebsocketServer::read_buffered(connection_record& record, outbound& out)
+{
+  size_t buffered = 0;
+  if (record.plain)
+    buffered = record.plain->get_buffered_amount();
+  else if (record.secure)
+    buffered = record.secure->get_buffered_amount();
+  m_outbound_bytes = m_outbound_bytes - out.buffered + buffered;
+  out.buffered = buffered;
+  return buffered;
+}
+
+void WebsocketServer::flush(connection_record& record, outbound& out)
+{
+  const outbound_limits& limits = g_outbound_limits;
+  read_buffered(record, out);
+  while (!out.frames.empty())
+  {
+    size_t size = out.frames.front().size();
+    if (out.buffered != 0 && out.buffered + size > limits.buffer_bytes)
+      break;
+    outbound_frame frame = std::move(out.frames.front());
+    out.frames.pop_front();
+    out.bytes -= size;
+    out.buffered += size;
+    if (frame.msg)
+      send_now(frame.msg, frame.opcode, record);
     else
-      m_server_tls.send(std::move(hdl), data, len, websocketpp::frame::opcode::BINARY);
-	 return true;
-	}
-	catch (std::exception& e)
-	{
-		BOOST_LOG_TRIVIAL(error) << "send error:"<< e.what();
-	}
-	return false;
-}
-
-bool WebsocketServer::Send(const std::string& text, connection_hdl hdl)
-{
-	try
-	{
-    if (m_con_list_plain.count(hdl))
-		  m_server_plain.send(std::move(hdl), text, websocketpp::frame::opcode::TEXT);
-    else 
-      m_server_tls.send(std::move(hdl), text, websocketpp::frame::opcode::TEXT);
-    BOOST_LOG_TRIVIAL(debug) << "<--SEND:\n" << text << "\n";
-		return true;
-	}
-	catch (std::exception& e)
-	{
-		BOOST_LOG_TRIVIAL(error) <<"send error:"<< e.what();
-	}
-	return false;
+      send_now(frame.data, frame.opcode, record);
+  }
 }
 
-void WebsocketServer::Broadcast(const std::string& text)
+void WebsocketServer::flush_deferred()
+{
+  lock_guard<mutex> guard(m_connection_lock);
+  m_flush_at = OnFlush();
+}
+
+void WebsocketServer::flush_outbound()
 {
+  auto now = std::chrono::steady_clock::now();
+  if (now - m_last_flush < std::chrono::milliseconds(kFlushInterval))
+    return;
+  m_last_flush = now;
+
   lock_guard<mutex> guard(m_connection_lock);
-  for (const auto& hdl: m_con_list_plain)
+  lock_guard<mutex> lock(m_outbound_lock);
+  // backwards, dropping one moves the last slot, already visited, into its
+  // place
+  for (size_t i = m_outbound_slots.size(); i-- > 0;)
   {
-    Send(text, hdl);
+    connection_record& record = m_connections[m_outbound_slots[i]];
+    outbound& out = *record.out;
+    if (out.bytes != 0 || out.buffered != 0)
+      flush(record, out);
+    // an idle connection keeps no outbound state
+    if (out.frames.empty() && out.buffered == 0 && !out.closing)
+      drop_outbound(record);
   }
-  for (const auto& hdl: m_con_list_tls)
+  g_stats->Set(ServerStats::OUTBOUND_BYTES, m_outbound_bytes);
+  g_stats->Set(ServerStats::OUTBOUND_DROPPED, m_outbound_dropped);
+  g_stats->Set(ServerStats::SLOW_CLOSED, m_outbound_closed);
+}
+
+bool WebsocketServer::make_room(connection_record& record, outbound& out)
+{
+  const outbound_limits& limits = g_outbound_limits;
+  while (true)
   {
-    Send(text, hdl);
+    bool full = out.frames.size() > limits.queue_frames
+      || out.bytes > limits.queue_bytes;
+    if (!full && m_outbound_bytes <= limits.global_bytes)
+      return true;
+
+    auto it = out.frames.end();
+    if (limits.policy != CLOSE_CONNECTION)
+    {
+      it = std::find_if(out.frames.begin(), out.frames.end(),
+                        [](const outbound_frame& f) { return f.options.droppable; });
+    }
+    if (it != out.frames.end())
+    {
+      out.bytes -= it->size();
+      m_outbound_bytes -= it->size();
+      ++m_outbound_dropped;
+      out.frames.erase(it);
+      continue;
+    }
+
+    // over the global cap only, close it if it is one of the slow ones
+    if (!full && out.buffered + out.bytes <= limits.buffer_bytes)
+      return true;
+    close_slow(record, out);
+    return false;
   }
 }
 
-void WebsocketServer::Broadcast(void* data, int len)
+void WebsocketServer::close_slow(connection_record& record, outbound& out)
+{
+  BOOST_LOG_TRIVIAL(warning) << "close slow consumer, buffered:" << out.buffered
+                             << " queued:" << out.bytes << "/" << out.frames.size()
+                             << " total:" << m_outbound_bytes;
+  Close(record.id, g_outbound_limits.close_code, "slow consumer");
+
+  m_outbound_bytes -= out.bytes;
+  out.frames.clear();
+  out.bytes = 0;
+  out.closing = true;
+  ++m_outbound_closed;
+}
+
+WebsocketServer::outbound& WebsocketServer::make_outbound(
+  connection_record& record)
+{
+  if (!record.out)
+  {
+    record.out.reset(new outbound(record.tls));
+    record.out->listed = m_outbound_slots.size();
+    m_outbound_slots.push_back(connection_slot(record.id));
+  }
+  return *record.out;
+}
+
+void WebsocketServer::drop_outbound(connection_record& record)
+{
+  size_t listed = record.out->listed;
+  uint32_t last = m_outbound_slots.back();
+  m_outbound_slots[listed] = last;
+  m_connections[last].out->listed = listed;
+  m_outbound_slots.pop_back();
+  record.out.reset();
+}
+
+void WebsocketServer::erase_outbound(connection_record& record)
+{
+  lock_guard<mutex> guard(m_outbound_lock);
+  if (!record.out)
+    return;
+  m_outbound_bytes -= record.out->bytes + record.out->buffered;
+  drop_outbound(record);
+}
+
+bool WebsocketServer::outbound_pending()
 {
+  lock_guard<mutex> guard(m_outbound_lock);
+  return m_outbound_bytes != 0;
+}
+
+void WebsocketServer::Broadcast(const std::string& text)
+{
+  message_ptr frame = MakeFrame(text);
   lock_guard<mutex> guard(m_connection_lock);
-  for (const auto& hdl : m_con_list_plain)
+  for (const auto& record : m_connections)
   {
-    Send(data,len, hdl);
+    if (record.id != 0)
+      Send(frame, record.id);
   }
-  for (const auto& hdl : m_con_list_tls)
+}
+
+void WebsocketServer::Broadcast(void* data, int len)
+{
+  lock_guard<mutex> guard(m_connection_lock);
+  for (const auto& record : m_connections)
   {
-    Send(data,len, hdl);
+    if (record.id != 0)
+      Send(data,len, record.id);
   }
 }
 
@@ -308,49 +763,215 @@ void WebsocketServer::loop_ping() {
       BOOST_LOG_TRIVIAL(info) << "loop_ping exit.";
       return;
     }
-    lock_guard<mutex> guard(m_connection_lock);
-    for (const auto& hdl : m_con_list_plain)
     {
-      std::error_code er;
-      m_server_plain.ping(hdl,"",er);
-      if (er)
+      lock_guard<mutex> guard(m_connection_lock);
+      for (const auto& record : m_connections)
       {
-        BOOST_LOG_TRIVIAL(error) << er.message();
+        std::error_code er;
+        if (record.secure)
+          record.secure->ping("",er);
+        else if (record.plain)
+          record.plain->ping("",er);
+        if (er)
+        {
+          BOOST_LOG_TRIVIAL(error) << er.message();
+        }
       }
     }
-    
-    for (const auto& hdl : m_con_list_tls)
     {
-      std::error_code er;
-      m_server_tls.ping(hdl,"",er);
-      if (er)
-      {
-        BOOST_LOG_TRIVIAL(error) << er.message();
-      }
+      lock_guard<mutex> guard(m_action_lock);
+      m_actions.push_control(action(TICK, 0));
     }
-
+    m_action_cond.notify_one();
   }
 
 }
 
-void WebsocketServer::on_pong_timeout(connection_hdl hdl, std::string s) {
+bool WebsocketServer::Close(connection_id id,
+                            websocketpp::close::status::value code,
+                            const std::string& reason)
+{
+  connection_record* record = find_connection(id);
+  if (!record)
+    return false;
   std::error_code er;
-  if (m_con_list_plain.count(hdl))
-    m_server_plain.close(hdl,websocketpp::close::status::normal,"pong timeout",er);
+  if (record->secure)
+    record->secure->close(code, reason, er);
+  else if (record->plain)
+    record->plain->close(code, reason, er);
+  if (er)
+    BOOST_LOG_TRIVIAL(error) << "close: " << er.message();
+  return !er;
+}
+
+void WebsocketServer::OnControl(const control_message& msg, std::ostream& reply)
+{
+  if (msg.command == MQ_LOG_LEVEL)
+  {
+    boost::log::trivial::severity_level level;
+    if (ParseSeverity(msg.text, level))
+    {
+      SetLogFilter(level);
+      reply << "log level " << level << "\n";
+    }
+    else
+      reply << "unknown log level " << msg.text << "\n";
+  }
+  else if (msg.command == MQ_STATS)
+  {
+    size_t shed;
+    {
+      lock_guard<mutex> guard(m_action_lock);
+      shed = m_actions.shed();
+    }
+    size_t tls = 0;
+    for (const auto& record : m_connections)
+      tls += record.id != 0 && record.tls;
+    reply << "connections: " << m_connection_count - tls << "\n"
+          << "tls connections: " << tls << "\n"
+          << "accept paused: " << m_listener_plain.paused() << "\n"
+          << "dispatch shed: " << shed << "\n"
+          << "outbound bytes: " << OutboundBytes() << "\n"
+          << "outbound dropped: " << OutboundDropped() << "\n"
+          << "slow consumers closed: " << OutboundClosed() << "\n"
+          << "pooled messages: "
+          << message_pool<pooled_message>::instance().spare() << "\n";
+  }
+  else if (msg.command == MQ_RELOAD_CERTS)
+  {
+    reply << (reload_tls_context() ? "certificates reloaded\n"
+                                   : "certificates not reloaded, see log\n");
+  }
+  else if (msg.command == MQ_PAUSE_ACCEPT)
+  {
+    bool pause = msg.arg != 0;
+    m_ios.post([this, pause]() {
+      if (pause)
+      {
+        m_listener_plain.pause();
+        m_listener_tls.pause();
+      }
+      else
+      {
+        m_listener_plain.resume();
+        m_listener_tls.resume();
+      }
+    });
+    reply << (pause ? "accept paused\n" : "accept resumed\n");
+  }
   else
-    m_server_tls.close(hdl,websocketpp::close::status::normal,"pong timeout",er);
-  BOOST_LOG_TRIVIAL(info) << "pong timeout " << er.message();
+    reply << "unknown command " << msg.command << "\n";
+}
+
+WebsocketServer::context_ptr WebsocketServer::tls_context(connection_hdl hdl)
+{
+  lock_guard<mutex> guard(m_tls_lock);
+  if (!m_tls_context)
+    m_tls_context = on_tls_init(MOZILLA_INTERMEDIATE, hdl);
+  return m_tls_context;
+}
+
+bool WebsocketServer::reload_tls_context()
+{
+  context_ptr ctx = on_tls_init(MOZILLA_INTERMEDIATE, connection_hdl());
+  if (!ctx)
+    return false;
+  lock_guard<mutex> guard(m_tls_lock);
+  m_tls_context = ctx;
+  return true;
+}
+
+void WebsocketServer::on_pong_timeout(connection_id id, std::string s) {
+  BOOST_LOG_TRIVIAL(info) << "pong timeout";
+  lock_guard<mutex> guard(m_connection_lock);
+  Close(id, websocketpp::close::status::normal, "pong timeout");
+}
+
+void WebsocketServer::start_drain(int deadline)
+{
+  if (m_draining)
+    return;
+  m_draining = true;
+  m_drain_deadline = std::chrono::steady_clock::now()
+    + std::chrono::milliseconds(deadline);
+  BOOST_LOG_TRIVIAL(info) << "drain, exit in " << deadline << "ms at the latest";
+
+  m_ios.post([this]() {
+    m_listener_plain.stop();
+    m_listener_tls.stop();
+  });
+  OnDrain(deadline);
+}
+
+void WebsocketServer::check_drain()
+{
+  if (!m_draining || m_drain_done)
+    return;
+  bool drained;
+  {
+    lock_guard<mutex> guard(m_connection_lock);
+    drained = Drained();
+  }
+  if (!drained && std::chrono::steady_clock::now() < m_drain_deadline)
+    return;
+
+  BOOST_LOG_TRIVIAL(info) << (drained ? "drained" : "drain deadline passed");
+  m_drain_done = true;
+  // handled by wait_exit_message like an external stop
+  m_message_queue.SendExitMessage();
 }
 
 void WebsocketServer::wait_exit_message() {
-  if (m_message_queue.WaitExitMessage()){
+  control_message msg;
+  bool exit = false;
+  while (!exit && m_message_queue.WaitMessage(msg))
+  {
+    if (msg.command == MQ_DRAIN)
+    {
+      BOOST_LOG_TRIVIAL(info) << "receive drain message";
+      {
+        lock_guard<mutex> guard(m_action_lock);
+        m_actions.push_control(action(DRAIN, msg.arg));
+      }
+      m_action_cond.notify_one();
+    }
+    else if (msg.command == MQ_HANDOFF)
+    {
+      // the new process accepts on them from now on and sends MQ_DRAIN
+      listen_fds fds;
+      fds.plain = m_listener_plain.native_handle();
+      fds.tls = m_listener_tls.native_handle();
+      if (SendListenSockets(fds))
+        m_message_queue.Disown();
+    }
+    else if (msg.command == MQ_EXIT)
+      exit = true;
+    else
+    {
+      BOOST_LOG_TRIVIAL(info) << "receive control message " << msg.command;
+      auto request = std::make_shared<control_request>();
+      request->msg = msg;
+      std::future<std::string> reply = request->reply.get_future();
+      {
+        lock_guard<mutex> guard(m_action_lock);
+        m_actions.push_control(action(CONTROL, request));
+      }
+      m_action_cond.notify_one();
+      if (msg.reply_to != 0
+          && reply.wait_for(std::chrono::milliseconds(kControlReplyWait))
+             == std::future_status::ready)
+        MessageQueue::Reply(msg, reply.get());
+    }
+  }
+
+  if (exit){
     BOOST_LOG_TRIVIAL(info) << "receive exit message";
     m_mutex_exit.notify();
     m_server_plain.stop();
     m_server_tls.stop();
     {
       lock_guard<mutex> guard(m_action_lock);
-      m_actions.push(action(EXIT, connection_hdl()));
+      m_actions.push_control(action(EXIT, 0));
     }
     m_action_cond.notify_one();
   } else {
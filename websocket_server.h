@@ -4,11 +4,20 @@
 
 #include <websocketpp/server.hpp>
 
+#include <deque>
+#include <future>
 #include <iostream>
-#include <set>
+#include <vector>
 
 #include <websocketpp/common/thread.hpp>
+#include "connection_slots.h"
+#include "fair_queue.h"
+#include "handoff.h"
+#include "listener.h"
+#include "message_pool.h"
 #include "message_queue.h"
+#include "server_stats.h"
+#include "small_block.h"
 
 
 using websocketpp::connection_hdl;
@@ -32,9 +41,62 @@ enum action_type {
   TLS_SUBSCRIBE,
   UNSUBSCRIBE,
   MESSAGE,
+  WAKEUP,
+  TICK,
+  CONTROL,
+  DRAIN,
   EXIT
 };
 
+// what Send does once a connection's outbound queue is full
+enum slow_consumer_policy {
+  DROP_OLDEST,      // drop the oldest droppable frame, close if none is left
+  COALESCE,         // a frame replaces a queued one with its coalesce key,
+                    // otherwise as DROP_OLDEST
+  CLOSE_CONNECTION  // close with close_code
+};
+
+/* Frames go straight to websocketpp while its buffered amount for the
+ * connection stays under buffer_bytes. Past that they wait in a queue of at
+ * most queue_frames / queue_bytes that is flushed as the socket drains.
+ * global_bytes caps what all connections together hold in both.
+ */
+struct outbound_limits {
+  size_t buffer_bytes = 256 * 1024;
+  size_t queue_frames = 256;
+  size_t queue_bytes = 1024 * 1024;
+  size_t global_bytes = 256 * 1024 * 1024;
+  slow_consumer_policy policy = DROP_OLDEST;
+  uint16_t close_code = websocketpp::close::status::try_again_later;
+};
+
+extern outbound_limits g_outbound_limits;
+
+// inbound frames waiting for the dispatch thread, see fair_queue
+struct dispatch_limits {
+  size_t queue_frames = 256; // per connection
+  size_t quantum = 4096;     // payload bytes per connection and turn
+  size_t control_frames = 4; // sign in/out and resume per connection
+};
+
+extern dispatch_limits g_dispatch_limits;
+
+// socket options of the two listeners
+struct listen_options {
+  socket_options plain;
+  socket_options tls;
+};
+
+extern listen_options g_listen_options;
+
+struct send_options {
+  send_options(bool d = false, uint32_t key = 0)
+    : droppable(d), coalesce_key(key) {}
+
+  bool droppable;        // may be dropped when the queue is full
+  uint32_t coalesce_key; // non zero, a newer frame with the key replaces it
+};
+
 class condition_mutex {
 public:
   bool wait(int time) {
@@ -57,59 +119,273 @@ protected:
   bool ready_ = false;
 };
 
-typedef websocketpp::server<websocketpp::config::asio> server_plain;
-typedef websocketpp::server<websocketpp::config::asio_tls> server_tls;
+/* websocketpp's asio configs trimmed for many idle connections. The read
+ * buffer is an array inside every connection, 4KB instead of 16KB; larger
+ * frames just take more reads. Message payloads come from message_pool, the
+ * caps only keep one peer from making them large.
+ */
+typedef websocketpp::message_buffer::message<recycling_msg_manager>
+  pooled_message;
+
+struct lean_asio_config : public websocketpp::config::asio {
+  typedef lean_asio_config type;
+  typedef pooled_message message_type;
+  typedef recycling_msg_manager<message_type> con_msg_manager_type;
+  typedef websocketpp::message_buffer::alloc::endpoint_msg_manager<
+    con_msg_manager_type> endpoint_msg_manager_type;
+  static const size_t connection_read_buffer_size = 4096;
+  static const size_t max_message_size = 1024 * 1024;
+  static const size_t max_http_body_size = 64 * 1024;
+};
+
+struct lean_asio_tls_config : public websocketpp::config::asio_tls {
+  typedef lean_asio_tls_config type;
+  typedef pooled_message message_type;
+  typedef recycling_msg_manager<message_type> con_msg_manager_type;
+  typedef websocketpp::message_buffer::alloc::endpoint_msg_manager<
+    con_msg_manager_type> endpoint_msg_manager_type;
+  static const size_t connection_read_buffer_size = 4096;
+  static const size_t max_message_size = 1024 * 1024;
+  static const size_t max_http_body_size = 64 * 1024;
+};
+
+typedef websocketpp::server<lean_asio_config> server_plain;
+typedef websocketpp::server<lean_asio_tls_config> server_tls;
 class WebsocketServer {
 public:
   typedef server_plain::message_ptr message_ptr;
 
+  // a control command: the dispatch thread writes the reply, the control
+  // thread sends it to the waiting client
+  struct control_request {
+    control_message msg;
+    std::promise<std::string> reply;
+  };
+
   struct action {
-  action(action_type t, connection_hdl h) : type(t), hdl(h) {}
-  action(action_type t, connection_hdl h, message_ptr m)
-    : type(t), hdl(h), msg(m) {}
+  action(action_type t, connection_id i) : type(t), id(i) {}
+  action(action_type t, connection_id i, connection_hdl h)
+    : type(t), id(i), hdl(h) {}
+  action(action_type t, connection_id i, message_ptr m)
+    : type(t), id(i), msg(m) {}
+  action(action_type t, int a) : type(t), arg(a) {}
+  action(action_type t, std::shared_ptr<control_request> c)
+    : type(t), control(c) {}
 
   action_type type;
-  websocketpp::connection_hdl hdl;
+  connection_id id = 0;
+  websocketpp::connection_hdl hdl; // SUBSCRIBE and TLS_SUBSCRIBE only
   message_ptr msg;
+  int arg = 0;
+  std::shared_ptr<control_request> control;
+  std::chrono::steady_clock::time_point received;
 };
-  WebsocketServer();
+  // queue_name: control queue, see MessageQueue
+  explicit WebsocketServer(const char* queue_name = nullptr);
+  // accept on listening sockets taken over from another process instead of
+  // binding the ports given to Listen
+  void Inherit(const listen_fds& fds);
   void Listen(int port,int port_tls=0);
+  // bind the ports with SO_REUSEPORT
+  void SetReusePort(bool value);
+  // frames longer than bytes close their connection with "message too big"
+  void SetMaxMessageSize(size_t bytes);
+  // OnWakeup runs on the dispatch thread whenever the eventfd fd is signaled
+  void WatchWakeup(int fd);
+
+  // Connections are known by their connection_id from on_open to OnClose.
+  // The calls taking one are for the dispatch thread or others holding
+  // m_connection_lock.
+
+  // false if id is gone or was closed as a slow consumer
+  bool Send(void* data, int len, connection_id id);
+  bool Send(const std::string& text, connection_id id,
+            const send_options& options = send_options());
+  // a frame from MakeFrame, the same buffer goes to every connection
+  bool Send(const message_ptr& frame, connection_id id,
+            const send_options& options = send_options());
+  // text framed once, for Send to any number of connections
+  message_ptr MakeFrame(const std::string& text);
+
+  bool Close(connection_id id, websocketpp::close::status::value code,
+             const std::string& reason);
 
-  bool Send(void* data, int len,connection_hdl hdl);
-  bool Send(const std::string& text,connection_hdl hdl);
+  // bytes buffered in websocketpp plus queued for id
+  size_t BufferedAmount(connection_id id);
+  // bytes held for all connections, frames dropped, connections closed
+  size_t OutboundBytes();
+  uint64_t OutboundDropped();
+  uint64_t OutboundClosed();
+  // g_dispatch_limits to the queue of the dispatch thread, after a reload
+  void ApplyDispatchLimits();
+  // arrival of the frame OnReceive is handling
+  std::chrono::steady_clock::time_point ReceivedAt() const { return m_received; }
 
   void Broadcast(const std::string& text);
   void Broadcast(void* data, int len);
-  virtual void OnReceive(connection_hdl hdl, const std::string& message) = 0;
-  virtual void OnClose(connection_hdl) = 0;
+  // msg stays alive for the whole call, so implementations may parse its
+  // payload in place and keep views into it until they return.
+  virtual void OnReceive(connection_id id, message_ptr msg) = 0;
+  virtual void OnClose(connection_id id) = 0;
+  // called on the asio thread, true to dispatch msg ahead of bulk traffic
+  virtual bool IsControl(const message_ptr& msg) { return false; }
+  // drain started: no new connections, exit in deadline ms at the latest.
+  // Called without m_connection_lock, unlike the other handlers.
+  virtual void OnDrain(int deadline) {}
+  // true once a drain has nothing left to wait for
+  virtual bool Drained() { return true; }
+  virtual void OnWakeup() {}
+  // on the dispatch thread after every ping round, for housekeeping
+  virtual void OnTick() {}
+  // on the dispatch thread between actions; when the work it holds back is
+  // due, the dispatch thread comes back by then. max() if nothing waits.
+  virtual std::chrono::steady_clock::time_point OnFlush()
+  {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  // a control command (see message_command) on the dispatch thread, what is
+  // written to reply goes back to the -c command that sent it
+  virtual void OnControl(const control_message& msg, std::ostream& reply);
 protected:
   void run(uint16_t port,uint16_t port_tls);
 
   void on_open(connection_hdl hdl);
   void on_open_tls(connection_hdl hdl);
+  void on_fail_tls(connection_hdl hdl);
+  // claims con's id and binds its remaining handlers to it
+  template <typename connection_ptr>
+  connection_id attach(const connection_ptr& con);
+
+  void on_close(connection_id id);
 
-  void on_close(connection_hdl hdl);
+  void on_message(connection_id id, message_ptr msg);
 
-  void on_message(connection_hdl hdl, server_plain::message_ptr msg);
+  void on_pong_timeout(connection_id id, std::string s);
 
-  void on_pong_timeout(connection_hdl hdl, std::string s);
+  typedef websocketpp::lib::shared_ptr<boost::asio::ssl::context> context_ptr;
+  // the context of every tls connection, built once and on reload
+  context_ptr tls_context(connection_hdl hdl);
+  bool reload_tls_context();
 
   void process_messages();
 
+  struct outbound_frame {
+    outbound_frame(const std::string& d, websocketpp::frame::opcode::value op,
+                   const send_options& o)
+      : data(d), opcode(op), options(o) {}
+    outbound_frame(const message_ptr& m, websocketpp::frame::opcode::value op,
+                   const send_options& o)
+      : msg(m), opcode(op), options(o) {}
+
+    size_t size() const { return msg ? msg->get_payload().size() : data.size(); }
+
+    std::string data;
+    message_ptr msg;      // a frame shared with other connections, or data
+    websocketpp::frame::opcode::value opcode;
+    send_options options;
+  };
+
+  // made and freed with every burst of frames, so from small_block_pool
+  struct outbound {
+    explicit outbound(bool t) : tls(t) {}
+
+    static void* operator new(size_t size) {
+      return small_block_pool::allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+      small_block_pool::deallocate(p, size);
+    }
+
+    bool tls;
+    std::deque<outbound_frame, small_block_allocator<outbound_frame> > frames;
+    size_t bytes = 0;     // queued in frames
+    size_t buffered = 0;  // websocketpp's buffered amount when last read
+    bool closing = false;
+    size_t listed = 0;    // its index in m_outbound_slots
+  };
+
+  struct connection_record;
+
+  // payload is a std::string or a message_ptr from MakeFrame
+  template <typename payload>
+  bool send_frame(const payload& data,
+                  websocketpp::frame::opcode::value opcode,
+                  connection_id id, const send_options& options);
+  bool send_now(const std::string& data,
+                websocketpp::frame::opcode::value opcode,
+                connection_record& record);
+  bool send_now(const message_ptr& msg,
+                websocketpp::frame::opcode::value opcode,
+                connection_record& record);
+  size_t read_buffered(connection_record& record, outbound& out);
+  void flush(connection_record& record, outbound& out);
+  void flush_outbound();
+  // OnFlush under m_connection_lock
+  void flush_deferred();
+  bool make_room(connection_record& record, outbound& out);
+  void close_slow(connection_record& record, outbound& out);
+  // the outbound state of record, made and listed if it has none
+  outbound& make_outbound(connection_record& record);
+  // frees and unlists it, under m_outbound_lock
+  void drop_outbound(connection_record& record);
+  void erase_outbound(connection_record& record);
+  bool outbound_pending();
+  // the record of an open connection, null once id is closed
+  connection_record* find_connection(connection_id id);
+
+  void wait_wakeup();
+
+  void start_drain(int deadline);
+  void check_drain();
+
   void loop_ping();
 
   void wait_exit_message();
 
+  boost::asio::io_service m_ios;
   server_plain m_server_plain;
   server_tls m_server_tls;
+  listener<server_plain> m_listener_plain;
+  listener<server_tls> m_listener_tls;
+  listen_fds m_inherited;
+  std::unique_ptr<boost::asio::posix::stream_descriptor> m_wakeup;
+  uint64_t m_wakeup_count;
+  context_ptr m_tls_context;
+  mutex m_tls_lock;
 
 protected:
-  typedef std::set<connection_hdl, std::owner_less<connection_hdl> > con_list;
+  // all the server keeps for an open connection, in m_connections at its
+  // slot. Holding the connection saves locking a connection_hdl per send.
+  struct connection_record {
+    connection_id id = 0; // 0 while the slot is free
+    bool tls = false;
+    server_plain::connection_ptr plain;
+    server_tls::connection_ptr secure;
+    // only while frames are queued or buffered, guarded by m_outbound_lock
+    std::unique_ptr<outbound> out;
+  };
 
   bool m_exit_signal;
-  con_list m_con_list_plain;
-  con_list m_con_list_tls;
-  std::queue<action> m_actions;
+  bool m_draining;
+  bool m_drain_done;
+  std::chrono::steady_clock::time_point m_drain_deadline;
+  connection_slots m_slots;
+  // indexed by connection slot, guarded by m_connection_lock
+  std::vector<connection_record> m_connections;
+  size_t m_connection_count;
+  fair_queue<action, connection_id> m_actions;
+
+  // slots of the connections that have outbound state, in no order, so a
+  // flush visits those and not every connection; guarded by m_outbound_lock
+  std::vector<uint32_t> m_outbound_slots;
+  size_t m_outbound_bytes;
+  uint64_t m_outbound_dropped;
+  uint64_t m_outbound_closed;
+  std::chrono::steady_clock::time_point m_last_flush;
+  // what OnFlush returned last
+  std::chrono::steady_clock::time_point m_flush_at;
+  std::chrono::steady_clock::time_point m_received;
+  mutex m_outbound_lock;
 
   mutex m_action_lock;
   mutex m_connection_lock;
@@ -117,5 +393,4 @@ protected:
 
   condition_mutex m_mutex_exit;
   MessageQueue m_message_queue;
-  boost::asio::io_service m_ios;
 };
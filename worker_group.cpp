@@ -0,0 +1,342 @@
+#include "worker_group.h"
+#include "message_queue.h"
+#include <boost/interprocess/anonymous_shared_memory.hpp>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory atomics must be lock free");
+
+namespace {
+  const int32_t kFree = -1;
+  const int32_t kClaiming = -2;
+  // Relay::to of the filler record at the end of a ring
+  const int32_t kPad = INT32_MIN;
+  const size_t kHeaderBytes = 64;
+
+  size_t Align(size_t n, size_t a) { return (n + a - 1) & ~(a - 1); }
+
+  size_t RecordSize(uint32_t size)
+  {
+    return Align(sizeof(WorkerGroup::Relay) + size, sizeof(WorkerGroup::Relay));
+  }
+}
+
+// name is guarded by a sequence lock: seq is odd while a claim writes it,
+// a reader copies it and retries if seq changed meanwhile
+struct WorkerGroup::Entry
+{
+  std::atomic<int32_t> owner;
+  std::atomic<uint32_t> seq;
+  char name[kNameSize];
+};
+
+struct WorkerGroup::Ring
+{
+  alignas(64) std::atomic<uint64_t> head; // written by the producer only
+  alignas(64) std::atomic<uint64_t> tail; // written by the consumer only
+  alignas(64) char data[kRingBytes];
+};
+
+WorkerGroup::WorkerGroup(int workers, int peers)
+  : m_workers(std::min(std::max(workers, 1), kMaxWorkers)),
+    m_peers(std::max(peers, 1)), m_self(-1)
+{
+  size_t entries = Align(static_cast<size_t>(m_peers) * sizeof(Entry), 64);
+  size_t rings = static_cast<size_t>(m_workers) * m_workers * sizeof(Ring);
+  m_region = boost::interprocess::anonymous_shared_memory(
+    kHeaderBytes + entries + rings);
+
+  char* base = static_cast<char*>(m_region.get_address());
+  m_next_id = new (base) std::atomic<uint32_t>(0);
+  m_entries = base + kHeaderBytes;
+  m_rings = m_entries + entries;
+  for (int id = 0; id < m_peers; ++id)
+  {
+    new (&EntryAt(id).owner) std::atomic<int32_t>(kFree);
+    new (&EntryAt(id).seq) std::atomic<uint32_t>(0);
+  }
+  for (int from = 0; from < m_workers; ++from)
+  {
+    for (int to = 0; to < m_workers; ++to)
+    {
+      new (&RingAt(from, to).head) std::atomic<uint64_t>(0);
+      new (&RingAt(from, to).tail) std::atomic<uint64_t>(0);
+    }
+  }
+
+  for (int i = 0; i < m_workers; ++i)
+    m_wakeup.push_back(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+}
+
+WorkerGroup::~WorkerGroup()
+{
+  for (int fd : m_wakeup)
+    ::close(fd);
+}
+
+std::string WorkerGroup::QueueName(int index)
+{
+  return "message_queue_signal_server_" + std::to_string(index);
+}
+
+int WorkerGroup::Run(const std::function<int(int)>& run)
+{
+  MessageQueue control(true);
+  std::vector<pid_t> pids(m_workers, -1);
+  int alive = 0;
+  for (int i = 0; i < m_workers; ++i)
+  {
+    pids[i] = Spawn(i, run);
+    if (pids[i] > 0)
+      ++alive;
+  }
+
+  // exit and drain end the workers for good, the others are passed on
+  std::atomic<bool> stopping(false);
+  std::atomic<bool> finished(false);
+  std::thread forward([&]() {
+    control_message msg;
+    while (control.WaitMessage(msg) && !finished)
+    {
+      if (msg.command == MQ_HANDOFF)
+      {
+        BOOST_LOG_TRIVIAL(warning) << "handoff is not supported with workers";
+        MessageQueue::Reply(msg, "handoff is not supported with workers\n");
+        continue;
+      }
+      if (msg.command == MQ_EXIT || msg.command == MQ_DRAIN)
+        stopping = true;
+      // every worker answers a request on its own
+      for (int i = 0; i < m_workers; ++i)
+        MessageQueue(false, QueueName(i).c_str()).SendMessage(msg);
+      if (msg.command == MQ_EXIT)
+        return;
+    }
+  });
+
+  while (alive > 0)
+  {
+    int status = 0;
+    pid_t pid = ::waitpid(-1, &status, 0);
+    if (pid < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    auto it = std::find(pids.begin(), pids.end(), pid);
+    if (it == pids.end())
+      continue;
+    int index = static_cast<int>(it - pids.begin());
+    ReleaseWorker(index);
+    bool died = WIFSIGNALED(status)
+      || (WIFEXITED(status) && WEXITSTATUS(status) != 0);
+    if (stopping || !died)
+    {
+      BOOST_LOG_TRIVIAL(info) << "worker " << index << " exit";
+      *it = -1;
+      --alive;
+      continue;
+    }
+    BOOST_LOG_TRIVIAL(warning) << "worker " << index << " died, status "
+                               << status << ", restarting";
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    *it = Spawn(index, run);
+    if (*it < 0)
+      --alive;
+  }
+
+  finished = true;
+  control.SendExitMessage();
+  forward.join();
+  return 0;
+}
+
+int WorkerGroup::WakeupFd() const
+{
+  return m_self < 0 ? -1 : m_wakeup[m_self];
+}
+
+int WorkerGroup::Claim(const std::string& name)
+{
+  for (int n = 0; n < m_peers; ++n)
+  {
+    int id = static_cast<int>(m_next_id->fetch_add(1, std::memory_order_relaxed)
+                              % m_peers);
+    Entry& entry = EntryAt(id);
+    int32_t expected = kFree;
+    if (!entry.owner.compare_exchange_strong(expected, kClaiming,
+                                             std::memory_order_acquire))
+      continue;
+    uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+    entry.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    size_t size = std::min(name.size(), kNameSize - 1);
+    std::memcpy(entry.name, name.data(), size);
+    entry.name[size] = '\0';
+    entry.seq.store(seq + 2, std::memory_order_release);
+    entry.owner.store(m_self, std::memory_order_release);
+    return id;
+  }
+  return -1;
+}
+
+void WorkerGroup::Release(int id)
+{
+  if (id < 0 || id >= m_peers)
+    return;
+  int32_t expected = m_self;
+  EntryAt(id).owner.compare_exchange_strong(expected, kFree,
+                                            std::memory_order_release);
+}
+
+int WorkerGroup::Owner(int id) const
+{
+  if (id < 0 || id >= m_peers)
+    return -1;
+  int owner = EntryAt(id).owner.load(std::memory_order_acquire);
+  return owner < 0 ? -1 : owner;
+}
+
+int WorkerGroup::Find(const std::string& name) const
+{
+  std::string key = name.substr(0, kNameSize - 1);
+  int found = -1;
+  ForEach([&](int id, const char* peer) {
+    if (found < 0 && key == peer)
+      found = id;
+  });
+  return found;
+}
+
+void WorkerGroup::ForEach(const Visit& visit) const
+{
+  char name[kNameSize];
+  for (int id = 0; id < m_peers; ++id)
+  {
+    if (ReadName(id, name))
+      visit(id, name);
+  }
+}
+
+bool WorkerGroup::Post(int worker, const Relay& relay, const char* text)
+{
+  Ring& ring = RingAt(m_self, worker);
+  if (relay.size > kMaxFrame)
+    return false;
+  uint64_t size = RecordSize(relay.size);
+
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  uint64_t tail = ring.tail.load(std::memory_order_acquire);
+  size_t pos = head % kRingBytes;
+  // a record never wraps, the end of the ring is skipped instead
+  uint64_t pad = kRingBytes - pos < size ? kRingBytes - pos : 0;
+  if (head + pad + size - tail > kRingBytes)
+    return false;
+  if (pad != 0)
+  {
+    reinterpret_cast<Relay*>(ring.data + pos)->to = kPad;
+    head += pad;
+    pos = 0;
+  }
+  std::memcpy(ring.data + pos, &relay, sizeof(Relay));
+  std::memcpy(ring.data + pos + sizeof(Relay), text, relay.size);
+  ring.head.store(head + size, std::memory_order_release);
+
+  uint64_t one = 1;
+  if (::write(m_wakeup[worker], &one, sizeof(one)) < 0 && errno != EAGAIN)
+    BOOST_LOG_TRIVIAL(error) << "wake worker " << worker << ": "
+                             << std::strerror(errno);
+  return true;
+}
+
+size_t WorkerGroup::Drain(const Deliver& deliver)
+{
+  size_t count = 0;
+  for (int from = 0; from < m_workers; ++from)
+  {
+    if (from == m_self)
+      continue;
+    Ring& ring = RingAt(from, m_self);
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    uint64_t head = ring.head.load(std::memory_order_acquire);
+    while (tail != head)
+    {
+      size_t pos = tail % kRingBytes;
+      const Relay& relay = *reinterpret_cast<const Relay*>(ring.data + pos);
+      if (relay.to == kPad)
+      {
+        tail += kRingBytes - pos;
+        continue;
+      }
+      deliver(relay, ring.data + pos + sizeof(Relay));
+      tail += RecordSize(relay.size);
+      ++count;
+    }
+    ring.tail.store(tail, std::memory_order_release);
+  }
+  return count;
+}
+
+WorkerGroup::Entry& WorkerGroup::EntryAt(int id) const
+{
+  return reinterpret_cast<Entry*>(m_entries)[id];
+}
+
+bool WorkerGroup::ReadName(int id, char* name) const
+{
+  const Entry& entry = EntryAt(id);
+  while (true)
+  {
+    uint32_t seq = entry.seq.load(std::memory_order_acquire);
+    // odd: being claimed, it has no peer yet
+    if ((seq & 1) != 0 || entry.owner.load(std::memory_order_acquire) < 0)
+      return false;
+    std::memcpy(name, entry.name, kNameSize);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.seq.load(std::memory_order_relaxed) == seq)
+    {
+      name[kNameSize - 1] = '\0';
+      return true;
+    }
+  }
+}
+
+WorkerGroup::Ring& WorkerGroup::RingAt(int from, int to) const
+{
+  return reinterpret_cast<Ring*>(m_rings)[from * m_workers + to];
+}
+
+void WorkerGroup::ReleaseWorker(int worker)
+{
+  for (int id = 0; id < m_peers; ++id)
+  {
+    int32_t expected = worker;
+    EntryAt(id).owner.compare_exchange_strong(expected, kFree,
+                                              std::memory_order_relaxed);
+  }
+}
+
+pid_t WorkerGroup::Spawn(int index, const std::function<int(int)>& run)
+{
+  pid_t pid = ::fork();
+  if (pid == 0)
+  {
+    m_self = index;
+    ::_exit(run(index));
+  }
+  if (pid < 0)
+    BOOST_LOG_TRIVIAL(error) << "fork worker " << index << ": "
+                             << std::strerror(errno);
+  else
+    BOOST_LOG_TRIVIAL(info) << "worker " << index << " pid " << pid;
+  return pid;
+}
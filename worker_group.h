@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <boost/interprocess/mapped_region.hpp>
+
+/* Worker processes sharing one port through SO_REUSEPORT.
+ *
+ * The group is created before the workers are forked and lives in anonymous
+ * shared memory that every worker inherits:
+ *  - a peer directory, peer id -> owning worker and name, so ids are unique
+ *    across workers and any worker can find where a peer is connected. It
+ *    has a fixed number of entries, 72 bytes each, set at start ("worker_peers"
+ *    in config.json); a sign in past them is refused;
+ *  - one single producer, single consumer ring per (from, to) worker pair
+ *    carrying relayed frames, plus an eventfd per worker to wake it up.
+ * Nothing in it is guarded by a lock, so a worker that dies holds up no one;
+ * the parent releases its peers and forks a new one.
+ */
+
+class WorkerGroup
+{
+public:
+  static constexpr int kMaxWorkers = 64;
+  static constexpr int kDefaultPeers = 1 << 19; // directory entries
+  static constexpr size_t kNameSize = 64;     // longer names are cut
+  static constexpr size_t kRingBytes = 256 * 1024;
+
+  // a frame relayed to peer "to" of another worker
+  struct Relay
+  {
+    int32_t to;
+    int32_t from;
+    int32_t type;
+    uint32_t size;
+  };
+
+  // the largest frame Post carries; workers refuse longer ones at their
+  // endpoints, so whether a frame goes through does not depend on where
+  // its peer is connected
+  static constexpr size_t kMaxFrame = kRingBytes / 2 - sizeof(Relay);
+
+  typedef std::function<void(const Relay&, const char* text)> Deliver;
+  typedef std::function<void(int id, const char* name)> Visit;
+
+  // call before forking the workers, ids are 0 .. peers - 1
+  WorkerGroup(int workers, int peers);
+  ~WorkerGroup();
+
+  // control queue name of worker index
+  static std::string QueueName(int index);
+
+  // forks the workers running run(index), forks a new one whenever one dies
+  // (a signal or non zero status), and forwards control commands to them
+  // until they have all exited
+  int Run(const std::function<int(int)>& run);
+
+  int Workers() const { return m_workers; }
+  int Peers() const { return m_peers; }
+  // the worker this process is, -1 in the parent
+  int Self() const { return m_self; }
+  // readable when relays for Self() are waiting
+  int WakeupFd() const;
+
+  // a free id owned by Self(), -1 if there is none
+  int Claim(const std::string& name);
+  void Release(int id);
+  // worker owning id, -1 if no peer has it
+  int Owner(int id) const;
+  // a peer named name, -1 if there is none
+  int Find(const std::string& name) const;
+  void ForEach(const Visit& visit) const;
+
+  // false if the ring to worker is full or the frame is longer than
+  // kMaxFrame, the frame is dropped
+  bool Post(int worker, const Relay& relay, const char* text);
+  // hands every relay waiting for Self() to deliver, returns how many
+  size_t Drain(const Deliver& deliver);
+
+private:
+  struct Entry;
+  struct Ring;
+
+  Entry& EntryAt(int id) const;
+  // copies the name of id into name, false if no peer has id
+  bool ReadName(int id, char* name) const;
+  Ring& RingAt(int from, int to) const;
+  void ReleaseWorker(int worker);
+  pid_t Spawn(int index, const std::function<int(int)>& run);
+
+  int m_workers;
+  int m_peers;
+  int m_self;
+  boost::interprocess::mapped_region m_region;
+  std::atomic<uint32_t>* m_next_id;
+  char* m_entries;
+  char* m_rings;
+  std::vector<int> m_wakeup;
+};